@@ -0,0 +1,643 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+
+// Headless load generator for chatserver
+// Opens N logged in connections from one event loop, sends chat traffic at a
+// fixed rate and measures how long every message takes to reach every receiver.
+
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_RATE        1000             // Messages per second, all senders together
+#define DEFAULT_DURATION    10               // Seconds of traffic after every client has logged in
+#define DEFAULT_SIZE        64               // Bytes of text in each SENDMSG message
+#define DEFAULT_PASSCODE    "cs3251secret"
+#define MAX_CONNECTING      64               // Logins in flight at once
+#define MAX_EVENTS          256
+#define CONNECT_TIMEOUT_MS  30000            // Give up on the connect phase after this long
+#define DRAIN_MS            1000             // Keep receiving this long after the last send
+#define HAPPY_RING          1024             // HAPPY messages a sender can have in flight
+
+#define TIMESTAMP_TAG 'B'                    // First byte of a benchmark SENDMSG text, followed by the send time
+
+// Connection states
+#define BENCH_IDLE       0   // Not connected (not started yet, failed or left during churn)
+#define BENCH_CONNECTING 1   // TCP handshake in progress
+#define BENCH_LOGIN      2   // Login request sent, waiting for AUTHORIZED
+#define BENCH_ACTIVE     3   // Logged in
+
+// Long-only command line options
+#define OPT_SENDERS 256
+#define OPT_SIZE    257
+#define OPT_HAPPY   258
+#define OPT_CHURN   259
+
+// Latency histogram with roughly 3% resolution over the full 64 bit range
+// Values below HIST_SUB get a bucket each, every power of two above is split into HIST_SUB buckets
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+typedef struct {
+  unsigned long long counts[HIST_BUCKETS];
+  unsigned long long total;
+  uint64_t max;
+} hist_t;
+
+// One benchmark connection
+typedef struct {
+  int sock;
+  int state;
+  int uid;                             // Id assigned by the server at login
+  char name[USERNAME_LENGTH];
+  long long login_start;               // When the current connect attempt started (ns)
+  struct frame_reader reader;
+  char *out;                           // Bytes the socket has not accepted yet
+  size_t out_len, out_cap;
+  uint32_t events;                     // Events epoll is watching for
+  long long happy_sent[HAPPY_RING];    // Send times of HAPPY messages waiting for their echo
+  unsigned happy_head, happy_count;
+} bench_conn_t;
+
+/* Global variables */
+
+bench_conn_t *conns;
+int num_conns = DEFAULT_CONNECTIONS;
+int num_senders = 0;                   // 0 means every connection sends
+int epoll_fd;
+struct sockaddr_in serv_addr;
+char passcode[PASSWORD_LENGTH] = DEFAULT_PASSCODE;
+
+// Traffic settings
+double rate = DEFAULT_RATE;
+int duration = DEFAULT_DURATION;
+int msg_size = DEFAULT_SIZE;
+int happy_pct = 0;
+double churn_rate = 0;
+
+// Results
+hist_t login_hist, fanout_hist, echo_hist;
+unsigned long long logins_ok, logins_failed, disconnects;
+unsigned long long sent_msgs, sent_happy, joins, leaves;
+unsigned long long delivered, happy_delivered, expected;
+int active_count;
+
+// Returns a monotonic timestamp in nanoseconds
+long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* histogram methods */
+
+// Returns the bucket a value falls in
+unsigned hist_index(uint64_t v)
+{
+  if (v < HIST_SUB)
+    return (unsigned)v;
+
+  int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+  return (unsigned)((shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1)));
+}
+
+// Returns the largest value that falls in a bucket
+uint64_t hist_upper(unsigned idx)
+{
+  if (idx < HIST_SUB)
+    return idx;
+
+  unsigned shift = idx / HIST_SUB - 1;
+  uint64_t sub = idx % HIST_SUB;
+  return ((HIST_SUB + sub + 1) << shift) - 1;
+}
+
+// Adds a latency sample (nanoseconds) to a histogram, stored in microseconds
+void hist_record(hist_t *h, long long ns)
+{
+  uint64_t us = ns > 0 ? (uint64_t)ns / 1000 : 0;
+
+  h->counts[hist_index(us)]++;
+  h->total++;
+  if (us > h->max)
+    h->max = us;
+}
+
+// Returns the value (microseconds) below which the given fraction of samples fall
+uint64_t hist_percentile(const hist_t *h, double p)
+{
+  unsigned long long rank = (unsigned long long)(p * h->total);
+  unsigned long long seen = 0;
+
+  if (rank >= h->total)
+    rank = h->total - 1;
+  for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > rank)
+      return hist_upper(i) < h->max ? hist_upper(i) : h->max;
+  }
+  return h->max;
+}
+
+// Prints a histogram's percentiles
+void hist_print(const char *label, const hist_t *h)
+{
+  if (h->total == 0) {
+    printf("%-18s no samples\n", label);
+    return;
+  }
+  printf("%-18s p50 %llu us  p99 %llu us  p999 %llu us  max %llu us  (%llu samples)\n", label,
+         (unsigned long long)hist_percentile(h, 0.50), (unsigned long long)hist_percentile(h, 0.99),
+         (unsigned long long)hist_percentile(h, 0.999), (unsigned long long)h->max, h->total);
+}
+
+/* connection methods */
+
+// Sets the events epoll watches for on a connection
+void watch(bench_conn_t *c, uint32_t events)
+{
+  if (events == c->events)
+    return;
+
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = c;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->sock, &ev) == 0)
+    c->events = events;
+}
+
+// Closes a connection and returns it to the idle state
+void close_conn(bench_conn_t *c)
+{
+  if (c->state == BENCH_ACTIVE)
+    active_count--;
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->sock, NULL);
+  close(c->sock);
+  frame_reader_free(&c->reader);
+  c->out_len = 0;
+  c->happy_count = 0;
+  c->state = BENCH_IDLE;
+}
+
+// Writes as much of the connection's pending bytes as the socket accepts
+void flush_conn(bench_conn_t *c)
+{
+  size_t sent = 0;
+
+  while (sent < c->out_len) {
+    ssize_t n = send(c->sock, c->out + sent, c->out_len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      disconnects++;
+      close_conn(c);
+      return;
+    }
+    sent += n;
+  }
+
+  memmove(c->out, c->out + sent, c->out_len - sent);
+  c->out_len -= sent;
+  watch(c, EPOLLIN | (c->out_len > 0 ? EPOLLOUT : 0));
+}
+
+// Encodes a frame and sends it, buffering whatever the socket does not take right away
+void send_frame(bench_conn_t *c, int type, const char *name, const char *data, size_t data_len)
+{
+  size_t name_len = name ? strlen(name) : 0;
+  size_t len = frame_length(name_len, data_len);
+
+  if (c->out_cap - c->out_len < len) {
+    size_t cap = c->out_cap ? c->out_cap : 4096;
+    while (cap - c->out_len < len)
+      cap *= 2;
+    char *out = realloc(c->out, cap);
+    if (out == NULL) {
+      printf("Out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    c->out = out;
+    c->out_cap = cap;
+  }
+
+  c->out_len += frame_encode(c->out + c->out_len, type, c->uid, name, name_len, data, data_len);
+  if (c->out_len == len)
+    flush_conn(c);  // nothing was queued ahead of this frame
+}
+
+// Starts a non-blocking connect for an idle connection
+void start_conn(bench_conn_t *c)
+{
+  c->login_start = now_ns();
+  c->uid = 0;
+  c->events = EPOLLOUT;
+
+  if ((c->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+    logins_failed++;
+    return;
+  }
+  if (connect(c->sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 && errno != EINPROGRESS) {
+    close(c->sock);
+    logins_failed++;
+    return;
+  }
+
+  struct epoll_event ev;
+  ev.events = c->events;
+  ev.data.ptr = c;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->sock, &ev);
+  c->state = BENCH_CONNECTING;
+}
+
+// Finishes the TCP handshake and sends the login request
+// The server reads it once it has sent ACCEPTED
+void conn_established(bench_conn_t *c)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+    logins_failed++;
+    close_conn(c);
+    return;
+  }
+
+  c->state = BENCH_LOGIN;
+  watch(c, EPOLLIN);
+  send_frame(c, LOGIN_COMMAND, c->name, passcode, strlen(passcode));
+}
+
+// Handles a frame received while logging in
+void handle_login_frame(bench_conn_t *c, struct frame *f)
+{
+  switch (f->hdr.type) {
+    case ACCEPTED:
+      break;
+    case AUTHORIZED:
+      c->uid = (int)f->hdr.uid;
+      c->state = BENCH_ACTIVE;
+      active_count++;
+      logins_ok++;
+      hist_record(&login_hist, now_ns() - c->login_start);
+      break;
+    default:
+      // REJECTED, UNAUTHORIZED or anything unexpected
+      logins_failed++;
+      close_conn(c);
+  }
+}
+
+// Parses the send time out of a benchmark SENDMSG text
+// Returns -1 if the text was not sent by the benchmark
+long long parse_timestamp(const struct frame *f)
+{
+  long long ts = 0;
+  uint32_t i;
+
+  if (f->hdr.data_len < 2 || f->data[0] != TIMESTAMP_TAG)
+    return -1;
+  for (i = 1; i < f->hdr.data_len && f->data[i] >= '0' && f->data[i] <= '9'; i++)
+    ts = ts * 10 + (f->data[i] - '0');
+  return i > 1 ? ts : -1;
+}
+
+// Handles a frame received by a logged in connection
+void handle_chat_frame(bench_conn_t *c, struct frame *f, long long now)
+{
+  if (f->hdr.type == CLOSED) {
+    disconnects++;
+    close_conn(c);
+    return;
+  }
+  if (f->hdr.type == PING) {
+    send_frame(c, PONG_COMMAND, NULL, NULL, 0);
+    return;
+  }
+
+  long long ts = parse_timestamp(f);
+  if (ts >= 0) {
+    delivered++;
+    hist_record(&fanout_hist, now - ts);
+    return;
+  }
+
+  // HAPPY messages carry no timestamp, senders time their own copy
+  static const char happy[] = "Feeling happy\n";
+  if (f->hdr.data_len == sizeof(happy) - 1 && memcmp(f->data, happy, sizeof(happy) - 1) == 0) {
+    happy_delivered++;
+    if ((int)f->hdr.uid == c->uid && c->happy_count > 0) {
+      hist_record(&echo_hist, now - c->happy_sent[c->happy_head]);
+      c->happy_head = (c->happy_head + 1) % HAPPY_RING;
+      c->happy_count--;
+    }
+  }
+}
+
+// Reads from a connection and handles every complete frame
+void conn_readable(bench_conn_t *c)
+{
+  struct frame f;
+  int rc;
+
+  ssize_t n = frame_reader_fill(&c->reader, c->sock);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    if (c->state == BENCH_LOGIN)
+      logins_failed++;
+    else
+      disconnects++;
+    close_conn(c);
+    return;
+  }
+
+  long long now = now_ns();
+  while (c->state >= BENCH_LOGIN && (rc = frame_reader_next(&c->reader, &f)) > 0) {
+    if (c->state == BENCH_LOGIN) {
+      handle_login_frame(c, &f);
+    } else {
+      handle_chat_frame(c, &f, now);
+    }
+  }
+}
+
+// Waits for socket events for up to timeout_ms and handles them
+void poll_events(int timeout_ms)
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+  for (int i = 0; i < n; i++) {
+    bench_conn_t *c = (bench_conn_t *)events[i].data.ptr;
+    if (c->state == BENCH_CONNECTING) {
+      conn_established(c);
+      continue;
+    }
+    if (c->state != BENCH_IDLE && (events[i].events & EPOLLOUT))
+      flush_conn(c);
+    if (c->state != BENCH_IDLE && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+      conn_readable(c);
+  }
+}
+
+/* traffic */
+
+// Sends one message from a connection, SENDMSG or HAPPY according to the command mix
+void send_message(bench_conn_t *c)
+{
+  char data[DATA_LENGTH];
+
+  if (rand() % 100 < happy_pct) {
+    if (c->happy_count == HAPPY_RING)
+      return;  // echoes are not keeping up, skip rather than lose track
+    c->happy_sent[(c->happy_head + c->happy_count++) % HAPPY_RING] = now_ns();
+    send_frame(c, HAPPY_COMMAND, NULL, NULL, 0);
+    sent_happy++;
+    expected += active_count;
+    return;
+  }
+
+  int len = snprintf(data, sizeof(data), "%c%lld ", TIMESTAMP_TAG, now_ns());
+  while (len < msg_size && len < DATA_LENGTH - 2)
+    data[len++] = 'x';
+  send_frame(c, SENDMSG_COMMAND, NULL, data, len);
+  sent_msgs++;
+  expected += active_count - 1;
+}
+
+// Makes a random logged in connection leave the chat room and join again
+void churn_one()
+{
+  int first = num_senders < num_conns ? num_senders : 0;  // keep senders connected when possible
+  bench_conn_t *c = &conns[first + rand() % (num_conns - first)];
+
+  if (c->state != BENCH_ACTIVE)
+    return;
+
+  send_frame(c, QUIT_COMMAND, NULL, NULL, 0);
+  if (c->state != BENCH_IDLE)
+    close_conn(c);
+  leaves++;
+  start_conn(c);
+  joins++;
+}
+
+// Connects and logs in every connection, at most MAX_CONNECTING at a time
+// Returns the number of seconds it took
+double connect_all()
+{
+  long long start = now_ns();
+  int next = 0;
+
+  while (logins_ok + logins_failed < (unsigned long long)num_conns) {
+    while (next < num_conns && (int)(next - logins_ok - logins_failed) < MAX_CONNECTING)
+      start_conn(&conns[next++]);
+    poll_events(10);
+    if (now_ns() - start > (long long)CONNECT_TIMEOUT_MS * 1000000) {
+      printf("Timed out waiting for logins\n");
+      break;
+    }
+  }
+
+  return (now_ns() - start) / 1e9;
+}
+
+// Sends traffic at the configured rate for the configured duration, then drains
+void run_traffic()
+{
+  long long start = now_ns();
+  long long end = start + (long long)duration * 1000000000LL;
+  unsigned long long scheduled = 0, churned = 0;
+  int sender = 0;
+
+  while (now_ns() < end) {
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // Catch up on every message that is due, spread round robin over the senders
+    unsigned long long due = (unsigned long long)(elapsed * rate);
+    for (int burst = 0; scheduled < due && burst < 10000; burst++) {
+      bench_conn_t *c = &conns[sender];
+      sender = (sender + 1) % num_senders;
+      scheduled++;
+      if (c->state == BENCH_ACTIVE)
+        send_message(c);
+    }
+
+    unsigned long long churn_due = (unsigned long long)(elapsed * churn_rate);
+    while (churned < churn_due) {
+      churn_one();
+      churned++;
+    }
+
+    poll_events(1);
+  }
+
+  long long drain_end = now_ns() + (long long)DRAIN_MS * 1000000;
+  while (now_ns() < drain_end)
+    poll_events(10);
+}
+
+// Prints CLI usage
+void print_usage()
+{
+  printf("Usage: chatbench -p <portnumber> [-h <hostname>] [-n <connections>] [-r <messages/sec>]\n"
+         "                 [-d <seconds>] [-c <passcode>] [--senders <count>] [--size <bytes>]\n"
+         "                 [--happy <percent>] [--churn <leaves/sec>]\n");
+}
+
+int main(int argc, char *argv[])
+{
+  // Parse command line arguments
+  int opt, option_index;
+  int port = 0;
+  char hostname[1024] = "127.0.0.1";
+
+  struct option long_options[] = {
+    {"host", required_argument, NULL, 'h'},
+    {"port", required_argument, NULL, 'p'},
+    {"connections", required_argument, NULL, 'n'},
+    {"rate", required_argument, NULL, 'r'},
+    {"duration", required_argument, NULL, 'd'},
+    {"passcode", required_argument, NULL, 'c'},
+    {"senders", required_argument, NULL, OPT_SENDERS},
+    {"size", required_argument, NULL, OPT_SIZE},
+    {"happy", required_argument, NULL, OPT_HAPPY},
+    {"churn", required_argument, NULL, OPT_CHURN},
+    {0, 0, 0, 0}
+  };
+
+  char optstring[16] = "h:p:n:r:d:c:";
+  while ((opt = getopt_long_only(argc, argv, optstring, long_options, &option_index)) != -1) {
+    switch (opt) {
+      case 'h':
+        if (strlen(optarg) >= sizeof(hostname)) {
+          printf("Host name is too long\n");
+          return EXIT_FAILURE;
+        }
+        strcpy(hostname, optarg);
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'n':
+        num_conns = atoi(optarg);
+        break;
+      case 'r':
+        rate = atof(optarg);
+        break;
+      case 'd':
+        duration = atoi(optarg);
+        break;
+      case 'c':
+        if (strlen(optarg) >= PASSWORD_LENGTH) {
+          printf("Passcode cannot exceed %d characters\n", PASSWORD_LENGTH - 1);
+          return EXIT_FAILURE;
+        }
+        strcpy(passcode, optarg);
+        break;
+      case OPT_SENDERS:
+        num_senders = atoi(optarg);
+        break;
+      case OPT_SIZE:
+        msg_size = atoi(optarg);
+        break;
+      case OPT_HAPPY:
+        happy_pct = atoi(optarg);
+        break;
+      case OPT_CHURN:
+        churn_rate = atof(optarg);
+        break;
+      default:
+        print_usage();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (port < 1 || port > 65535) {
+    printf("Must provide a port number between 1 and 65535\n");
+    print_usage();
+    return EXIT_FAILURE;
+  }
+  if (num_conns < 2 || rate <= 0 || duration <= 0 || msg_size < 0 || happy_pct < 0 || happy_pct > 100 ||
+      churn_rate < 0 || num_senders < 0) {
+    printf("Need at least 2 connections, a positive rate and duration, and a happy percentage between 0 and 100\n");
+    print_usage();
+    return EXIT_FAILURE;
+  }
+  if (num_senders == 0 || num_senders > num_conns)
+    num_senders = num_conns;
+
+  // If localhost was passed in, change to the appropriate IP address
+  if (strcmp(hostname, "localhost") == 0)
+    strcpy(hostname, "127.0.0.1");
+
+  // Set the destination address and port
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, hostname, &serv_addr.sin_addr) <= 0) {
+    printf("Invalid address. Address not supported: IP %s port %d\n", hostname, port);
+    return EXIT_FAILURE;
+  }
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("epoll_create1");
+    return EXIT_FAILURE;
+  }
+  conns = (bench_conn_t *)calloc(num_conns, sizeof(bench_conn_t));
+  if (conns == NULL) {
+    printf("Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < num_conns; i++)
+    sprintf(conns[i].name, "bench%d", i);
+  srand((unsigned)time(NULL));
+
+  // Phase 1: log every connection in
+  double connect_secs = connect_all();
+  printf("Connected %llu of %d clients in %.3f s (%.0f logins/s, %llu failed)\n",
+         logins_ok, num_conns, connect_secs, logins_ok / connect_secs, logins_failed);
+  hist_print("login latency", &login_hist);
+  if (active_count < 2) {
+    printf("Not enough clients logged in to run traffic\n");
+    return EXIT_FAILURE;
+  }
+
+  // Phase 2: traffic
+  printf("Sending %.0f messages/s from %d senders to %d clients for %d s (%d%% HAPPY, %.1f leaves/s)\n",
+         rate, num_senders, active_count, duration, happy_pct, churn_rate);
+  unsigned long long connect_logins = logins_ok;
+  memset(&login_hist, 0, sizeof(login_hist));
+  run_traffic();
+
+  // Report
+  printf("Sent %llu SENDMSG and %llu HAPPY messages (%.0f messages/s)\n",
+         sent_msgs, sent_happy, (sent_msgs + sent_happy) / (double)duration);
+  printf("Delivered %llu of ~%llu expected messages (%.0f deliveries/s)\n",
+         delivered + happy_delivered, expected, (delivered + happy_delivered) / (double)duration);
+  hist_print("fanout latency", &fanout_hist);
+  hist_print("happy echo latency", &echo_hist);
+  if (churn_rate > 0) {
+    printf("Churn: %llu leaves, %llu joins, %llu rejoined\n", leaves, joins, logins_ok - connect_logins);
+    hist_print("rejoin latency", &login_hist);
+  }
+  if (disconnects > 0)
+    printf("%llu connections were closed by the server\n", disconnects);
+
+  for (int i = 0; i < num_conns; i++) {
+    if (conns[i].state != BENCH_IDLE)
+      close_conn(&conns[i]);
+    free(conns[i].out);
+  }
+  free(conns);
+  close(epoll_fd);
+
+  return EXIT_SUCCESS;
+}
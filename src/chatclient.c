@@ -1,24 +1,61 @@
 #include <stdio.h> 
 #include <sys/socket.h> 
-#include <sys/select.h>
 #include <arpa/inet.h> 
 #include <unistd.h> 
 #include <string.h> 
 #include <stdlib.h> 
-#include <pthread.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "protocol.h"
 
-/* Global variables available to all threads */
+#define ATTACH_CHUNK (32 * 1024)    // Bytes of a file uploaded per ATTACH frame
+#define INPUT_BUFF   (16 * 1024)    // Bytes of input (stdin or a script) read at once
+#define SEND_HIGH    (256 * 1024)   // Bytes waiting to be sent before input is no longer read
+#define STDOUT_BUFF  (64 * 1024)    // Size of the stdout buffer, flushed once per loop iteration
+
+/* Global variables */
 
 char display_name[USERNAME_LENGTH];
 int client_socket;
 int client_id;
-
-// Global flag that send() and recv() threads read and write during execution
-// Clearing this flag will stop both threads execution
-_Atomic int client_running = 1;
+int compress_flag = 0;   // Ask the server for compression at login (--compress)
+int compress = 0;        // Set once the server agreed to compression
+
+// Frames received from the server but not yet processed
+// Shared by login() and then the event loop, since the server may send
+// chat messages right behind the login response
+struct frame_reader reader;
+
+// Where commands come from: stdin, or a file or pipe given with --script
+// Scripts run without prompts, and their commands are sent as fast as they are read
+// without waiting for the server to answer each one
+int input_fd = 0;
+int interactive = 1;
+const char *line_start = "\r";   // Moves the cursor back over the prompt, empty for scripts
+int input_eof = 0;               // Set once the input has nothing more to read
+int input_done = 0;              // Set once :Exit was sent, nothing after it is
+
+// Input read but not yet handled as lines
+char input_buff[INPUT_BUFF];
+size_t input_len = 0;
+int discarding = 0;   // Skipping the rest of a line that was too long
+
+// Frames waiting to be sent to the server, in order
+char *send_buff;
+size_t send_len = 0;
+size_t send_cap = 0;
+
+// File being uploaded with :send, one chunk at a time as the socket takes them
+FILE *upload;
+char upload_path[DATA_LENGTH];
+size_t upload_total;
+
+// Flag the event loop runs on, cleared when the connection closes
+int client_running = 1;
 
 // Checks if a provided string contains entirely alphanumeric characters
 int isalnum_str(char *s)
@@ -34,170 +71,455 @@ int isalnum_str(char *s)
   return 0;
 }
 
-// Prompts user to enter login credentials
-// Returns 0 if logged in, -1 if not
-struct login_response login(char *username, char *pwd)
+// Blocks until the next frame from the server has arrived
+// Returns 1 if a frame was received, -1 if the connection broke
+int recv_frame(struct frame *f)
 {
-  struct login_request login_request;
-  struct login_response login_resp;
-
-  // Send login request to server
-  strcpy(login_request.username, username);  // copy name into global variable
-  strcpy(login_request.password, pwd);
-  strcpy(display_name, username);
-  send(client_socket, &login_request, sizeof(login_request), 0);
+  int rc;
 
-  // Receive login response from server
-  recv(client_socket, &login_resp, sizeof(login_resp), 0);
+  while ((rc = frame_reader_next(&reader, f)) == 0) {
+    if (frame_reader_fill(&reader, client_socket) <= 0)
+      return -1;
+  }
 
-  return login_resp;
+  return rc;
 }
 
-// Thread for reading input from stdin and sending messages to the chat room
-void *send_messages() 
+// Makes room for len more bytes at the end of the send buffer
+// Returns where they go, or NULL if memory could not be allocated (which stops the client)
+char *send_reserve(size_t len)
 {
-  char data_buff[DATA_LENGTH];
-  struct client_message client_msg;
+  if (send_cap - send_len < len) {
+    size_t cap = send_cap ? send_cap : 4096;
+    while (cap - send_len < len)
+      cap *= 2;
+    char *buff = realloc(send_buff, cap);
+    if (buff == NULL) {
+      printf("%sOut of memory, shutting down...\n", line_start);
+      client_running = 0;
+      return NULL;
+    }
+    send_buff = buff;
+    send_cap = cap;
+  }
+  return send_buff + send_len;
+}
 
-  fd_set rfds;
-  int rc;
-  struct timeval no_timeout;
-  no_timeout.tv_sec = 0;
-  no_timeout.tv_usec = 0;
+// Queues a frame with the given type and '\0' terminated data (data may be NULL)
+// Long messages go out compressed if compression was negotiated and it makes them smaller
+void send_frame(int type, const char *name, const char *data)
+{
+  size_t name_len = name ? strlen(name) : 0, data_len = data ? strlen(data) : 0;
+  size_t len = frame_length(name_len, data_len);
+  char *frame = send_reserve(len);
+  if (frame == NULL)
+    return;
+
+  if (compress && data_len >= COMPRESS_MIN_DATA) {
+    size_t packed_len = frame_encode_compressed(frame, len - 1, type, client_id, name, name_len, data, data_len);
+    if (packed_len) {
+      send_len += packed_len;
+      return;
+    }
+  }
+  send_len += frame_encode(frame, type, client_id, name, name_len, data, data_len);
+}
 
-  // Prompt for input
-  printf("> ");
-  fflush(stdout);    // print the character right away, don't wait for new line to show up in stdout buffer
+// Sends as much of the send buffer as the socket takes without blocking
+void flush_sends()
+{
+  size_t done = 0;
 
-  while (client_running) {
-    // Check if stdin has any input to read with select()
-    // Set a timeout of 0 so we can check for input without blocking
-    FD_ZERO(&rfds);
-    FD_SET(0, &rfds);
-    if ((rc = select(1, &rfds, NULL, NULL, &no_timeout)) < 0) {
-      printf("select() error with stdin\n");
-      continue;
+  while (done < send_len) {
+    ssize_t n = send(client_socket, send_buff + done, send_len - done, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      break;
+    if (n <= 0) {
+      printf("%sCould not send data to server, shutting down...\n", line_start);
+      client_running = 0;
+      return;
     }
+    done += n;
+  }
+  memmove(send_buff, send_buff + done, send_len - done);
+  send_len -= done;
+}
 
-    // Check if data is available
-    if (!FD_ISSET(0, &rfds))
-      continue;
+// Returns the last component of a path
+const char *base_name(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
 
-    // Read the data from stdin
-    fgets(data_buff, DATA_LENGTH, stdin);
+// Starts uploading a file, which upload_chunks() sends in ATTACH_CHUNK sized frames
+// No further input is read until the upload is queued, so commands keep their order
+void send_file(const char *path)
+{
+  upload = fopen(path, "rb");
+  if (upload == NULL) {
+    printf("Could not open %s\n", path);
+    return;
+  }
+  snprintf(upload_path, sizeof(upload_path), "%s", path);
+  upload_total = 0;
+}
 
-    // Check how much the user entered
-    if (strlen(data_buff) == 1) {
-      // User just hit enter key by itself, don't send a message
-      continue;
-    } else if (strchr(data_buff, '\n') == NULL) {
-      // New line was not read - input is too long
-      // Need to read in and discard the rest of the input
-      int c;
-      while ((c = getc(stdin)) != '\n' && c != EOF);
-      printf("Input is too long, cannot exceed %d characters\n", DATA_LENGTH);
+// Queues chunks of the file being uploaded while less than SEND_HIGH bytes wait to be sent,
+// then asks the server to send the file to the room once it is all queued
+// Each chunk is read straight into the send buffer behind its header
+void upload_chunks()
+{
+  while (upload && client_running && send_len < SEND_HIGH) {
+    char *frame = send_reserve(FRAME_HEADER_LENGTH + ATTACH_CHUNK);
+    if (frame == NULL)
+      return;
+
+    size_t n = fread(frame + FRAME_HEADER_LENGTH, 1, ATTACH_CHUNK, upload);
+    if (n > 0) {
+      frame_encode_head(frame, ATTACH_COMMAND, client_id, NULL, 0, n);
+      send_len += FRAME_HEADER_LENGTH + n;
+      upload_total += n;
       continue;
     }
 
-    // Remove new line character
-    data_buff[strlen(data_buff) - 1] = '\0';
-
-    if (strcmp(data_buff, ":)") == 0) {
-      client_msg.command = HAPPY_COMMAND;
-    } else if (strcmp(data_buff, ":(") == 0) {
-      client_msg.command = SAD_COMMAND;
-    } else if (strcmp(data_buff, ":mytime") == 0) {
-      client_msg.command = MYTIME_COMMAND;
-    } else if (strcmp(data_buff, ":+1hr") == 0) {
-      client_msg.command = MYTIMEPLUS_COMMAND;
-    } else if (strcmp(data_buff, ":help") == 0) {
-      client_msg.command = HELP_COMMAND;
-    } else if (strcmp(data_buff, ":Exit") == 0) {
-      // client closed the connection
-      client_msg.command = QUIT_COMMAND;
+    fclose(upload);
+    upload = NULL;
+    if (upload_total == 0) {
+      printf("%s is empty, nothing was sent\n", upload_path);
     } else {
-      client_msg.command = SENDMSG_COMMAND;
-      strcpy(client_msg.data, data_buff);
+      send_frame(ATTACH_END_COMMAND, base_name(upload_path), NULL);
     }
+  }
+}
 
-    send(client_socket, &client_msg, sizeof(client_msg), 0);
+// Saves an attachment sent by another client as "received-<file name>" in the current directory
+void save_attachment(const struct frame *f, const char *sender)
+{
+  const char *end = memchr(f->data, '\0', f->hdr.data_len < USERNAME_LENGTH ? f->hdr.data_len : USERNAME_LENGTH);
+  if (end == NULL) {
+    printf("%sMalformed attachment from %s\n", line_start, sender);
+    return;
+  }
 
-    // Prompt for input
-    printf("> ");
-    fflush(stdout);
+  char path[USERNAME_LENGTH + 16];
+  const char *name = base_name(f->data);
+  if (*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    name = "attachment";
+  snprintf(path, sizeof(path), "received-%s", name);
+
+  size_t len = f->hdr.data_len - (end + 1 - f->data);
+  FILE *file = fopen(path, "wb");
+  if (file == NULL || fwrite(end + 1, 1, len, file) != len) {
+    printf("%sCould not save %s from %s\n", line_start, path, sender);
+  } else {
+    printf("%s> %s sent %s (%zu bytes), saved as %s\n", line_start, sender, name, len, path);
   }
+  if (file)
+    fclose(file);
+}
 
+// Parses a time ago such as 90s, 30m, 2h or 1d (a bare number is in minutes)
+// Returns the number of seconds, or -1 if the text is not a duration
+long parse_ago(const char *s)
+{
+  char *unit;
+  long n = strtol(s, &unit, 10);
+
+  if (unit == s || n < 0)
+    return -1;
+  if (*unit == '\0' || strcmp(unit, "m") == 0)
+    return n * 60;
+  if (strcmp(unit, "s") == 0)
+    return n;
+  if (strcmp(unit, "h") == 0)
+    return n * 3600;
+  if (strcmp(unit, "d") == 0)
+    return n * 86400;
+  return -1;
+}
+
+// Builds the data of a HISTORY frame from ":history <since> [<until>]" arguments
+// Returns -1 if they are not durations
+int history_range(const char *args, char *data, size_t size)
+{
+  char since[32] = "", until[32] = "";
+  long from, to = 0;
+
+  if (sscanf(args, "%31s %31s", since, until) < 1 || (from = parse_ago(since)) < 0)
+    return -1;
+  if (until[0] != '\0' && (to = parse_ago(until)) < 0)
+    return -1;
+
+  long long now = (long long)time(NULL);
+  snprintf(data, size, "%lld %lld", now - from, to ? now - to : 0);
   return 0;
 }
 
-// Thread for receiving messages from chat server and printing to stdout
-// Need a separate thread for receiving messages so the client can still listen
-// for messages from the server while the user is prompted for input
-void *recv_messages() 
+// Sends login credentials to the server
+// Returns the response code (AUTHORIZED, UNAUTHORIZED or REJECTED if the room filled up)
+// and sets client_id if logged in
+int login(char *username, char *pwd)
 {
-  struct server_message server_msg;
+  struct frame login_resp;
 
-  // Spin as long as client is still running and connection is alive
-  fd_set rfds;
-  int rc;
-  struct timeval no_timeout;
-  no_timeout.tv_sec = 0;
-  no_timeout.tv_usec = 0;
-  while (client_running) {
-    // Use select() to check if there is data to be read in the socket
-    FD_ZERO(&rfds);
-    FD_SET(client_socket, &rfds);
-    if ((rc = select(client_socket + 1, &rfds, NULL, NULL, &no_timeout)) < 0) {
-      // Error, close connection
-      printf("select() error after connection established, shutting down...\n");
-      client_running = 0; // shutdown client
-      break;
-    }
+  // Send login request to server, asking for compression if wanted
+  char frame[FRAME_HEADER_LENGTH + USERNAME_LENGTH + PASSWORD_LENGTH];
+  strcpy(display_name, username);  // copy name into global variable
+  size_t len = frame_encode_str(frame, LOGIN_COMMAND, client_id, username, pwd);
+  if (compress_flag)
+    frame_set_flags(frame, FRAME_FLAG_COMPRESSION);
+  send(client_socket, frame, len, 0);
 
-    // Check if the data is available
-    if (!FD_ISSET(client_socket, &rfds))
-      continue;
+  // Receive login response from server
+  if (recv_frame(&login_resp) < 0)
+    return UNAUTHORIZED;
 
-    // Read the data
-    // Break the loop if recv() does not return > 0 (error or connection was closed client side)
-    if (recv(client_socket, &server_msg, sizeof(server_msg), 0) <= 0) {
-      printf("Could not receive data from server, shutting down...\n");
-      client_running = 0;   // shutdown the client if the connection breaks
-      break;
+  if (login_resp.hdr.type == AUTHORIZED) {
+    client_id = login_resp.hdr.uid;
+    compress = (login_resp.hdr.flags & FRAME_FLAG_COMPRESSION) != 0;
+  }
+  return login_resp.hdr.type;
+}
+
+// Prints the prompt for the next command (interactive mode only)
+void prompt()
+{
+  if (interactive)
+    printf("> ");
+}
+
+// Turns one line of input (without its new line) into a command and queues it
+void handle_line(char *line)
+{
+  char *name = NULL;         // only private messages name a user
+  char *data = NULL;         // only messages and room names carry data
+  char range[64];            // time range of a history query
+  int command;
+
+  // User just hit enter key by itself, don't send a message
+  if (line[0] == '\0')
+    return;
+
+  if (strcmp(line, ":)") == 0) {
+    command = HAPPY_COMMAND;
+  } else if (strcmp(line, ":(") == 0) {
+    command = SAD_COMMAND;
+  } else if (strcmp(line, ":mytime") == 0) {
+    command = MYTIME_COMMAND;
+  } else if (strcmp(line, ":+1hr") == 0) {
+    command = MYTIMEPLUS_COMMAND;
+  } else if (strcmp(line, ":help") == 0) {
+    command = HELP_COMMAND;
+  } else if (strcmp(line, ":Exit") == 0) {
+    // client closed the connection, nothing after it is sent
+    command = QUIT_COMMAND;
+    input_done = 1;
+  } else if (strncmp(line, ":join ", 6) == 0) {
+    // room name follows the command
+    command = JOIN_COMMAND;
+    data = line + 6;
+  } else if (strcmp(line, ":leave") == 0) {
+    command = LEAVE_COMMAND;
+  } else if (strcmp(line, ":rooms") == 0) {
+    command = LIST_COMMAND;
+  } else if (strncmp(line, ":send ", 6) == 0) {
+    // path of the file to attach follows the command
+    send_file(line + 6);
+    prompt();
+    return;
+  } else if (strncmp(line, ":history ", 9) == 0) {
+    // one or two times ago, sent to the server as a range of Unix times
+    command = HISTORY_COMMAND;
+    if (history_range(line + 9, range, sizeof(range)) < 0) {
+      printf("Usage: :history <since> [<until>], e.g. :history 2h 1h\n");
+      prompt();
+      return;
     }
+    data = range;
+  } else if (strncmp(line, ":dm ", 4) == 0 && strchr(line + 4, ' ') != NULL) {
+    // username, then the message after the next space
+    command = DM_COMMAND;
+    name = line + 4;
+    data = strchr(name, ' ');
+    *data++ = '\0';
+  } else {
+    command = SENDMSG_COMMAND;
+    data = line;
+  }
+
+  send_frame(command, name, data);
+  prompt();
+}
 
-    if (server_msg.uid == 0) {
-      // print the message outright if from the server
-      printf("\r%s", server_msg.data);
-    } else if (server_msg.uid == client_id) {
-      // message originally sent by this client and returned to us
-      // happens for special commands like ':)'
-      // print the message without the username
-      printf("\r> %s", server_msg.data);
+// Handles a line of input, unless it is too long to send
+void take_line(char *line, size_t len)
+{
+  if (len > DATA_LENGTH - 2) {
+    printf("Input is too long, cannot exceed %d characters\n", DATA_LENGTH - 2);
+    prompt();
+    return;
+  }
+  line[len] = '\0';
+  handle_line(line);
+}
+
+// Handles the complete lines read so far, stopping at :send until the upload is queued
+// Once the input has ended, the last line is handled even without a new line and :Exit
+// is sent for the user
+void handle_input()
+{
+  char *line = input_buff, *end = input_buff + input_len, *nl;
+
+  while (!input_done && !upload && (nl = memchr(line, '\n', end - line)) != NULL) {
+    if (discarding) {
+      discarding = 0;  // end of the line that was too long
     } else {
-      printf("\r> %s: %s", server_msg.username, server_msg.data);
+      take_line(line, nl - line);
     }
+    line = nl + 1;
+  }
 
-    // Stop looping if the server sent a signal indicating that it closed the connection
-    // Server would send a closed signal either when the server is shut down OR after
-    //   the client sends QUIT command/closes the connection
-    // Setting client_running will cause both threads to return
-    if (server_msg.status == CLOSED) {
-      client_running = 0;
+  // A line that fills the whole buffer can only be too long, skip to its end
+  if (line == input_buff && input_len == sizeof(input_buff)) {
+    if (!discarding)
+      take_line(input_buff, input_len);
+    discarding = 1;
+    line = end;
+  }
+  input_len = end - line;
+  memmove(input_buff, line, input_len);
+
+  if (input_eof && !input_done && !upload) {
+    if (input_len > 0 && !discarding)
+      take_line(input_buff, input_len);
+    input_len = 0;
+    if (!input_done)
+      send_frame(QUIT_COMMAND, NULL, NULL);
+    input_done = 1;
+  }
+}
+
+// Reads what is available on the input and handles it
+void read_input()
+{
+  ssize_t n = read(input_fd, input_buff + input_len, sizeof(input_buff) - input_len);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (n <= 0) {
+    input_eof = 1;
+  } else {
+    input_len += n;
+  }
+  handle_input();
+}
+
+// Prints one frame received from the server
+void print_frame(struct frame *server_msg)
+{
+  static char username[USERNAME_LENGTH], data[MAX_FRAME_DATA + 1];
+
+  frame_copy_name(server_msg, username, sizeof(username));
+  frame_copy_data(server_msg, data, sizeof(data));
+
+  if (server_msg->hdr.type == ATTACHMENT) {
+    save_attachment(server_msg, username);
+  } else if (server_msg->hdr.uid == 0) {
+    // print the message outright if from the server
+    printf("%s%s", line_start, data);
+  } else if ((int)server_msg->hdr.uid == client_id) {
+    // message originally sent by this client and returned to us
+    // happens for special commands like ':)'
+    // print the message without the username
+    printf("%s> %s", line_start, data);
+  } else {
+    printf("%s> %s: %s", line_start, username, data);
+  }
+
+  // Stop looping if the server sent a signal indicating that it closed the connection
+  // Server would send a closed signal either when the server is shut down OR after
+  //   the client sends QUIT command/closes the connection
+  if (server_msg->hdr.type == CLOSED) {
+    client_running = 0;
+  } else {
+    // Connection still open, print another '>' to prompt for user input
+    prompt();
+  }
+}
+
+// Reads what the server sent and prints every complete frame
+void read_server()
+{
+  struct frame server_msg;
+  int rc;
+
+  // Break the loop if recv() does not return > 0 (error or connection was closed)
+  ssize_t n = frame_reader_fill(&reader, client_socket);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (n <= 0) {
+    printf("%sCould not receive data from server, shutting down...\n", line_start);
+    client_running = 0;
+    return;
+  }
+
+  // One read may carry several frames, heartbeats are answered without printing anything
+  while (client_running && (rc = frame_reader_next(&reader, &server_msg)) > 0) {
+    if (server_msg.hdr.type == PING) {
+      send_frame(PONG_COMMAND, NULL, NULL);
     } else {
-      // Connection still open, print another '>' to prompt for user input
-      printf("> ");
-      fflush(stdout);
+      print_frame(&server_msg);
     }
   }
 
-  return 0;
+  if (client_running && rc < 0) {
+    printf("%sMalformed message from server, shutting down...\n", line_start);
+    client_running = 0;
+  }
+}
+
+// Event loop: one poll() over the socket and the input, sleeping until either is ready
+// Input is only read while the send buffer is below SEND_HIGH and no upload is in progress,
+// so a fast script is paced by the server instead of growing the buffer
+// Everything printed during one iteration goes to stdout in one write
+void run_client()
+{
+  struct pollfd pfds[2];
+
+  prompt();
+  while (client_running) {
+    upload_chunks();
+    if (!upload && !input_done && (input_len > 0 || input_eof))
+      handle_input();  // lines read behind a :send
+    fflush(stdout);
+
+    pfds[0].fd = client_socket;
+    pfds[0].events = POLLIN | (send_len > 0 ? POLLOUT : 0);
+    pfds[1].fd = input_eof || input_done || upload || send_len >= SEND_HIGH ? -1 : input_fd;
+    pfds[1].events = POLLIN;
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      printf("poll() error, shutting down...\n");
+      break;
+    }
+
+    if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR))
+      read_server();
+    if (client_running && pfds[1].revents)
+      read_input();
+    if (client_running && send_len > 0)
+      flush_sends();
+  }
+  fflush(stdout);
 }
 
 // Prints CLI usage
 void print_usage()
 {
-  printf("Usage: client -j -h <hostname> -p <portnumber> -u <username> -c <passcode>\n");
+  printf("Usage: client -j -h <hostname> -p <portnumber> -u <username> -c <passcode> [--compress]\n"
+         "              [--script <file>|-]\n");
 }
 
 // Main thread for logging into the chat room
@@ -206,7 +528,7 @@ int main(int argc, char *argv[])
   // Parse command line arguments
   int opt, option_index;
   int join_flag = 0;
-  int port;
+  int port = 0;
   char hostname[1024], username[USERNAME_LENGTH], passcode[PASSWORD_LENGTH];
 
   struct option long_options[] = {
@@ -215,15 +537,32 @@ int main(int argc, char *argv[])
     {"port", required_argument, NULL, 'p'},
     {"username", required_argument, NULL, 'u'},
     {"passcode", required_argument, NULL, 'c'},
+    {"compress", no_argument, NULL, 'z'},
+    {"script", required_argument, NULL, 'f'},
     {0, 0, 0, 0}
   };
 
-  char optstring[10] = "jh:p:u:c:";
+  // Attachments arrive as single frames far larger than chat messages
+  reader.max_attachment = MAX_ATTACHMENT_DATA;
+
+  char optstring[13] = "jh:p:u:c:zf:";
   while ((opt = getopt_long_only(argc, argv, optstring, long_options, &option_index)) != -1) {
     switch (opt) {
       case 'j': 
         join_flag = 1;
         break;
+      case 'z':
+        compress_flag = 1;
+        break;
+      case 'f':
+        // Commands come from a file, or from stdin with "-", and run without prompts
+        if (strcmp(optarg, "-") != 0 && (input_fd = open(optarg, O_RDONLY | O_CLOEXEC)) < 0) {
+          printf("Could not open script %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        interactive = 0;
+        line_start = "";
+        break;
       case 'h': 
         strcpy(hostname, optarg);
         break;
@@ -231,10 +570,13 @@ int main(int argc, char *argv[])
         port = atoi(optarg);
         break;
       case 'u': 
-        strcpy(username, optarg);
-        break;
       case 'c': 
-        strcpy(passcode, optarg);
+        // Username and passcode must fit in the protocol's length fields
+        if (strlen(optarg) >= USERNAME_LENGTH) {
+          printf("Username and passcode cannot exceed %d characters\n", USERNAME_LENGTH - 1);
+          return EXIT_FAILURE;
+        }
+        strcpy(opt == 'u' ? username : passcode, optarg);
         break;
       default: 
         printf("Error!\n");
@@ -269,7 +611,6 @@ int main(int argc, char *argv[])
   
   int ret;
   struct sockaddr_in serv_addr; 
-  pthread_t send_tid, recv_tid; 
 
   if ((client_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) { 
     printf("Socket creation error.\n"); 
@@ -294,34 +635,38 @@ int main(int argc, char *argv[])
   } 
 
   // Wait to receive a signal from server indicating if connection was successful
-  int conn;
-  recv(client_socket, &conn, sizeof(conn), 0);
-  if (conn == REJECTED) {
+  struct frame conn;
+  if (recv_frame(&conn) < 0 || conn.hdr.type == REJECTED) {
     printf("Rejected by server at IP %s port %d.\n", hostname, port);
     return EXIT_FAILURE;
   }
   printf("Connected to server at IP %s port %d.\n", hostname, port); 
 
   // Prompt user to login until successful
-  struct login_response login_resp = login(username, passcode);
-  if (login_resp.status == UNAUTHORIZED) {
+  int login_status = login(username, passcode);
+  if (login_status == REJECTED) {
+    printf("Rejected by server at IP %s port %d.\n", hostname, port);
+    return EXIT_FAILURE;
+  }
+  if (login_status != AUTHORIZED) {
     printf("Incorrect password, login request denied.\n"); 
     return EXIT_FAILURE;
   }
 
-  // Set client id
-  client_id = login_resp.id;
   printf("\n~~~~~~~~~~~Welcome to the chat room, %s (uid %d)~~~~~~~~~~~\n\n", username, client_id);
 
-  // Create threads for sending and receiving messages
-  pthread_create(&recv_tid, NULL, &recv_messages, NULL);
-  pthread_create(&send_tid, NULL, &send_messages, NULL);
-
-  // Wait for threads to finish
-  pthread_join(recv_tid, NULL);
-  pthread_join(send_tid, NULL); 
+  // From here on stdout is written in batches by the event loop, and the socket never blocks it
+  setvbuf(stdout, NULL, _IOFBF, STDOUT_BUFF);
+  fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+  run_client();
 
   close(client_socket);
+  if (input_fd != 0)
+    close(input_fd);
+  if (upload)
+    fclose(upload);
+  frame_reader_free(&reader);
+  free(send_buff);
 
   return 0; 
 } 
@@ -1,356 +1,3214 @@
 #include <unistd.h> 
 #include <stdio.h> 
 #include <sys/socket.h> 
-#include <sys/select.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <poll.h>
 #include <stdlib.h> 
 #include <netinet/in.h> 
+#include <netinet/tcp.h>
 #include <string.h> 
-#include <pthread.h>
 #include <arpa/inet.h>
 #include <getopt.h>
 #include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include "protocol.h"
+#include "framebuf.h"
+#include "outqueue.h"
+#include "registry.h"
+#include "inbox.h"
+#include "logger.h"
+#include "history.h"
+#include "rooms.h"
+#include "users.h"
+#include "uring.h"
+#include "metrics.h"
+#include "slab.h"
+#include "intern.h"
+#include "store.h"
+#include "relay.h"
+#include "timerwheel.h"
+#include "handoff.h"
 
-#define MAX_CLIENTS   128 
 #define PASSWORD      "cs3251secret"
 #define LOG_FILE_PATH "server_log.txt"
+#define LOG_BIN_PATH  "server_log.bin"   // Log file with --log-format binary
 #define SERVER_IP     "127.0.0.1"
+#define MAX_EVENTS    64   // Max readiness events handled per epoll_wait() call
+#define ACCEPT_BATCH  256  // Max connections accepted per wakeup of the listening socket
+
+#define DEFAULT_MAX_CLIENTS 128   // Clients logged in at once
+#define FD_RESERVE 1024           // File descriptors kept for everything but logged in clients: listening
+                                  // sockets, shards, the log, the store, links, uploads and pending logins
+
+#define DEFAULT_AUTH_TIMEOUT 10   // Seconds a new connection has to send its login request
+#define DEFAULT_LOG_FLUSH_MS 100  // Max time a log record waits before it is written
+#define DEFAULT_PING_INTERVAL 30  // Seconds a logged in client may be silent before it is sent a PING
+#define DEFAULT_IDLE_TIMEOUT  90  // Seconds of silence after which a client is disconnected
+
+#define DEFAULT_RATE  50    // Commands per second a client may send once its burst is used up
+#define DEFAULT_BURST 100   // Commands a client may send at once after being quiet
+#define ATTACH_TOKEN_BYTES (256 * 1024)   // Bytes of an upload that cost as much as one command
+#define ATTACH_MIN_CHARGE  4096           // Bytes every attachment chunk is charged at least
+
+#define DEFAULT_OVERLOAD_QUEUE  (64 * 1024 * 1024)   // Bytes queued for a shard's clients that make it overloaded
+#define DEFAULT_OVERLOAD_LAG_MS 250                  // Time one batch of events may take before the shard is overloaded
+#define OVERLOAD_CHECK_MS       100                  // How often a busy shard checks whether it is overloaded
+#define OVERLOAD_SAMPLE         4                    // Low priority commands let through while overloaded: 1 in this many
+
+#define ROOMS_PER_CLIENT 32   // Rooms one connection may create, so it cannot fill the directory by itself
+
+#define DEFAULT_HISTORY       50            // Messages replayed to a joining client
+#define DEFAULT_HISTORY_BYTES (256 * 1024)  // Size of each shard's history arena
+
+#define DEFAULT_QUEUE_LIMIT (256 * 1024)   // Default cap on bytes queued for one client
+
+#define DEFAULT_MAX_ATTACHMENT (16 * 1024 * 1024)   // Largest attachment a client may upload
+#define DEFAULT_SPOOL_DIR      "/tmp"               // Where uploads are spooled (as unlinked files)
+
+#define DEFAULT_STORE_SEGMENT (64 * 1024 * 1024)   // Size of each message store segment file
+#define STORE_QUERY_MAX       200                  // Most stored messages sent for one :history query
+#define HISTORY_MAX_SECS      (UINT64_MAX / 1000 - 1)   // Latest time a :history query may name, so it fits in ms
+
+// What to do when a client's outbound queue is full
+#define POLICY_DROP_OLDEST 0   // Drop the oldest queued messages to make room
+#define POLICY_DISCONNECT  1   // Disconnect the client
+#define POLICY_COALESCE    2   // Replace everything not yet sent with one "messages skipped" notice
+
+// TCP options set on client sockets
+#define TCP_MODE_NAGLE   0   // Leave Nagle's algorithm on (the kernel default)
+#define TCP_MODE_NODELAY 1   // Set TCP_NODELAY, every flush goes out right away
+#define TCP_MODE_CORK    2   // Cork the socket while a flush takes more than one send call
+
+// Event loop backends
+#define IO_EPOLL 0   // Readiness with epoll, then non-blocking socket calls
+#define IO_URING 1   // Completions with io_uring: multishot accept and recv, asynchronous sends
+
+// io_uring backend sizes, per shard
+#define URING_ENTRIES     1024   // Submission ring entries
+#define URING_BUFFERS     1024   // Provided receive buffers, a power of two
+#define URING_BUFFER_SIZE 4096   // Bytes per receive buffer
+
+// What an io_uring completion belongs to, kept in the low bits of its user_data
+// The rest of user_data is the client_t the request was made for, if any
+#define UOP_ACCEPT 1
+#define UOP_WAKE   2
+#define UOP_RECV   3
+#define UOP_SEND   4
+#define UOP_WRITABLE 5   // Poll for a socket taking more of an attachment's file contents
+#define UOP_CANCEL 6     // Cancellation of another request, its completion needs no handling
+#define UOP_MASK   7
+
+// Connection states
+#define CONN_LOGIN  0   // Accepted, waiting for the login request
+#define CONN_ACTIVE 1   // Logged in and part of the chat room
+
+#define CLIENT_SLAB_CHUNK 64   // Connections carved out of each slab chunk
+#define SEND_SLAB_CHUNK   16   // io_uring send contexts carved out of each slab chunk
+
+// Long-only command line options
+#define OPT_QUEUE_LIMIT   256
+#define OPT_SLOW_POLICY   257
+#define OPT_BACKLOG       258
+#define OPT_AUTH_TIMEOUT  259
+#define OPT_WORKERS       260
+#define OPT_LOG_FORMAT    261
+#define OPT_LOG_FLUSH     262
+#define OPT_LOG_FSYNC     263
+#define OPT_HISTORY       264
+#define OPT_HISTORY_SECS  265
+#define OPT_HISTORY_BYTES 266
+#define OPT_TCP_MODE      267
+#define OPT_IO            268
+#define OPT_MAX_ATTACHMENT 269
+#define OPT_SPOOL_DIR     270
+#define OPT_STATS_SOCKET  271
+#define OPT_COMPRESS_MIN  272
+#define OPT_STORE_DIR     273
+#define OPT_STORE_SEGMENT 274
+#define OPT_NODE_ID       275
+#define OPT_CLUSTER_PORT  276
+#define OPT_PEER          277
+#define OPT_PING_INTERVAL 278
+#define OPT_IDLE_TIMEOUT  279
+#define OPT_RATE          280
+#define OPT_BURST         281
+#define OPT_OVERLOAD_QUEUE 282
+#define OPT_OVERLOAD_LAG  283
+#define OPT_HANDOFF_SOCKET 284
+#define OPT_TAKEOVER      285
+#define OPT_MAX_CLIENTS   286
+#define OPT_CLUSTER_BIND  287
+#define OPT_CLUSTER_SECRET 288
+
+// An io_uring send in flight, the kernel reads the message and its iovecs until it completes
+// Only connections with a send in flight hold one, taken from the shard's send slab
+typedef struct {
+  struct msghdr msg;
+  struct iovec iov[OUTQ_IOV_MAX];
+} send_ctx_t;
+
+// Per TCP-connection client structure
+// Allocated from the owning shard's connection slab
+typedef struct client {
+  reg_entry_t entry;               // Client id and position in the clients registry (must be first)
+  struct sockaddr_in addr;         // Client source IP address and port
+  int connection_sock;             // Connection socket file descriptor
+  const char *name;                // Client display name, interned at login (no_name before)
+  struct frame_reader reader;      // Frames received from the client but not yet processed
+  out_queue_t outq;                // Frames waiting to be written to the client
+  uint32_t events;                 // Events the event loop is currently watching for
+  unsigned long dropped;           // Messages dropped because the client read too slowly
+  int state;                       // CONN_LOGIN or CONN_ACTIVE
+  int compress;                    // Set if the client negotiated compression at login
+  int room;                        // Room the client is in, LOBBY_ROOM after logging in
+  int rooms_made;                  // Rooms the client created by joining them
+  reg_entry_t room_entry;          // Position in the room's members on this shard
+  wheel_timer_t timer;             // Login deadline in CONN_LOGIN, next heartbeat check in CONN_ACTIVE
+  long long last_heard;            // Time (ms) of the last read from the client
+  int pinged;                      // Set once a PING went out and nothing was heard since
+  long long tokens;                // Commands the client may send right away, in thousandths of a command
+  long long tokens_at;             // Time (ms) the tokens were last topped up
+  int throttled;                   // Set once the client was told it sends too fast, until its tokens fill up again
+  long long accepted_ns;           // When the connection was accepted, for the login latency metric
+  struct client *prev_pending;     // Neighbours in the pending logins list
+  struct client *next_pending;
+  int flush_pending;               // Set while the client is on the flush list
+  struct client *next_flush;       // Next client in the flush list
+  int closing;                     // Set once the client is scheduled to be disconnected
+  struct client *next_closing;     // Next client in the closing list
+  int io_refs;                     // io_uring requests in flight for this connection
+  int sending;                     // Set while an io_uring send of the queue is in flight
+  int released;                    // Set once the connection is closed and only waits for io_refs to drain
+  send_ctx_t *send;                // The io_uring send in flight, NULL when there is none
+  int upload_fd;                   // Spool file of the attachment being uploaded (-1 for none)
+  size_t upload_len;               // Bytes of the attachment received so far
+  int upload_failed;               // Set when the upload went wrong, later chunks are ignored until the end
+  int cancelled;                   // Set once its io_uring requests were cancelled to hand it over
+} client_t;
+
+// A connection handed over by the previous server (see handoff.h), waiting for its shard to adopt it
+typedef struct adopted {
+  handoff_conn_t meta;
+  int sock;
+  int upload_fd;
+  struct frame_reader reader;   // Bytes the client sent that the previous server did not process
+  out_queue_t outq;             // Frames the previous server had not written yet
+  struct adopted *next;
+} adopted_t;
+
+// One event loop thread (a shard) and the slice of the clients it owns
+// Every shard accepts connections on its own SO_REUSEPORT listening socket,
+// so the kernel spreads new clients across shards and no socket is shared
+typedef struct {
+  pthread_t thread;
+  int listening_sock;   // Socket file descriptor for socket that accepts new client connections
+  int epoll_fd;         // Event loop for the listening socket, wake_fd and the shard's clients
+  int wake_fd;          // eventfd signalled when the inbox goes from empty to non empty
+  inbox_t inbox;        // Frames broadcast by clients of other shards
+  history_t history;    // Recent broadcasts, replayed to clients joining this shard (owner thread only)
+  registry_t *rooms;    // Clients of this shard in each room, indexed by room id (owner thread only)
+  outq_stats_t writes;  // Send calls, frames and bytes written to the shard's clients (owner thread writes)
+  size_t queued;        // Bytes queued for the shard's connections, kept by their out queues (owner thread only)
+  metrics_t metrics;    // Everything else the stats endpoint reports (owner thread writes)
+  uring_t ring;         // io_uring backend only, created by the shard's own thread
+  slab_t client_slab;   // Connection objects of the shard's clients (owner thread only)
+  slab_t send_slab;     // Contexts of the io_uring sends in flight (owner thread only)
+  timer_wheel_t timers; // Login deadlines and heartbeats of the shard's connections (owner thread only)
+  adopted_t *adopted;   // Connections handed over by the previous server, adopted when the shard starts
+} shard_t;
 
 /* Global variables observed by all threads */
 
-// Array of clients connected to the server
-// Insertion order preserved
-// Access to list must be protected by mutex lock
-client_t *clients[MAX_CLIENTS];
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Event loop threads, shards[0] runs on the main thread
+shard_t *shards;
+int num_shards = 1;
 
 // Clients metadata
-int client_id = 1;
+_Atomic unsigned client_seq = 0;   // Logins so far, the next id is taken from it, see next_client_id()
 _Atomic int client_count = 0;
 
-// Server log file
-FILE *log_file;
-
-// Socket file descriptor for socket that accepts new client connections
-int listening_sock;
-
-// Global flag that all socket threads loop on
-// Cleared upon server shutdown (Ctrl-C)
-_Atomic int server_running = 1;
+// Name of connections that have not logged in, never interned
+const char no_name[] = "";
+
+// Frames with the same contents for every client, encoded once at startup
+frame_buf_t *menu_frame;
+frame_buf_t *closed_frame;
+frame_buf_t *accepted_frame;
+frame_buf_t *rejected_frame;
+frame_buf_t *unauthorized_frame;
+frame_buf_t *ping_frame;
+
+// Outbound queue settings
+size_t queue_limit = DEFAULT_QUEUE_LIMIT;
+int slow_policy = POLICY_DROP_OLDEST;
+int tcp_mode = TCP_MODE_NAGLE;
+int io_backend = IO_EPOLL;
+size_t compress_min = COMPRESS_MIN_DATA;   // 0 turns compression off
+
+// Stats endpoint, a Unix socket that answers every connection with a report
+const char *stats_path = NULL;   // NULL when --stats-socket is not given
+int stats_sock = -1;
+pthread_t stats_tid;
+long long started_ms;
+
+// Attachment settings
+size_t max_attachment = DEFAULT_MAX_ATTACHMENT;
+const char *spool_dir = DEFAULT_SPOOL_DIR;
+
+// Message store settings
+const char *store_path = NULL;   // NULL when --store-dir is not given
+size_t store_segment = DEFAULT_STORE_SEGMENT;
+
+// Cluster settings
+int node_id = 0;
+int cluster_port = 0;   // 0 when --cluster-port is not given
+const char *cluster_bind = SERVER_IP;   // Address the cluster port listens on, loopback like the client port
+const char *cluster_secret = NULL;      // Shared by every node, never the client passcode
+int peer_count = 0;
+
+// Connection settings
+int max_clients = DEFAULT_MAX_CLIENTS;
+int listen_backlog = SOMAXCONN;
+int auth_timeout = DEFAULT_AUTH_TIMEOUT;
+int ping_interval = DEFAULT_PING_INTERVAL;   // 0 turns heartbeats off
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+// Load shedding settings
+int rate_limit = DEFAULT_RATE;   // 0 turns rate limiting off
+int rate_burst = DEFAULT_BURST;
+size_t overload_queue = DEFAULT_OVERLOAD_QUEUE;   // 0 ignores queued bytes
+int overload_lag = DEFAULT_OVERLOAD_LAG_MS;       // 0 ignores event loop lag
+
+// Shards that are currently overloaded, the whole server sheds load while any is
+atomic_int overloaded_shards = 0;
+
+// Upgrade handoff, see handoff.h
+const char *handoff_path = NULL;   // NULL when --handoff-socket is not given
+int takeover = 0;                  // Set by --takeover, the server starts from the one at handoff_path
+int handoff_sock = -1;             // Where the next server connects to take over
+pthread_t handoff_tid;
+atomic_int handoff_conn = -1;      // Connection to the next server once it asked to take over
+pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;   // Keeps each shard's messages together, guards the rest
+pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;     // Signalled when a shard reports or a handoff is decided
+int handoff_reports;               // Shards that sent their connections in the current handoff
+int handoff_failed;                // Set if one of them could not
+unsigned handoff_sent;             // Connections sent in the current handoff
+unsigned handoff_round;            // Handoffs decided so far
+int handoff_done;                  // Set once the next server confirmed it took everything over
+int handoff_closed;                // Set once a shard shut down, no handoff can start any more
+atomic_int stop_requested;         // Set by Ctrl-C, a shard carrying on after a failed handoff stops again
+
+// What the previous server handed over, until the shards are set up
+adopted_t *adopted_list;
+int *adopted_listeners;   // Listening sockets, indexed by the previous server's shard (-1 for none)
+unsigned adopted_shards;
+
+// History settings
+unsigned history_msgs = DEFAULT_HISTORY;
+int history_secs = 0;   // 0 means no age limit
+size_t history_bytes = DEFAULT_HISTORY_BYTES;
+
+// Log settings
+int log_format = LOG_FORMAT_TEXT;
+int log_flush_ms = DEFAULT_LOG_FLUSH_MS;
+int log_fsync = LOG_FSYNC_NEVER;
+
+// Global flag that the event loops run on
+// Cleared upon server shutdown (Ctrl-C), atomic so every shard sees the change
+atomic_int server_running = 1;
+
+/* Per-shard variables, each event loop thread has its own copy */
+
+// Shard run by this thread
+_Thread_local shard_t *self;
+
+// Clients connected to this shard, indexed by id
+// Only the shard's own thread touches the registry, so it needs no lock
+_Thread_local registry_t clients;
+
+// Connections that have not logged in yet, oldest first (their deadlines are in the shard's timer wheel)
+_Thread_local client_t *pending_head;
+_Thread_local client_t *pending_tail;
+
+// Clients with newly queued frames, written once the current batch of events has been handled
+// Every frame queued for a client during the batch then goes out in one send call
+_Thread_local client_t *flush_list;
+
+// Clients to disconnect once the current batch of events has been handled
+// Disconnects are deferred so broadcast loops never see a client disappear
+_Thread_local client_t *closing_list;
+
+// Time (ms) the event loop last woke up, stamped on every read instead of reading the clock each time
+_Thread_local long long loop_now;
+
+// Overload controller state of this shard
+_Thread_local int overloaded;          // Set while this shard counts in overloaded_shards
+_Thread_local long long load_checked;  // Time (ms) of the last overload check
+_Thread_local long long batch_max;     // Longest batch of events (ms) since the last check
+_Thread_local unsigned sample_seq;     // Low priority commands seen while overloaded
+
+// Closed connections waiting for their io_uring requests to complete before they are freed
+_Thread_local int lingering;
+
+// Set while the shard's connections are being handed over, received bytes are then kept for the next server
+_Thread_local int exporting;
+
+// Set while the shard's multishot accept and wakeup poll are armed, so a shard that carries on
+// after a failed handoff only arms again what was cancelled
+_Thread_local int accept_armed;
+_Thread_local int wake_armed;
+
+// io_uring features the kernel turned out to lack, requests fall back to one shot
+_Thread_local int accept_oneshot;
+_Thread_local int recv_oneshot;
 
 // Logging methods
-// Prints the string to stdout and writes it to the server's log file
+// Queues the string for the log writer, which prints it to stdout and writes it to the server's log file
 void server_log(char *s)
 {
-  printf("%s", s);  // print to console
-  fprintf(log_file, "%s", s);  // write to log file
+  logger_text(s);
+}
+
+// Prints the string to stderr and writes it to the server's log file
+void server_error(char *s)
+{
+  perror(s);
+  logger_text(s);
+}
+
+// Returns a monotonic timestamp in milliseconds, for deadlines
+long long now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Appends the IP address and port number of a socket to a string
+void append_sock_addr(struct sockaddr_in addr, char *buff)
+{
+  char temp_buff[1024];
+  sprintf(temp_buff, "IP: %d.%d.%d.%d port: %d",
+        addr.sin_addr.s_addr & 0xff,
+        (addr.sin_addr.s_addr & 0xff00) >> 8,
+        (addr.sin_addr.s_addr & 0xff0000) >> 16,
+        (addr.sin_addr.s_addr & 0xff000000) >> 24,
+        addr.sin_port);
+
+  strcat(buff, temp_buff);
+}
+
+/* clients data structure methods */
+
+// Returns the i-th client in the registry
+client_t *client_at(unsigned i)
+{
+  return (client_t *)clients.members[i];
+}
+
+// Returns the i-th member of a room on this shard
+client_t *room_member_at(int room, unsigned i)
+{
+  return (client_t *)((char *)self->rooms[room].members[i] - offsetof(client_t, room_entry));
+}
+
+// Puts a client in a room
+// Returns -1 if memory could not be allocated
+int enter_room(client_t *client, int room)
+{
+  client->room_entry.id = client->entry.id;
+  if (registry_add(&self->rooms[room], &client->room_entry) < 0)
+    return -1;
+
+  client->room = room;
+  room_count(room, self - shards, 1);
+  relay_members(room);
+  return 0;
+}
+
+// Takes a client out of its room
+// The client's membership may be the room's last reference, so the member count is posted to the
+// relay (which holds the room until it is sent) before it is dropped
+// Must not run while a broadcast is walking the room, see reap_clients()
+void exit_room(client_t *client)
+{
+  registry_remove(&self->rooms[client->room], &client->room_entry);
+  relay_members(client->room);
+  room_count(client->room, self - shards, -1);
+}
+
+// Returns the client of this shard with the given id, or NULL
+client_t *find_client(int id)
+{
+  return (client_t *)registry_find(&clients, id);
+}
+
+// Adds a client to the clients registry, the server wide users index and the lobby
+// The caller has already reserved the client's seat in client_count
+// Returns -1 if memory could not be allocated
+int add_client(client_t *client)
+{
+  if (registry_add(&clients, &client->entry) < 0)
+    return -1;
+
+  if (users_add(client->name, client->entry.id, self - shards) < 0) {
+    registry_remove(&clients, &client->entry);
+    return -1;
+  }
+  if (enter_room(client, LOBBY_ROOM) < 0) {
+    users_remove(client->entry.id);
+    registry_remove(&clients, &client->entry);
+    return -1;
+  }
+  relay_presence(client->entry.id, client->name, 1);
+  return 0;
+}
+
+// Closes a connection's socket and frees it, after a last best effort write of its queue
+// With io_uring the connection lingers until every request in flight for it has completed,
+// so the kernel never touches a freed client or frame
+void release_connection(client_t *client)
+{
+  if (client->io_refs > 0) {
+    if (!client->released)
+      lingering++;
+    client->released = 1;
+    return;
+  }
+  if (client->released)
+    lingering--;
+  timer_cancel(&self->timers, &client->timer);
+
+  outq_write(&client->outq, client->connection_sock, &self->writes);
+  close(client->connection_sock);
+  if (client->upload_fd >= 0)
+    close(client->upload_fd);
+  frame_reader_free(&client->reader);
+  outq_free(&client->outq);
+  if (client->name != no_name)
+    intern_put(client->name);
+  slab_free(&self->client_slab, client);
+}
+
+// Removes a client from the clients registry, the users index and its room in O(1) and frees it
+// Must not run while a broadcast is walking the registry, see reap_clients()
+void delete_client(client_t *client)
+{
+  registry_remove(&clients, &client->entry);
+  users_remove(client->entry.id);
+  relay_presence(client->entry.id, client->name, 0);
+  exit_room(client);
+  client_count--;
+
+  release_connection(client);
+}
+
+// Marks a client to be disconnected after the current batch of events
+void schedule_close(client_t *client)
+{
+  if (client->closing)
+    return;
+
+  client->closing = 1;
+  client->next_closing = closing_list;
+  closing_list = client;
+}
+
+// Watches for the client becoming writable only while it has queued frames
+void update_events(client_t *client)
+{
+  uint32_t events = EPOLLIN | (outq_empty(&client->outq) ? 0 : EPOLLOUT);
+  if (events == client->events)
+    return;
+
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = client;
+  if (epoll_ctl(self->epoll_fd, EPOLL_CTL_MOD, client->connection_sock, &ev) == 0)
+    client->events = events;
+}
+
+// Tags an io_uring request with what it was made for
+uint64_t uring_tag(client_t *client, int op)
+{
+  return (uint64_t)(uintptr_t)client | (uint64_t)op;
+}
+
+// Asks io_uring to receive from a client into the shard's provided buffers
+void arm_recv(client_t *client)
+{
+  uring_prep_recv(&self->ring, client->connection_sock, !recv_oneshot, uring_tag(client, UOP_RECV));
+  client->io_refs++;
+}
+
+// Starts watching a new connection for incoming bytes
+// Returns -1 if the event loop could not take it
+int watch_client(client_t *client)
+{
+  if (io_backend == IO_URING) {
+    arm_recv(client);
+    return 0;
+  }
+
+  struct epoll_event ev;
+  ev.events = client->events = EPOLLIN;
+  ev.data.ptr = client;
+  return epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, client->connection_sock, &ev);
+}
+
+// Stops watching a connection that is about to be closed
+// With io_uring the read side is shut down, which completes the pending receive
+void unwatch_client(client_t *client)
+{
+  if (io_backend == IO_URING) {
+    shutdown(client->connection_sock, SHUT_RD);
+    return;
+  }
+
+  epoll_ctl(self->epoll_fd, EPOLL_CTL_DEL, client->connection_sock, NULL);
+}
+
+// Hands the client's queued frames to io_uring in one asynchronous send
+// The frames stay pinned in the queue until the send completes
+// io_uring has no sendfile, so an attachment's file contents go out with
+// non-blocking sendfile() calls instead, paced by a poll for the socket
+// becoming writable again
+void submit_send(client_t *client)
+{
+  char log_buff[1024];
+
+  if (client->sending || outq_empty(&client->outq))
+    return;
+
+  if (outq_file_pending(&client->outq)) {
+    if (outq_write(&client->outq, client->connection_sock, &self->writes) < 0) {
+      counter_add(&self->metrics.send_failures, 1);
+      sprintf(log_buff, "Write to client %d failed\n", client->entry.id);
+      server_log(log_buff);
+      schedule_close(client);
+      return;
+    }
+    if (!outq_empty(&client->outq)) {
+      uring_prep_poll(&self->ring, client->connection_sock, POLLOUT, 0, uring_tag(client, UOP_WRITABLE));
+      client->sending = 1;
+      client->io_refs++;
+    }
+    return;
+  }
+
+  send_ctx_t *send = slab_alloc(&self->send_slab);
+  if (send == NULL) {
+    server_error((char *)"Could not allocate send\n");
+    schedule_close(client);
+    return;
+  }
+  unsigned n_iov = outq_gather(&client->outq, send->iov, OUTQ_IOV_MAX);
+  client->outq.pinned = n_iov;
+  send->msg.msg_iov = send->iov;
+  send->msg.msg_iovlen = n_iov;
+  client->send = send;
+
+  uring_prep_sendmsg(&self->ring, client->connection_sock, &send->msg, MSG_NOSIGNAL, uring_tag(client, UOP_SEND));
+  client->sending = 1;
+  client->io_refs++;
+  counter_add(&self->writes.syscalls, 1);   // one send, even though io_uring_enter() submits many at once
+}
+
+// Writes as much of the client's queue as the socket accepts without blocking
+// With io_uring the queue is handed to an asynchronous send instead
+// In TCP_MODE_CORK a flush that needs several send calls is corked, so the
+// kernel only sends full segments until the last one
+void flush_client(client_t *client)
+{
+  char log_buff[1024];
+  int cork = tcp_mode == TCP_MODE_CORK && client->outq.count > OUTQ_IOV_MAX;
+  int on = 1, off = 0;
+
+  histogram_add(&self->metrics.queue_depth, client->outq.count);
+  if (io_backend == IO_URING) {
+    submit_send(client);
+    return;
+  }
+
+  if (cork) {
+    setsockopt(client->connection_sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    counter_add(&self->writes.syscalls, 1);
+  }
+  int rc = outq_write(&client->outq, client->connection_sock, &self->writes);
+  if (cork) {
+    setsockopt(client->connection_sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    counter_add(&self->writes.syscalls, 1);
+  }
+
+  if (rc < 0) {
+    counter_add(&self->metrics.send_failures, 1);
+    sprintf(log_buff, "Write to client %d failed\n", client->entry.id);
+    server_log(log_buff);
+    schedule_close(client);
+    return;
+  }
+
+  update_events(client);
+}
+
+// Adds a client to the flush list, its queue is written at the end of the current batch of events
+void schedule_flush(client_t *client)
+{
+  if (client->flush_pending)
+    return;
+
+  client->flush_pending = 1;
+  client->next_flush = flush_list;
+  flush_list = client;
+}
+
+// Writes out the queue of every client on the flush list
+void flush_clients()
+{
+  while (flush_list) {
+    client_t *client = flush_list;
+    flush_list = client->next_flush;
+    client->flush_pending = 0;
+    if (!client->closing)
+      flush_client(client);
+  }
+}
+
+// Applies the slow reader policy to a client whose queue has no room for need more bytes
+// Returns -1 if the new frame should not be queued
+int handle_slow_client(client_t *client, size_t need)
+{
+  char log_buff[1024];
+  unsigned dropped;
+
+  switch (slow_policy) {
+    case POLICY_DISCONNECT:
+      sprintf(log_buff, "Client %d (%s) is reading too slowly, disconnecting\n", client->entry.id, client->name);
+      server_log(log_buff);
+      counter_add(&self->metrics.slow_disconnects, 1);
+      schedule_close(client);
+      return -1;
+    case POLICY_COALESCE:
+      dropped = outq_drop_unsent(&client->outq);
+      client->dropped += dropped;
+      counter_add(&self->metrics.slow_drops, dropped);
+      if (dropped > 0) {
+        sprintf(log_buff, "*** %u messages skipped, you are reading too slowly\n", dropped);
+        frame_buf_t *notice = frame_buf_create(OPEN, 0, SERVER_USERNAME, log_buff);
+        if (notice) {
+          outq_push(&client->outq, notice);
+          frame_buf_release(notice);
+        }
+      }
+      return 0;
+    default:
+      dropped = outq_drop_oldest(&client->outq, need, queue_limit);
+      client->dropped += dropped;
+      counter_add(&self->metrics.slow_drops, dropped);
+      return 0;
+  }
+}
+
+// Queues an encoded frame for a client
+// The queue is written once the current batch of events has been handled, so
+// everything a client is sent in one batch is gathered into one send call
+// The queue takes its own reference to the frame, so callers keep theirs
+void send_frame_to_client(frame_buf_t *fb, client_t *dst)
+{
+  if (dst->closing)
+    return;
+
+  // Every recipient that negotiated compression shares the frame's one compressed twin
+  if (dst->compress)
+    fb = frame_buf_compressed(fb, compress_min);
+
+  // Queue is full, the client is not keeping up with the chat room
+  if (!outq_empty(&dst->outq) && dst->outq.bytes + fb->len > queue_limit) {
+    if (handle_slow_client(dst, fb->len) < 0)
+      return;
+  }
+
+  int was_empty = outq_empty(&dst->outq);
+  if (outq_push(&dst->outq, fb) < 0) {
+    counter_add(&self->metrics.send_failures, 1);
+    server_error((char *)"Could not queue message\n");
+    schedule_close(dst);
+    return;
+  }
+
+  // Frames queued behind others go out when the event loop reports the socket writable
+  if (was_empty)
+    schedule_flush(dst);
+}
+
+// Encodes a chat message into a frame that can be shared by every recipient
+// If src is null then the message is being sent by the server
+frame_buf_t *encode_message(char *s, client_t *src)
+{
+  frame_buf_t *fb;
+
+  if (src == NULL) {
+    fb = frame_buf_create(OPEN, 0, SERVER_USERNAME, s);
+  } else {
+    fb = frame_buf_create(OPEN, src->entry.id, src->name, s);
+  }
+  if (fb == NULL)
+    server_error((char *)"Could not allocate message frame\n");
+
+  return fb;
+}
+
+// Sends a message to a client
+// If src is null then the message is being sent by the server
+void send_message_to_client(char *s, client_t *dst, client_t *src)
+{
+  frame_buf_t *fb = encode_message(s, src);
+  if (fb == NULL)
+    return;
+
+  send_frame_to_client(fb, dst);
+  frame_buf_release(fb);
+}
+
+// Sends an encoded frame to the members of a room on this shard except one (except may be NULL)
+// Every broadcast passes through here exactly once per shard, whether or not the shard has members
+// in the room, so it is also where history is recorded (attachments are not, their contents live
+// in a file) and a client joining the room later on any shard gets the same replay
+// The caller holds the room; each frame in the history holds it too, until it is evicted
+void send_frame_to_local_room_except(frame_buf_t *fb, int room, client_t *except)
+{
+  if (fb->file_len == 0 && history_add(&self->history, room, fb->data, fb->len, now_ms()))
+    room_hold(room);
+
+  registry_t *members = &self->rooms[room];
+  if (members->count == 0)
+    return;  // only here for the history
+  unsigned sent = 0;
+  for (unsigned i = 0; i < members->count; i++) {
+    client_t *client = room_member_at(room, i);
+    if (client != except) {
+      send_frame_to_client(fb, client);
+      sent++;
+    }
+  }
+  histogram_add(&self->metrics.fanout, sent);
+}
+
+// Wakes a shard's event loop
+void wake_shard(shard_t *shard)
+{
+  uint64_t one = 1;
+  if (write(shard->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    server_error((char *)"eventfd write");
+}
+
+// Posts an encoded frame to the inbox of every other shard
+// Shards with no members in the room still record it in their history, delivering it costs them nothing
+// The frame itself is shared, each shard only takes a reference; the room is held until the shard has it
+void post_to_shards(frame_buf_t *fb, int room)
+{
+  for (int i = 0; i < num_shards; i++) {
+    shard_t *shard = &shards[i];
+    if (shard == self)
+      continue;
+
+    room_hold(room);
+    int rc = inbox_push(&shard->inbox, fb, room, 0);
+    if (rc < 0) {
+      room_release(room);
+      server_error((char *)"Could not post message to shard\n");
+    } else if (rc > 0) {
+      wake_shard(shard);  // the shard may be asleep, later posts ride on this wakeup
+    }
+  }
+}
+
+// Sends an encoded frame to one client, on whichever shard (or node) it is connected to
+// A client that has left by the time the frame arrives is simply not found
+void send_frame_to_user(frame_buf_t *fb, int id, int shard)
+{
+  if (shard >= num_shards) {
+    relay_direct(fb, id, shard);
+    return;
+  }
+  if (&shards[shard] == self) {
+    client_t *client = find_client(id);
+    if (client)
+      send_frame_to_client(fb, client);
+    return;
+  }
+
+  int rc = inbox_push(&shards[shard].inbox, fb, 0, id);
+  if (rc < 0) {
+    server_error((char *)"Could not post message to shard\n");
+  } else if (rc > 0) {
+    wake_shard(&shards[shard]);
+  }
+}
+
+// Delivers every frame other shards posted, either to one client or to the members of a room on this shard
+void drain_inbox()
+{
+  uint64_t posted;
+  if (read(self->wake_fd, &posted, sizeof(posted)) < 0 && errno != EAGAIN)
+    server_error((char *)"eventfd read");
+
+  inbox_node_t *node = inbox_take(&self->inbox);
+  while (node) {
+    if (node->uid) {
+      send_frame_to_user(node->fb, node->uid, self - shards);
+    } else {
+      send_frame_to_local_room_except(node->fb, node->room, NULL);
+      room_release(node->room);
+    }
+    node = inbox_node_free(node);
+  }
+}
+
+// Appends a message broadcast to a room to the message store
+void store_message(frame_buf_t *fb, int room)
+{
+  struct frame f;
+
+  if (store_path == NULL || fb->file_len > 0 || frame_decode(fb->data, fb->len, &f) < 0)
+    return;
+  store_append(room_name(room), f.hdr.uid, f.name, f.hdr.name_len, f.data, f.hdr.data_len);
+}
+
+// Sends an encoded frame to every member of a room except one (except may be NULL)
+// except always belongs to this shard, members on other shards get the frame through their inbox
+// and members on other nodes through the relay
+// This is the one place every broadcast starts from, so it is where it is stored
+void send_frame_to_room_except(frame_buf_t *fb, int room, client_t *except)
+{
+  store_message(fb, room);
+  send_frame_to_local_room_except(fb, room, except);
+  if (num_shards > 1)
+    post_to_shards(fb, room);
+  relay_broadcast(fb, room);
+}
+
+// Delivers a broadcast relayed by another node to this node's members of the room
+// Runs on the relay thread, which belongs to no shard, so every shard gets it through its inbox
+void relayed_room_frame(frame_buf_t *fb, int room)
+{
+  store_message(fb, room);
+  post_to_shards(fb, room);
+}
+
+// Delivers a frame relayed by another node to the local client it is addressed to
+void relayed_user_frame(frame_buf_t *fb, int id)
+{
+  int shard = users_find_id(id);
+  if (shard >= 0 && shard < num_shards)
+    send_frame_to_user(fb, id, shard);
+}
+
+// Sends message to every member of a room except one (except may be NULL)
+void send_message_to_room_except(char *s, client_t *src, int room, client_t *except)
+{
+  frame_buf_t *fb = encode_message(s, src);
+  if (fb == NULL)
+    return;
+
+  send_frame_to_room_except(fb, room, except);
+  frame_buf_release(fb);
+}
+
+// Sends message to every member of the sender's room, including the sender
+// The message is encoded once and the same frame is written to every member
+void send_message_to_room(char *s, client_t *src)
+{
+  send_message_to_room_except(s, src, src->room, NULL);
+}
+
+// Builds the frames that are identical for every client
+// Called once at startup
+void build_static_frames()
+{
+  char buff_out[2048] = "";
+  strcat(buff_out, "*** :)        Send 'Feeling happy'\r\n");
+  strcat(buff_out, "*** :(        Send 'Feeling sad'\r\n");
+  strcat(buff_out, "*** :mytime   Send the current time\r\n");
+  strcat(buff_out, "*** :+1hr     Send the current time + 1 hour\r\n");
+  strcat(buff_out, "*** :join <room>  Move to a room, creating it if needed\r\n");
+  strcat(buff_out, "*** :leave    Go back to the " LOBBY_ROOM_NAME "\r\n");
+  strcat(buff_out, "*** :rooms    List the rooms\r\n");
+  strcat(buff_out, "*** :dm <user> <message>  Send a private message\r\n");
+  strcat(buff_out, "*** :send <file>  Send a file to the room\r\n");
+  strcat(buff_out, "*** :history <since> [<until>]  Show stored messages of the room, times ago as 30m, 2h or 1d\r\n");
+  strcat(buff_out, "*** :Exit     Quit\r\n");
+  strcat(buff_out, "*** :help     Show help\r\n");
+
+  menu_frame = frame_buf_create(OPEN, 0, SERVER_USERNAME, buff_out);
+  closed_frame = frame_buf_create(CLOSED, 0, SERVER_USERNAME, "*** Server has terminated connection\n");
+  accepted_frame = frame_buf_create(ACCEPTED, 0, NULL, NULL);
+  rejected_frame = frame_buf_create(REJECTED, 0, NULL, NULL);
+  unauthorized_frame = frame_buf_create(UNAUTHORIZED, 0, NULL, NULL);
+  ping_frame = frame_buf_create(PING, 0, NULL, NULL);
+}
+
+// Sends the chat room list of commands to a client
+void send_menu(client_t *client)
+{
+  send_frame_to_client(menu_frame, client);
+}
+
+// Queues a signal to a client indicating that it is going to close its connection
+// Best effort: it goes out with the last write before the socket is closed, see release_connection()
+void send_closed_signal(client_t *client) {
+  outq_push(&client->outq, closed_frame);
+}
+
+// Logs that a client disconnected
+void log_disconnect(client_t *client)
+{
+  char log_buff[2048];
+
+  sprintf(log_buff, "Client %d (%s) disconnected\n", client->entry.id, client->name);
+  server_log(log_buff);
+  if (client->dropped > 0) {
+    sprintf(log_buff, "Client %d (%s) missed %lu messages by reading too slowly\n", client->entry.id, client->name, client->dropped);
+    server_log(log_buff);
+  }
+}
+
+// Copies the recent history of a room for a client about to join it
+// Taken before the client's own join notice is recorded
+frame_buf_t *take_history(int room)
+{
+  long long since = history_secs > 0 ? now_ms() - (long long)history_secs * 1000 : 0;
+  return history_replay(&self->history, room, history_msgs, since);
+}
+
+// Sends a joining client the recent history of its room in one batched write
+void send_history(client_t *client, frame_buf_t *replay)
+{
+  if (replay == NULL)
+    return;
+
+  send_frame_to_client(replay, client);
+  frame_buf_release(replay);
+}
+
+// Announces a newly logged in client to the chat room
+// Called once the client has been added to the clients array and the event loop
+void client_joined(client_t *client)
+{
+  char out_buff[2048], log_buff[2048];
+
+  // Everything recorded so far predates this client
+  frame_buf_t *replay = take_history(client->room);
+
+  sprintf(log_buff, "Client %d (%s) accepted from ", client->entry.id, client->name);
+  append_sock_addr(client->addr, log_buff);
+  strcat(log_buff, "\n");
+  server_log(log_buff);
+
+  // Tell the lobby that a new client has joined
+  sprintf(out_buff, "*** %s has joined the chat room!\n", client->name);
+  server_log(out_buff);
+  send_message_to_room_except(out_buff, NULL, client->room, client);
+
+  // Print the help menu to the new client, followed by what it missed
+  send_menu(client);
+  send_history(client, replay);
+}
+
+/* pending logins list methods */
+
+// Appends a new connection to the pending logins list and arms its login deadline
+void pending_add(client_t *client)
+{
+  timer_arm(&self->timers, &client->timer, loop_now + (long long)auth_timeout * 1000);
+  client->prev_pending = pending_tail;
+  client->next_pending = NULL;
+  if (pending_tail) {
+    pending_tail->next_pending = client;
+  } else {
+    pending_head = client;
+  }
+  pending_tail = client;
+}
+
+// Removes a connection from the pending logins list
+void pending_remove(client_t *client)
+{
+  if (client->prev_pending) {
+    client->prev_pending->next_pending = client->next_pending;
+  } else {
+    pending_head = client->next_pending;
+  }
+  if (client->next_pending) {
+    client->next_pending->prev_pending = client->prev_pending;
+  } else {
+    pending_tail = client->prev_pending;
+  }
+}
+
+// Closes a connection that never logged in
+// Whatever the socket accepts right now (e.g. a REJECTED or UNAUTHORIZED response) is all it gets
+void drop_connection(client_t *client)
+{
+  unwatch_client(client);
+  pending_remove(client);
+  release_connection(client);
+}
+
+// Removes a client from the chat room and closes its connection
+// Client entered QUIT, closed the connection otherwise (i.e. Ctrl-C) or fell too far behind
+// Only called from reap_clients() so no broadcast is in progress
+void client_left(client_t *client)
+{
+  char out_buff[2048];
+
+  if (client->state != CONN_ACTIVE) {
+    drop_connection(client);
+    return;
+  }
+
+  // Stop watching the socket before it is closed
+  unwatch_client(client);
+
+  // Send a message to the client's room that the client left the chat room
+  sprintf(out_buff, "*** %s has left the chat room!\n", client->name);
+  server_log(out_buff);
+  send_message_to_room_except(out_buff, NULL, client->room, client);
+
+  // Close connection
+  send_closed_signal(client);   // send a CLOSED status code to the client
+  log_disconnect(client);
+  delete_client(client);
+}
+
+// Disconnects every client scheduled to close
+// Announcing a departure can push other slow clients over their limit, so loop until none are left
+// The flush list is emptied before each client is freed, so it never holds a freed client
+void reap_clients()
+{
+  while (closing_list) {
+    flush_clients();
+    client_t *client = closing_list;
+    closing_list = client->next_closing;
+    client_left(client);
+  }
+}
+
+// Moves a client from its room to another one
+// Both rooms are told, and the client gets the new room's recent history
+void move_to_room(client_t *client, int room)
+{
+  char out_buff[2048];
+  int old_room = client->room;
+
+  if (room == old_room) {
+    sprintf(out_buff, "*** You are already in room %s\n", room_name(room));
+    send_message_to_client(out_buff, client, NULL);
+    return;
+  }
+
+  frame_buf_t *replay = take_history(room);
+
+  room_hold(old_room);  // the client no longer holds it, but its members still have to be told
+  exit_room(client);
+  if (enter_room(client, room) < 0) {
+    server_error((char *)"Could not join room\n");
+    frame_buf_release(replay);
+    if (enter_room(client, old_room) < 0)
+      schedule_close(client);
+    room_release(old_room);
+    return;
+  }
+
+  sprintf(out_buff, "*** %s has left room %s\n", client->name, room_name(old_room));
+  send_message_to_room_except(out_buff, NULL, old_room, client);
+  room_release(old_room);
+  sprintf(out_buff, "*** %s has joined room %s\n", client->name, room_name(room));
+  server_log(out_buff);
+  send_message_to_room_except(out_buff, NULL, room, client);
+
+  sprintf(out_buff, "*** You are now in room %s\n", room_name(room));
+  send_message_to_client(out_buff, client, NULL);
+  send_history(client, replay);
+}
+
+// Handles a request to move to the room named in a JOIN frame
+void join_room(client_t *client, struct frame *join_request)
+{
+  char name[ROOM_NAME_LENGTH + 1], out_buff[2048];
+
+  frame_copy_data(join_request, name, sizeof(name));
+  if (!room_name_valid(name)) {
+    sprintf(out_buff, "*** Room names are 1 to %d letters, digits, '-' or '_'\n", ROOM_NAME_LENGTH - 1);
+    send_message_to_client(out_buff, client, NULL);
+    return;
+  }
+
+  int created;
+  int room = room_lookup(name, client->rooms_made < ROOMS_PER_CLIENT, &created);
+  if (room < 0) {
+    if (client->rooms_made < ROOMS_PER_CLIENT) {
+      send_message_to_client((char *)"*** No more rooms can be created\n", client, NULL);
+    } else {
+      sprintf(out_buff, "*** You can only create %d rooms, join one that exists\n", ROOMS_PER_CLIENT);
+      send_message_to_client(out_buff, client, NULL);
+    }
+    return;
+  }
+  client->rooms_made += created;
+
+  move_to_room(client, room);
+  room_release(room);
+}
+
+// Sends a client the list of rooms and how many members each has
+void list_rooms(client_t *client)
+{
+  char out_buff[DATA_LENGTH];
+
+  int len = sprintf(out_buff, "*** Rooms: ");
+  room_list(out_buff + len, sizeof(out_buff) - len - 1);
+  strcat(out_buff, "\n");
+  send_message_to_client(out_buff, client, NULL);
+}
+
+// Delivers the result of a :history query to the client that asked, followed by a summary
+// Runs on the store's query thread, so the frames go through the client's shard inbox
+void history_reply(frame_buf_t *fb, unsigned found, int truncated, int uid, int shard)
+{
+  char out_buff[DATA_LENGTH];
+
+  if (fb)
+    send_frame_to_user(fb, uid, shard);
+
+  if (found == 0 && !truncated) {
+    sprintf(out_buff, "*** No stored messages in this room for that time range\n");
+  } else if (truncated) {
+    sprintf(out_buff, "*** Showed %u stored messages and stopped early, narrow the range to see the rest\n", found);
+  } else {
+    sprintf(out_buff, "*** %u stored messages\n", found);
+  }
+  frame_buf_t *summary = frame_buf_create(OPEN, 0, SERVER_USERNAME, out_buff);
+  if (summary) {
+    send_frame_to_user(summary, uid, shard);
+    frame_buf_release(summary);
+  }
+}
+
+// Asks the store for the stored messages of a client's room from a time range
+// The store's query thread scans them and history_reply() sends them, the event loop does not wait
+void query_history(client_t *client, struct frame *query)
+{
+  char in_buff[DATA_LENGTH];
+  unsigned long long from, to;
+
+  if (store_path == NULL) {
+    send_message_to_client((char *)"*** Messages are not stored on this server\n", client, NULL);
+    return;
+  }
+  frame_copy_data(query, in_buff, sizeof(in_buff));
+  if (sscanf(in_buff, "%llu %llu", &from, &to) != 2) {
+    send_message_to_client((char *)"*** Usage: :history <since> [<until>]\n", client, NULL);
+    return;
+  }
+  if (to == 0)
+    to = (unsigned long long)time(NULL);
+
+  // Times are seconds since the epoch, scaled to milliseconds below
+  if (from > HISTORY_MAX_SECS || to > HISTORY_MAX_SECS || from > to) {
+    send_message_to_client((char *)"*** That is not a valid time range\n", client, NULL);
+    return;
+  }
+
+  if (store_query_post(room_name(client->room), from * 1000, to * 1000 + 999, STORE_QUERY_MAX,
+                       history_reply, client->entry.id, self - shards) < 0)
+    send_message_to_client((char *)"*** The message store is busy, try again later\n", client, NULL);
+}
+
+// Sends the message in a DM frame to the one client it names
+// Only the target's connection is touched, found through the users index
+void direct_message(client_t *client, struct frame *dm)
+{
+  char target[USERNAME_LENGTH], in_buff[DATA_LENGTH], out_buff[2048];
+  int id = (int)dm->hdr.uid, shard;
+
+  frame_copy_name(dm, target, sizeof(target));
+  if (target[0] != '\0') {
+    shard = users_find_name(target, &id);
+  } else {
+    shard = users_find_id(id);
+  }
+  if (shard < 0) {
+    if (target[0] != '\0') {
+      snprintf(out_buff, sizeof(out_buff), "*** No user named %s\n", target);
+    } else {
+      sprintf(out_buff, "*** No user with id %d\n", id);
+    }
+    send_message_to_client(out_buff, client, NULL);
+    return;
+  }
+
+  frame_copy_data(dm, in_buff, DATA_LENGTH);
+  sprintf(out_buff, "[private] %s\n", in_buff);
+  frame_buf_t *fb = encode_message(out_buff, client);
+  if (fb == NULL)
+    return;
+  send_frame_to_user(fb, id, shard);
+  frame_buf_release(fb);
+
+  snprintf(out_buff, sizeof(out_buff), "[private to %d] %s\n", id, in_buff);
+  logger_chat(client->entry.id, client->name, out_buff);
+}
+
+// Creates an anonymous file in the spool directory to hold an upload
+// The file is unlinked right away, so it disappears once the last frame using it is released
+// Returns the file descriptor, or -1 on failure
+int spool_open()
+{
+  char path[PATH_MAX];
+
+  int fd = open(spool_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+    return fd;
+
+  // File system without O_TMPFILE, create a named file and unlink it
+  snprintf(path, sizeof(path), "%s/chatspool-XXXXXX", spool_dir);
+  fd = mkostemp(path, O_CLOEXEC);
+  if (fd >= 0)
+    unlink(path);
+  return fd;
+}
+
+// Abandons the client's upload, telling it why
+void abort_upload(client_t *client, char *reason)
+{
+  if (client->upload_fd >= 0)
+    close(client->upload_fd);
+  client->upload_fd = -1;
+  client->upload_len = 0;
+  client->upload_failed = 1;
+  send_message_to_client(reason, client, NULL);
+}
+
+// Appends the chunk of an attachment in an ATTACH frame to the client's spool file
+// The first chunk of an upload creates the file
+void attach_chunk(client_t *client, struct frame *chunk)
+{
+  char out_buff[1024];
+
+  if (client->upload_failed)
+    return;
+
+  if (client->upload_fd < 0) {
+    client->upload_fd = spool_open();
+    client->upload_len = 0;
+    if (client->upload_fd < 0) {
+      server_error((char *)"Could not create spool file\n");
+      abort_upload(client, (char *)"*** The server could not store the attachment\n");
+      return;
+    }
+  }
+
+  if (client->upload_len + chunk->hdr.data_len > max_attachment) {
+    sprintf(out_buff, "*** Attachments are limited to %zu bytes\n", max_attachment);
+    abort_upload(client, out_buff);
+    return;
+  }
+
+  // Spool writes go to the page cache, the data is read back from there by sendfile()
+  size_t done = 0;
+  while (done < chunk->hdr.data_len) {
+    ssize_t n = write(client->upload_fd, chunk->data + done, chunk->hdr.data_len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      server_error((char *)"Could not write spool file\n");
+      abort_upload(client, (char *)"*** The server could not store the attachment\n");
+      return;
+    }
+    done += n;
+  }
+  client->upload_len += done;
+}
+
+// Finishes the client's upload and sends the attachment to its room
+// The ATTACHMENT frame is built once: a small buffer with the header, sender and
+// file name, followed by the spool file, which every recipient (on every shard)
+// reads with sendfile() at its own pace
+void attach_end(client_t *client, struct frame *end)
+{
+  char file_name[USERNAME_LENGTH], out_buff[2048];
+
+  if (client->upload_failed) {
+    client->upload_failed = 0;  // the next chunk starts a new upload
+    return;
+  }
+  if (client->upload_fd < 0) {
+    send_message_to_client((char *)"*** No attachment was uploaded\n", client, NULL);
+    return;
+  }
+
+  // Keep only the last path component, recipients save the file under this name
+  frame_copy_name(end, file_name, sizeof(file_name));
+  char *base = strrchr(file_name, '/');
+  base = base ? base + 1 : file_name;
+  if (*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0)
+    base = (char *)"attachment";
+
+  size_t name_len = strlen(client->name), base_len = strlen(base);
+  size_t file_len = client->upload_len;
+  frame_buf_t *fb = frame_buf_file(frame_length(name_len, base_len + 1), client->upload_fd, file_len);
+  client->upload_fd = -1;
+  client->upload_len = 0;
+  if (fb == NULL) {
+    server_error((char *)"Could not allocate attachment\n");
+    return;
+  }
+  size_t head = frame_encode_head(fb->data, ATTACHMENT, client->entry.id, client->name, name_len, base_len + 1 + file_len);
+  memcpy(fb->data + head, base, base_len + 1);
+
+  send_frame_to_room_except(fb, client->room, client);
+  frame_buf_release(fb);
+
+  snprintf(out_buff, sizeof(out_buff), "*** Sent %s (%zu bytes) to room %s\n", base, file_len, room_name(client->room));
+  send_message_to_client(out_buff, client, NULL);
+  snprintf(out_buff, sizeof(out_buff), "[attachment] %s (%zu bytes)\n", base, file_len);
+  logger_chat(client->entry.id, client->name, out_buff);
+}
+
+// Broadcasts the text of a SENDMSG frame to the rest of the sender's room
+// The frame is encoded straight from the received one into a pooled buffer,
+// with one spare byte past its end so the text can be logged in place
+void broadcast_text(client_t *client, struct frame *msg)
+{
+  size_t name_len = strlen(client->name);
+  size_t text_len = strnlen(msg->data, msg->hdr.data_len < DATA_LENGTH - 1 ? msg->hdr.data_len : DATA_LENGTH - 1);
+
+  frame_buf_t *fb = frame_buf_alloc(frame_length(name_len, text_len + 1) + 1);
+  if (fb == NULL) {
+    server_error((char *)"Could not allocate message frame\n");
+    return;
+  }
+  fb->len--;  // the spare byte is not sent
+  char *text = fb->data + frame_encode_head(fb->data, OPEN, client->entry.id, client->name, name_len, text_len + 1);
+  memcpy(text, msg->data, text_len);
+  text[text_len] = '\n';
+  text[text_len + 1] = '\0';
+
+  send_frame_to_room_except(fb, client->room, client);
+  logger_chat(client->entry.id, client->name, text);
+  frame_buf_release(fb);
+}
+
+// Processes one complete frame received from a client
+// Returns -1 if the client asked to leave the chat room, 0 otherwise
+int handle_client_message(client_t *client, struct frame *client_msg)
+{
+  int command = client_msg->hdr.type;
+
+  char out_buff[2048];
+
+  // Time info
+  time_t tme;
+  struct tm *time_info;
+
+  out_buff[0] = '\0';
+
+  if (command == HAPPY_COMMAND) {
+    sprintf(out_buff, "Feeling happy\n");
+    send_message_to_room(out_buff, client);
+  } else if (command == SAD_COMMAND) {
+    sprintf(out_buff, "Feeling sad\n");
+    send_message_to_room(out_buff, client);
+  } else if (command == MYTIME_COMMAND) {
+    time(&tme);
+    time_info = localtime(&tme);
+    sprintf(out_buff, "My current time is: %02d:%02d:%02d\n", time_info->tm_hour, time_info->tm_min, time_info->tm_sec);
+    send_message_to_room(out_buff, client);
+  } else if (command == MYTIMEPLUS_COMMAND) {
+    time(&tme);
+    time_info = localtime(&tme);
+    sprintf(out_buff, "My time in one hour will be: %02d:%02d:%02d\n", 
+            (time_info->tm_hour == 23 ? 0 : time_info->tm_hour + 1), time_info->tm_min, time_info->tm_sec);
+    send_message_to_room(out_buff, client);
+  } else if (command == HELP_COMMAND) {
+    send_menu(client);
+  } else if (command == QUIT_COMMAND) {
+    // Close the connection to this client
+    return -1;
+  } else if (command == JOIN_COMMAND) {
+    join_room(client, client_msg);
+    return 0;
+  } else if (command == LEAVE_COMMAND) {
+    move_to_room(client, LOBBY_ROOM);
+    return 0;
+  } else if (command == LIST_COMMAND) {
+    list_rooms(client);
+    return 0;
+  } else if (command == DM_COMMAND) {
+    direct_message(client, client_msg);
+    return 0;
+  } else if (command == ATTACH_COMMAND) {
+    attach_chunk(client, client_msg);
+    return 0;
+  } else if (command == ATTACH_END_COMMAND) {
+    attach_end(client, client_msg);
+    return 0;
+  } else if (command == SENDMSG_COMMAND) {
+    broadcast_text(client, client_msg);
+    return 0;
+  } else if (command == HISTORY_COMMAND) {
+    query_history(client, client_msg);
+    return 0;
+  } else if (command == PONG_COMMAND) {
+    // Heartbeat answer, process_frames() already noted the client is alive
+    return 0;
+  } else {
+    // unknown command
+    sprintf(out_buff, "*** Unknown command passed in by client %d: %d\n", client->entry.id, command);
+    send_message_to_client(out_buff, client, NULL);
+    server_log(out_buff);
+    return 0;
+  }
+  
+  // Log whatever message was sent to client(s)
+  // The log writer thread adds the "> name: " prefix, nothing is formatted here
+  logger_chat(client->entry.id, client->name, out_buff);
+
+  return 0;
+}
+
+// Tells a connection it cannot log in (the chat room is full or the server overloaded) and schedules it to be closed
+void reject_connection(client_t *client, const char *reason)
+{
+  char buff[1024];
+
+  sprintf(buff, "%s, rejecting login attempt by user at ", reason);
+  append_sock_addr(client->addr, buff);
+  strcat(buff, "\n");
+  server_log(buff);
+  counter_add(&self->metrics.login_failures, 1);
+  send_frame_to_client(rejected_frame, client);
+  schedule_close(client);
+}
+
+// Hands out the next client id of this node's range, node_id * RELAY_ID_SPACE + 1 to (node_id + 1) * RELAY_ID_SPACE
+// The counter wraps within the range and skips ids still logged in, so ids never run into another node's
+// Returns -1 if every id of the range is in use
+int next_client_id()
+{
+  for (int tries = 0; tries < RELAY_ID_SPACE; tries++) {
+    unsigned seq = atomic_fetch_add(&client_seq, 1) % RELAY_ID_SPACE;
+    int id = node_id * RELAY_ID_SPACE + 1 + (int)seq;
+    if (users_find_id(id) < 0)
+      return id;
+  }
+  return -1;
+}
+
+// Handles the first frame of a connection, which must be a login request
+// Returns -1 if the connection should be closed, 0 if the client is now logged in
+int handle_login(client_t *client, struct frame *login_request)
+{
+  char password[PASSWORD_LENGTH], name[USERNAME_LENGTH], log_buff[1024];
+
+  frame_copy_data(login_request, password, sizeof(password));
+  if (login_request->hdr.type != LOGIN_COMMAND || strcmp(password, PASSWORD) != 0) {
+    // Password does not match send rejection message
+    sprintf(log_buff, "Login failed for user at ");
+    append_sock_addr(client->addr, log_buff);
+    strcat(log_buff, "\n");
+    server_log(log_buff);
+    counter_add(&self->metrics.login_failures, 1);
+    send_frame_to_client(unauthorized_frame, client);
+    return -1;
+  }
+
+  // Admit nobody new while the server is shedding load, the clients already in come first
+  if (overloaded_shards > 0) {
+    counter_add(&self->metrics.overload_rejects, 1);
+    reject_connection(client, "Server overloaded");
+    return -1;
+  }
+
+  // Reserve a seat, the room may have filled up since the connection was accepted
+  // Other shards log clients in concurrently, so check and take the seat in one step
+  if (client_count++ >= max_clients) {
+    client_count--;
+    reject_connection(client, "Max clients reached");
+    return -1;
+  }
+
+  int id = next_client_id();
+  if (id < 0) {
+    client_count--;
+    reject_connection(client, "No client ids left");
+    return -1;
+  }
+
+  // Initialize client and start communication
+  // Clients with the same name share one interned copy of it
+  frame_copy_name(login_request, name, sizeof(name));
+  if ((client->name = intern_get(name)) == NULL) {
+    client->name = no_name;
+    client_count--;
+    server_error((char *)"Could not register client\n");
+    return -1;
+  }
+  client->entry.id = id;
+  if (add_client(client) < 0) {
+    client_count--;
+    server_error((char *)"Could not register client\n");
+    return -1;
+  }
+  pending_remove(client);
+  client->state = CONN_ACTIVE;
+  if (ping_interval > 0) {
+    timer_arm(&self->timers, &client->timer, loop_now + (long long)ping_interval * 1000);
+  } else {
+    timer_cancel(&self->timers, &client->timer);
+  }
+  client->compress = compress_min > 0 && (login_request->hdr.flags & FRAME_FLAG_COMPRESSION);
+  client->tokens = (long long)rate_burst * 1000;
+  client->tokens_at = loop_now;
+  client->throttled = 0;
+  counter_add(&self->metrics.logins, 1);
+  histogram_add(&self->metrics.login_us, (unsigned long)((metrics_now_ns() - client->accepted_ns) / 1000));
+
+  // Setup response to send back to client
+  frame_buf_t *login_resp = frame_buf_create(AUTHORIZED, client->entry.id, NULL, NULL);
+  if (login_resp) {
+    if (client->compress)
+      frame_set_flags(login_resp->data, FRAME_FLAG_COMPRESSION);
+    send_frame_to_client(login_resp, client);
+    frame_buf_release(login_resp);
+  }
+
+  client_joined(client);
+
+  return 0;
+}
+
+// Charges a command to the client's token bucket, which fills up at rate_limit commands per second
+// Attachment chunks are charged by size, one command per ATTACH_TOKEN_BYTES, so uploads cannot write
+// to disk at line rate. While the server is overloaded everything costs twice as much, throttling every sender
+// Returns 0 if the bucket is empty and the command must be dropped
+int take_token(client_t *client, const struct frame *f)
+{
+  int command = f->hdr.type;
+  if (rate_limit == 0 || command == PONG_COMMAND || command == QUIT_COMMAND)
+    return 1;
+
+  long long full = (long long)rate_burst * 1000;
+  client->tokens += (loop_now - client->tokens_at) * rate_limit;
+  client->tokens_at = loop_now;
+  if (client->tokens >= full) {
+    client->tokens = full;
+    client->throttled = 0;
+  }
+
+  long long cost = overloaded_shards > 0 ? 2000 : 1000;
+  if (command == ATTACH_COMMAND) {
+    size_t len = f->hdr.data_len > ATTACH_MIN_CHARGE ? f->hdr.data_len : ATTACH_MIN_CHARGE;
+    cost = cost * (long long)len / ATTACH_TOKEN_BYTES;
+  }
+  if (client->tokens < cost)
+    return 0;
+  client->tokens -= cost;
+  return 1;
+}
+
+// Returns 1 if a command should be dropped to shed load, telling the client the first time it is throttled
+// Commands beyond the client's rate are dropped, a dropped attachment chunk fails its upload, and while
+// the server is overloaded only one in OVERLOAD_SAMPLE low priority commands (moods and times) is let through
+int shed_command(client_t *client, const struct frame *f)
+{
+  char buff[256];
+  int command = f->hdr.type;
+
+  if (!take_token(client, f)) {
+    counter_add(&self->metrics.rate_limited, 1);
+    if (command == ATTACH_COMMAND) {
+      if (!client->upload_failed)
+        abort_upload(client, (char *)"*** The attachment was dropped, you are uploading too fast\n");
+    } else if (!client->throttled) {
+      client->throttled = 1;
+      sprintf(buff, "*** You are sending too fast, commands are dropped (limit %d per second)\n", rate_limit);
+      send_message_to_client(buff, client, NULL);
+    }
+    return 1;
+  }
+
+  if (overloaded_shards > 0 && (command == HAPPY_COMMAND || command == SAD_COMMAND ||
+                                command == MYTIME_COMMAND || command == MYTIMEPLUS_COMMAND)) {
+    if (sample_seq++ % OVERLOAD_SAMPLE != 0) {
+      counter_add(&self->metrics.sampled_out, 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Handles every complete frame buffered in the client's frame reader
+void process_frames(client_t *client)
+{
+  struct frame client_msg;
+  int rc;
+
+  // Anything heard from the client shows it is alive, the heartbeat timer checks this when it fires
+  client->last_heard = loop_now;
+  client->pinged = 0;
+
+  while (!client->closing && (rc = frame_reader_next(&client->reader, &client_msg)) > 0) {
+    int type = client_msg.hdr.type;
+    counter_add(&self->metrics.commands[type < METRIC_COMMANDS ? type : 0], 1);
+
+    if (client->state == CONN_LOGIN) {
+      if (handle_login(client, &client_msg) < 0)
+        schedule_close(client);
+      continue;
+    }
+
+    if (shed_command(client, &client_msg))
+      continue;
+
+    if (handle_client_message(client, &client_msg) < 0) {
+      schedule_close(client);
+      return;
+    }
+  }
+
+  // Malformed frame, the stream cannot be resynchronized
+  if (!client->closing && rc < 0) {
+    server_log((char *)"Malformed frame received, dropping client\n");
+    schedule_close(client);
+  }
+}
+
+// Called by the event loop when a client socket is readable
+// A single recv() on a stream socket may return part of a frame or several
+// frames, so bytes are buffered in the client's frame reader until complete
+void client_readable(client_t *client)
+{
+  ssize_t n = frame_reader_fill(&client->reader, client->connection_sock);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+
+  // recv() did not return > 0 (error or connection was closed client side)
+  if (n <= 0) {
+    schedule_close(client);
+    return;
+  }
+  counter_add(&self->metrics.bytes_in, n);
+
+  process_frames(client);
+}
+
+// Prints CLI usage
+void print_usage()
+{
+  printf("Usage: server -s -p <portnumber> [--queue-limit <bytes>] [--slow-policy drop|disconnect|coalesce]\n"
+         "              [--backlog <connections>] [--auth-timeout <seconds>] [--workers <threads>]\n"
+         "              [--log-format text|binary] [--log-flush-ms <ms>] [--log-fsync never|batch|second]\n"
+         "              [--history <messages>] [--history-secs <seconds>] [--history-bytes <bytes>]\n"
+         "              [--tcp-mode nagle|nodelay|cork] [--io epoll|uring]\n"
+         "              [--max-attachment <bytes>] [--spool-dir <directory>] [--stats-socket <path>]\n"
+         "              [--compress-min <bytes>] [--store-dir <directory>] [--store-segment-mb <MB>]\n"
+         "              [--node-id <id>] [--cluster-port <port>] [--cluster-bind <address>]\n"
+         "              [--cluster-secret <secret>] [--peer <host:port>]...\n"
+         "              [--ping-interval <seconds>] [--idle-timeout <seconds>]\n"
+         "              [--rate <commands/s>] [--burst <commands>] [--overload-queue <bytes>] [--overload-lag-ms <ms>]\n"
+         "              [--handoff-socket <path> [--takeover]] [--max-clients <clients>]\n");
+}
+
+// Set the shutdown flag upon Ctrl-C
+// Only the main thread takes the signal, its event loop sees the change and stops the other shards
+void catch_ctrl_c()
+{
+  stop_requested = 1;
+  server_running = 0;
+}
+
+// Clears the shutdown flag and wakes every shard so it notices
+void stop_shards()
+{
+  server_running = 0;
+  for (int i = 0; i < num_shards; i++) {
+    if (&shards[i] != self)
+      wake_shard(&shards[i]);
+  }
+}
+
+// Sets up a connection object for a freshly accepted socket and hands it to the event loop
+// The connection starts in CONN_LOGIN and has auth_timeout seconds to log in
+void new_connection(int connection_sock, struct sockaddr_in *client_addr)
+{
+  client_t *client = slab_alloc(&self->client_slab);
+  if (client == NULL) {
+    server_error((char *)"Could not allocate connection\n");
+    close(connection_sock);
+    return;
+  }
+  client->addr = *client_addr;
+  client->connection_sock = connection_sock;
+  client->state = CONN_LOGIN;
+  client->name = no_name;
+  client->accepted_ns = metrics_now_ns();
+  client->upload_fd = -1;
+  outq_account(&client->outq, &self->queued);
+  if (tcp_mode == TCP_MODE_NODELAY) {
+    int on = 1;
+    setsockopt(connection_sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  pending_add(client);
+  counter_add(&self->metrics.accepts, 1);
+
+  if (watch_client(client) < 0) {
+    server_error((char *)"epoll_ctl");
+    drop_connection(client);
+    return;
+  }
+
+  // Check if max number of clients have been reached
+  // Checked again at login, seats may have filled up in the meantime
+  if (client_count >= max_clients) {
+    reject_connection(client, "Max clients reached");
+    return;
+  }
+
+  send_frame_to_client(accepted_frame, client);
+}
+
+// Accepts every connection waiting on the listening socket, up to ACCEPT_BATCH
+// Sockets are accepted non-blocking and the login exchange runs in the event loop,
+// so a client that connects and never logs in cannot hold up anybody else
+// Returns -1 if the listening socket failed, 0 otherwise
+int accept_clients()
+{
+  // Socket address and port metadata for client
+  struct sockaddr_in client_addr; 
+
+  for (int i = 0; i < ACCEPT_BATCH; i++) {
+    socklen_t addrlen = sizeof(client_addr);
+    // Accept connection from client and create a new socket for the connection
+    // Places source information about client in client_addr struct
+    int connection_sock = accept4(self->listening_sock, (struct sockaddr *)&client_addr, &addrlen,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connection_sock < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;  // backlog drained
+      if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+        continue;  // this connection went away, try the next one
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        server_error((char *)"accept4: out of resources\n");
+        return 0;  // keep serving existing clients
+      }
+      server_error((char *)"accept4"); 
+      return -1;
+    } 
+
+    new_connection(connection_sock, &client_addr);
+  }
+
+  return 0;
+}
+
+// Handles a connection's timer
+// A connection that has not logged in has run out of time. For a logged in client the timer
+// is a heartbeat check: it is not moved on every read, only pushed back when it fires early,
+// so busy clients cost the wheel nothing. A client silent for ping_interval gets a PING,
+// and one still silent idle_timeout after it was last heard from is disconnected.
+void connection_timer(wheel_timer_t *timer, void *arg)
+{
+  client_t *client = (client_t *)((char *)timer - offsetof(client_t, timer));
+  char log_buff[1024];
+  (void)arg;
+
+  if (client->closing)
+    return;
+
+  if (client->state == CONN_LOGIN) {
+    sprintf(log_buff, "Login timed out for user at ");
+    append_sock_addr(client->addr, log_buff);
+    strcat(log_buff, "\n");
+    server_log(log_buff);
+    counter_add(&self->metrics.login_failures, 1);
+    schedule_close(client);
+    return;
+  }
+
+  long long ping_at = client->last_heard + (long long)ping_interval * 1000;
+  long long drop_at = client->last_heard + (long long)idle_timeout * 1000;
+
+  // An idle client gives its buffers back, so it costs little more than its connection object
+  if (loop_now >= ping_at) {
+    frame_reader_trim(&client->reader);
+    outq_trim(&client->outq);
+  }
+
+  if (loop_now >= drop_at) {
+    snprintf(log_buff, sizeof(log_buff), "Client %d (%s) did not answer for %d seconds, disconnecting\n",
+             client->entry.id, client->name, idle_timeout);
+    server_log(log_buff);
+    counter_add(&self->metrics.idle_disconnects, 1);
+    schedule_close(client);
+  } else if (loop_now >= ping_at && !client->pinged) {
+    send_frame_to_client(ping_frame, client);
+    counter_add(&self->metrics.pings, 1);
+    client->pinged = 1;
+    timer_arm(&self->timers, timer, drop_at);
+  } else {
+    timer_arm(&self->timers, timer, client->pinged ? drop_at : ping_at);
+  }
+}
+
+// Decides every OVERLOAD_CHECK_MS whether this shard is overloaded: the bytes queued for its
+// clients or the longest batch of events since the last check passed their threshold
+// A shard stays overloaded until both are back under half their threshold, so it does not flap
+void check_overload()
+{
+  char log_buff[256];
+
+  if (loop_now - load_checked < OVERLOAD_CHECK_MS)
+    return;
+  long long lag = batch_max;
+  load_checked = loop_now;
+  batch_max = 0;
+
+  size_t queued = self->queued;
+  int shift = overloaded ? 1 : 0;
+  int over = (overload_queue > 0 && queued > overload_queue >> shift) ||
+             (overload_lag > 0 && lag > overload_lag >> shift);
+  if (over == overloaded)
+    return;
+
+  overloaded = over;
+  atomic_fetch_add(&overloaded_shards, over ? 1 : -1);
+  if (over) {
+    snprintf(log_buff, sizeof(log_buff), "Shard %d overloaded (%zu bytes queued, %lld ms lag), shedding load\n",
+             (int)(self - shards), queued, lag);
+  } else {
+    snprintf(log_buff, sizeof(log_buff), "Shard %d recovered from overload\n", (int)(self - shards));
+  }
+  server_log(log_buff);
+}
+
+// Records how long the batch of events that just finished took, for check_overload()
+void end_batch()
+{
+  long long took = now_ms() - loop_now;
+  if (took > batch_max)
+    batch_max = took;
+}
+
+// Fires every connection timer that is due
+void run_timers()
+{
+  timer_wheel_advance(&self->timers, loop_now, connection_timer, NULL);
+}
+
+// Returns how long the event loop may sleep before the next timer is due (-1 for no limit)
+int next_timeout()
+{
+  return timer_wheel_next(&self->timers, now_ms());
+}
+
+/* io_uring backend */
+
+// Arms a (multishot) accept on the shard's listening socket
+void arm_accept()
+{
+  uring_prep_accept(&self->ring, self->listening_sock, SOCK_NONBLOCK | SOCK_CLOEXEC, !accept_oneshot, UOP_ACCEPT);
+  accept_armed = 1;
+}
+
+// Arms a (multishot) poll on the shard's wakeup fd
+void arm_wake()
+{
+  uring_prep_poll(&self->ring, self->wake_fd, POLLIN, 1, UOP_WAKE);
+  wake_armed = 1;
+}
+
+// Handles a connection accepted by io_uring
+void accept_completed(const uring_cqe_t *cqe)
+{
+  if (cqe->res >= 0) {
+    struct sockaddr_in client_addr;
+    socklen_t addrlen = sizeof(client_addr);
+    if (!server_running && !exporting) {
+      close(cqe->res);
+    } else if (getpeername(cqe->res, (struct sockaddr *)&client_addr, &addrlen) < 0) {
+      close(cqe->res);  // the connection went away already
+    } else {
+      new_connection(cqe->res, &client_addr);
+    }
+  } else if (cqe->res == -EINVAL && !accept_oneshot) {
+    accept_oneshot = 1;  // kernel without multishot accept
+  } else if (cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOBUFS || cqe->res == -ENOMEM) {
+    server_error((char *)"accept: out of resources\n");
+  }
+
+  if (!(cqe->flags & URING_CQE_MORE)) {
+    accept_armed = 0;
+    if (server_running)
+      arm_accept();
+  }
+}
+
+// Handles bytes (or the end of the stream) received by io_uring
+void recv_completed(client_t *client, const uring_cqe_t *cqe)
+{
+  char *buff = uring_cqe_buffer(&self->ring, cqe);
+  int more = cqe->flags & URING_CQE_MORE;
+
+  if (!more)
+    client->io_refs--;
+
+  if (!client->released && !client->closing && cqe->res > 0) {
+    counter_add(&self->metrics.bytes_in, cqe->res);
+    if (frame_reader_append(&client->reader, buff, cqe->res) < 0) {
+      server_error((char *)"Could not buffer received bytes\n");
+      schedule_close(client);
+    }
+  }
+  uring_recycle(&self->ring, cqe);
+
+  if (client->released) {
+    if (client->io_refs == 0)
+      release_connection(client);
+    return;
+  }
+  if (client->closing)
+    return;
+
+  // A connection being handed over is not read any further, the next server processes what arrived
+  if (exporting)
+    return;
+
+  if (cqe->res > 0) {
+    process_frames(client);
+  } else if (cqe->res == 0) {
+    schedule_close(client);  // connection was closed client side
+    return;
+  } else if (cqe->res == -EINVAL && !recv_oneshot) {
+    recv_oneshot = 1;  // kernel without multishot recv
+  } else if (cqe->res != -ENOBUFS && cqe->res != -EINTR) {
+    schedule_close(client);
+    return;
+  }
+
+  // Multishot receives end when buffers run out, re-arm
+  if (!more && !client->closing)
+    arm_recv(client);
+}
+
+// Handles the completion of an io_uring send
+void send_completed(client_t *client, const uring_cqe_t *cqe)
+{
+  char log_buff[1024];
+
+  client->sending = 0;
+  client->io_refs--;
+  client->outq.pinned = 0;
+  slab_free(&self->send_slab, client->send);
+  client->send = NULL;
+  if (cqe->res > 0)
+    outq_advance(&client->outq, cqe->res, &self->writes);
+
+  if (client->released) {
+    if (client->io_refs == 0)
+      release_connection(client);
+    return;
+  }
+  // A cancelled send, the rest of the queue goes to the next server
+  if (exporting)
+    return;
+  if (cqe->res < 0) {
+    counter_add(&self->metrics.send_failures, 1);
+    sprintf(log_buff, "Write to client %d failed\n", client->entry.id);
+    server_log(log_buff);
+    schedule_close(client);
+    return;
+  }
+
+  // Frames queued while the send was in flight go out with the next batch
+  if (!client->closing && !outq_empty(&client->outq))
+    schedule_flush(client);
+}
+
+// Handles the poll that paces an attachment's file contents to a client
+void writable_completed(client_t *client)
+{
+  client->sending = 0;
+  client->io_refs--;
+
+  if (client->released) {
+    if (client->io_refs == 0)
+      release_connection(client);
+    return;
+  }
+
+  // A failed poll shows up as a failed write on the next flush
+  if (!client->closing)
+    schedule_flush(client);
+}
+
+// Creates a listening socket bound to the server's address
+// Returns the socket, or -1 on failure
+int open_listener(struct sockaddr_in *addr)
+{
+  // Create TCP listening socket for accepting connections
+  // Non-blocking so accept_clients() can drain the backlog without stalling the event loop
+  int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0) { 
+    server_error((char *)"Socket creation failed.\n"); 
+    return -1;
+  } 
+      
+  // Set SO_REUSEADDR option to avoid binding issues after the server was previously shutdown
+  // and SO_REUSEPORT so every shard can listen on the same port
+  int sock_opt = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sock_opt, sizeof(sock_opt)) ||
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &sock_opt, sizeof(sock_opt))) { 
+    server_error((char *)"setsockopt failed"); 
+    close(sock);
+    return -1;
+  } 
+
+  // Forcefully attaching socket to the port number and IP address
+  // Incoming messages to the IP + port combo will come through this socket 
+  if (bind(sock, (struct sockaddr *)addr, sizeof(*addr)) < 0) { 
+    server_error((char *)"Binding failed"); 
+    close(sock);
+    return -1;
+  } 
+
+  // Starting listening for new connections
+  // The kernel caps the backlog at net.core.somaxconn
+  if (listen(sock, listen_backlog) < 0) { 
+    server_error((char *)"listen"); 
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+// Main server thread, runs the event loop that accepts and serves every client
+// Creates a shard's listening socket, wakeup fd and event loop
+// Every shard binds the same address, SO_REUSEPORT lets the kernel balance connections between them
+// A listening socket handed over by the previous server (listen_fd, -1 for none) is used as it is,
+// so the connections waiting in its queue are not lost
+// Returns -1 on failure
+int setup_shard(shard_t *shard, struct sockaddr_in *server_addr, int listen_fd)
+{
+  shard->ring.fd = -1;  // the io_uring ring is created by the shard's own thread
+  timer_wheel_init(&shard->timers, now_ms());
+  slab_init(&shard->client_slab, sizeof(client_t), CLIENT_SLAB_CHUNK);
+  slab_init(&shard->send_slab, sizeof(send_ctx_t), SEND_SLAB_CHUNK);
+
+  shard->listening_sock = listen_fd >= 0 ? listen_fd : open_listener(server_addr);
+  if (shard->listening_sock < 0)
+    return -1;
+
+  // Create the event loop and watch the listening socket for new connections
+  // Client sockets are added to the same loop as soon as they are accepted
+  if ((shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+      (shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    server_error((char *)"epoll_create1");
+    return -1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;  // NULL marks the listening socket, clients carry their client_t
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listening_sock, &ev) < 0) {
+    server_error((char *)"epoll_ctl");
+    return -1;
+  }
+  ev.data.ptr = shard;  // the shard itself marks its wakeup fd
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wake_fd, &ev) < 0) {
+    server_error((char *)"epoll_ctl");
+    return -1;
+  }
+
+  shard->rooms = (registry_t *)calloc(MAX_ROOMS, sizeof(registry_t));
+  if (shard->rooms == NULL) {
+    server_error((char *)"Could not allocate rooms\n");
+    return -1;
+  }
+
+  // Allocate the history arena up front, recording messages never allocates
+  if (history_init(&shard->history, history_bytes, history_msgs, room_release) < 0) {
+    server_error((char *)"Could not allocate message history\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Upgrade handoff */
+
+// Closes the shard's end of a connection that was handed over and frees it
+// Nobody is told the client left, it is still connected to the next server
+void forget_connection(client_t *client)
+{
+  if (io_backend == IO_EPOLL)
+    epoll_ctl(self->epoll_fd, EPOLL_CTL_DEL, client->connection_sock, NULL);
+  timer_cancel(&self->timers, &client->timer);
+  close(client->connection_sock);
+  if (client->upload_fd >= 0)
+    close(client->upload_fd);
+  frame_reader_free(&client->reader);
+  outq_free(&client->outq);
+  if (client->name != no_name)
+    intern_put(client->name);
+  slab_free(&self->client_slab, client);
+}
+
+// Sends a connection, what it sent that was not processed and the frames queued for it to the next server
+// Returns -1 if the next server went away
+int export_connection(client_t *client, int conn)
+{
+  handoff_conn_t msg;
+  handoff_block_t block;
+  const char *input;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = HANDOFF_CONN;
+  msg.id = client->state == CONN_ACTIVE ? client->entry.id : 0;
+  msg.compress = client->compress;
+  msg.pinged = client->pinged;
+  msg.throttled = client->throttled;
+  msg.upload_failed = client->upload_failed;
+  msg.addr = client->addr;
+  msg.last_heard = client->last_heard;
+  msg.tokens = client->tokens;
+  msg.tokens_at = client->tokens_at;
+  msg.dropped = client->dropped;
+  msg.upload_len = client->upload_len;
+  strcpy(msg.name, client->name);
+  if (client->state == CONN_ACTIVE)
+    strcpy(msg.room, room_name(client->room));
+  int fds[2] = { client->connection_sock, client->upload_fd };
+  if (handoff_send(conn, &msg, sizeof(msg), fds, client->upload_fd >= 0 ? 2 : 1) < 0)
+    return -1;
+
+  memset(&block, 0, sizeof(block));
+  block.len = frame_reader_pending(&client->reader, &input);
+  if (block.len > 0) {
+    block.type = HANDOFF_INPUT;
+    if (handoff_send(conn, &block, sizeof(block), NULL, 0) < 0 ||
+        handoff_send_data(conn, input, block.len) < 0)
+      return -1;
+  }
+
+  for (unsigned i = 0; i < client->outq.count; i++) {
+    frame_buf_t *fb = outq_at(&client->outq, i);
+    block.type = HANDOFF_OUTPUT;
+    block.len = fb->len;
+    block.skip = i == 0 ? client->outq.offset : 0;
+    block.file_len = fb->file_fd >= 0 ? fb->file_len : 0;
+    if (handoff_send(conn, &block, sizeof(block), &fb->file_fd, block.file_len > 0 ? 1 : 0) < 0 ||
+        handoff_send_data(conn, fb->data, fb->len) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Logs in a connection the previous server had logged in, under the same id, name and room
+// Returns -1 if it could not be registered
+int adopt_login(client_t *client, const handoff_conn_t *meta)
+{
+  if ((client->name = intern_get(meta->name)) == NULL) {
+    client->name = no_name;
+    return -1;
+  }
+  client->entry.id = meta->id;
+  client_count++;
+  if (add_client(client) < 0) {
+    client_count--;
+    return -1;
+  }
+  pending_remove(client);
+  client->state = CONN_ACTIVE;
+
+  // The heartbeat check catches up with when the client was last heard from as soon as it fires
+  if (ping_interval > 0) {
+    timer_arm(&self->timers, &client->timer, loop_now);
+  } else {
+    timer_cancel(&self->timers, &client->timer);
+  }
+
+  int room = room_lookup(meta->room, 1, NULL);
+  if (room >= 0 && room != client->room) {
+    exit_room(client);
+    if (enter_room(client, room) < 0)
+      enter_room(client, LOBBY_ROOM);
+  }
+  if (room >= 0)
+    room_release(room);
+  return 0;
+}
+
+// Adopts the connections the previous server handed over to this shard
+// They pick up where they left off, with their unsent frames still queued, and nobody is
+// told anything: to the chat room the upgrade is invisible
+void adopt_connections()
+{
+  while (self->adopted) {
+    adopted_t *a = self->adopted;
+    self->adopted = a->next;
+
+    client_t *client = slab_alloc(&self->client_slab);
+    if (client == NULL) {
+      server_error((char *)"Could not allocate connection\n");
+      close(a->sock);
+      if (a->upload_fd >= 0)
+        close(a->upload_fd);
+      frame_reader_free(&a->reader);
+      outq_free(&a->outq);
+      free(a);
+      continue;
+    }
+    client->addr = a->meta.addr;
+    client->connection_sock = a->sock;
+    client->state = CONN_LOGIN;
+    client->name = no_name;
+    client->accepted_ns = metrics_now_ns();
+    client->reader = a->reader;
+    client->outq = a->outq;
+    outq_account(&client->outq, &self->queued);
+    client->compress = a->meta.compress;
+    client->last_heard = a->meta.last_heard;
+    client->pinged = a->meta.pinged;
+    client->tokens = a->meta.tokens;
+    client->tokens_at = a->meta.tokens_at;
+    client->throttled = a->meta.throttled;
+    client->dropped = a->meta.dropped;
+    client->upload_fd = a->upload_fd;
+    client->upload_len = a->meta.upload_len;
+    client->upload_failed = a->meta.upload_failed;
+    pending_add(client);
+
+    if (watch_client(client) < 0) {
+      server_error((char *)"epoll_ctl");
+      drop_connection(client);
+    } else if (a->meta.id != 0 && adopt_login(client, &a->meta) < 0) {
+      server_error((char *)"Could not register client\n");
+      schedule_close(client);
+    } else {
+      const char *input;
+      if (!outq_empty(&client->outq))
+        schedule_flush(client);
+      if (frame_reader_pending(&client->reader, &input) > 0)
+        process_frames(client);
+    }
+    free(a);
+  }
+  flush_clients();
+}
+
+// Runs a shard's epoll event loop until the server encounters an error or is shut down
+// Sleeps in epoll_wait() until a socket is ready, another shard posts a broadcast
+// or a connection's timer is due, so idle connections cost no CPU
+void run_epoll_loop()
+{
+  struct epoll_event events[MAX_EVENTS];
+  adopt_connections();
+  while (server_running) {
+    int n = epoll_wait(self->epoll_fd, events, MAX_EVENTS, next_timeout());
+    loop_now = now_ms();
+    check_overload();
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;  // interrupted by a signal, re-check server_running
+      server_error((char *)"epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == self) {
+        drain_inbox();
+        continue;
+      }
+
+      client_t *client = (client_t *)events[i].data.ptr;
+      if (client == NULL) {
+        if (accept_clients() < 0)
+          server_running = 0;
+        continue;
+      }
+
+      // Skip clients disconnected earlier in this batch
+      if (client->closing)
+        continue;
+      if (events[i].events & EPOLLOUT)
+        flush_client(client);
+      if (!client->closing && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        client_readable(client);
+    }
+
+    // Write what the batch queued, then disconnect whoever failed or asked to leave
+    flush_clients();
+    run_timers();
+    reap_clients();
+    flush_clients();
+    end_batch();
+  }
+}
+
+// Handles every completion io_uring has posted
+void handle_completions()
+{
+  uring_cqe_t cqe;
+  while (uring_peek(&self->ring, &cqe)) {
+    client_t *client = (client_t *)(uintptr_t)(cqe.user_data & ~(uint64_t)UOP_MASK);
+    switch (cqe.user_data & UOP_MASK) {
+      case UOP_ACCEPT:
+        accept_completed(&cqe);
+        break;
+      case UOP_WAKE:
+        drain_inbox();
+        if (!(cqe.flags & URING_CQE_MORE)) {
+          wake_armed = 0;
+          if (server_running)
+            arm_wake();
+        }
+        break;
+      case UOP_RECV:
+        recv_completed(client, &cqe);
+        break;
+      case UOP_SEND:
+        send_completed(client, &cqe);
+        break;
+      case UOP_WRITABLE:
+        writable_completed(client);
+        break;
+    }
+  }
+}
+
+// Re-arms a connection's receive after a failed handoff, and its send if frames are waiting
+void resume_client(client_t *client)
+{
+  if (!client->cancelled)
+    return;
+  client->cancelled = 0;
+  if (client->io_refs == 0 && !client->closing)
+    arm_recv(client);  // a request still in flight was not cancelled in time, it is still armed
+  if (!outq_empty(&client->outq))
+    schedule_flush(client);
+}
+
+// Re-arms what settle_uring() cancelled, for a shard that carries on after a failed handoff
+void resume_uring()
+{
+  exporting = 0;
+  if (!accept_armed)
+    arm_accept();
+  if (!wake_armed)
+    arm_wake();
+  for (unsigned i = 0; i < clients.count; i++)
+    resume_client(client_at(i));
+  for (client_t *client = pending_head; client; client = client->next_pending)
+    resume_client(client);
+}
+
+// Runs a shard's io_uring event loop until the server encounters an error or is shut down
+// Accepts and receives are multishot requests that stay armed, and every
+// send queued during a batch is submitted with the wait for the next one in
+// a single io_uring_enter()
+void run_uring_loop()
+{
+  // A shard that carries on after a failed handoff keeps its ring and re-arms what was cancelled
+  if (exporting) {
+    resume_uring();
+  } else {
+    if (uring_init(&self->ring, URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE) < 0) {
+      server_error((char *)"io_uring_setup");
+      return;
+    }
+    arm_accept();
+    arm_wake();
+  }
+  adopt_connections();
+
+  while (server_running) {
+    if (uring_wait(&self->ring, next_timeout()) < 0 && errno != EINTR && errno != ETIME) {
+      server_error((char *)"io_uring_enter");
+      break;
+    }
+    loop_now = now_ms();
+    check_overload();
+
+    handle_completions();
+
+    // Write what the batch queued, then disconnect whoever failed or asked to leave
+    flush_clients();
+    run_timers();
+    reap_clients();
+    flush_clients();
+    end_batch();
+  }
+}
+
+// Waits for the io_uring requests of closed connections to complete so they can be freed
+// Every socket has been shut down, so this takes at most a few round trips
+void drain_lingering()
+{
+  for (int tries = 0; lingering > 0 && tries < 100; tries++) {
+    if (uring_wait(&self->ring, 10) < 0 && errno != EINTR && errno != ETIME)
+      break;
+    handle_completions();
+  }
+}
+
+// Stops every io_uring request of the shard's connections so they can be handed over
+// Receives are cancelled rather than shut down, the sockets must stay usable for the next server
+// What they received meanwhile is kept in the connections' frame readers
+void settle_uring()
+{
+  exporting = 1;
+  uring_prep_cancel(&self->ring, UOP_ACCEPT, UOP_CANCEL);
+
+  for (int tries = 0; tries < 100; tries++) {
+    int busy = 0;
+    for (unsigned i = 0; i < clients.count; i++) {
+      client_t *client = client_at(i);
+      busy |= client->io_refs > 0;
+      if (client->io_refs > 0 && !client->cancelled) {
+        uring_prep_cancel(&self->ring, uring_tag(client, UOP_RECV), UOP_CANCEL);
+        uring_prep_cancel(&self->ring, uring_tag(client, UOP_SEND), UOP_CANCEL);
+        uring_prep_cancel(&self->ring, uring_tag(client, UOP_WRITABLE), UOP_CANCEL);
+        client->cancelled = 1;
+      }
+    }
+    for (client_t *client = pending_head; client; client = client->next_pending) {
+      busy |= client->io_refs > 0;
+      if (client->io_refs > 0 && !client->cancelled) {
+        uring_prep_cancel(&self->ring, uring_tag(client, UOP_RECV), UOP_CANCEL);
+        uring_prep_cancel(&self->ring, uring_tag(client, UOP_SEND), UOP_CANCEL);
+        client->cancelled = 1;
+      }
+    }
+    if (!busy)
+      break;
+    if (uring_wait(&self->ring, 10) < 0 && errno != EINTR && errno != ETIME)
+      break;
+    handle_completions();
+  }
 }
 
-// Prints the string to stderr and writes it to the server's log file
-void server_error(char *s)
+// Sends the shard's listening socket and every one of its connections to the next server
+// The shard keeps them all until the next server confirms it took everything over
+// Returns -1 if the next server went away
+int export_shard()
 {
-  perror(s);
-  fprintf(log_file, "%s", s);
+  int conn = handoff_conn;
+  unsigned sent = 0;
+
+  if (io_backend == IO_URING)
+    settle_uring();
+
+  pthread_mutex_lock(&handoff_lock);
+  handoff_listener_t listener = { HANDOFF_LISTENER, (uint32_t)(self - shards) };
+  int rc = handoff_send(conn, &listener, sizeof(listener), &self->listening_sock, 1);
+  for (unsigned i = 0; rc == 0 && i < clients.count; i++) {
+    if ((rc = export_connection(client_at(i), conn)) == 0)
+      sent++;
+  }
+  for (client_t *client = pending_head; rc == 0 && client; client = client->next_pending) {
+    if ((rc = export_connection(client, conn)) == 0)
+      sent++;
+  }
+  handoff_sent += sent;
+  pthread_mutex_unlock(&handoff_lock);
+
+  return rc;
 }
 
-// Appends the IP address and port number of a socket to a string
-void append_sock_addr(struct sockaddr_in addr, char *buff)
+// Lets go of every connection of the shard once the next server took them over
+void forget_shard()
 {
-  char temp_buff[1024];
-  sprintf(temp_buff, "IP: %d.%d.%d.%d port: %d",
-        addr.sin_addr.s_addr & 0xff,
-        (addr.sin_addr.s_addr & 0xff00) >> 8,
-        (addr.sin_addr.s_addr & 0xff0000) >> 16,
-        (addr.sin_addr.s_addr & 0xff000000) >> 24,
-        addr.sin_port);
+  char log_buff[256];
+  unsigned handed = 0;
+
+  while (clients.count > 0) {
+    client_t *client = client_at(clients.count - 1);
+    registry_remove(&clients, &client->entry);
+    forget_connection(client);
+    handed++;
+  }
+  while (pending_head) {
+    client_t *client = pending_head;
+    pending_remove(client);
+    forget_connection(client);
+    handed++;
+  }
 
-  strcat(buff, temp_buff);
+  sprintf(log_buff, "Shard %d handed %u connections over to the next server\n", (int)(self - shards), handed);
+  server_log(log_buff);
 }
 
-/* clients data structure methods */
-
-// Adds a client to the clients array
-// Insert at the end of the array
-void add_client(client_t *client)
+// Called by a shard whose event loop stopped: if a new server is taking over, sends it the shard's
+// connections and waits for the handoff thread to hear whether it took them all
+// Returns 1 if the shard is done and shuts down, 0 if the handoff failed and it has to run again
+int hand_over_shard()
 {
-  pthread_mutex_lock(&clients_mutex);
-  clients[client_count++] = client;
-  pthread_mutex_unlock(&clients_mutex);
+  pthread_mutex_lock(&handoff_lock);
+  if (handoff_conn < 0) {
+    handoff_closed = 1;  // shutting down, a server that connects now is turned away
+    pthread_mutex_unlock(&handoff_lock);
+    return 1;
+  }
+  pthread_mutex_unlock(&handoff_lock);
+
+  int rc = export_shard();
+
+  pthread_mutex_lock(&handoff_lock);
+  unsigned round = handoff_round;
+  handoff_reports++;
+  handoff_failed |= rc < 0;
+  pthread_cond_broadcast(&handoff_cond);
+  while (handoff_round == round)
+    pthread_cond_wait(&handoff_cond, &handoff_lock);
+  int done = handoff_done;
+  pthread_mutex_unlock(&handoff_lock);
+
+  if (done)
+    forget_shard();
+  return done;
 }
 
-// Removes a client from the clients array
-// Shifts elements after client 1 spot to the left
-void delete_client(client_t *client)
+// Runs a shard's event loop on the selected backend
+void run_event_loop()
 {
-  pthread_mutex_lock(&clients_mutex);
-
-  // Find index of client in the array
-  int pos;
-  for (pos = 0; pos < client_count; pos++) {
-    if (clients[pos]->id == client->id) {
-      break;
-    }
+  thread_metrics = &self->metrics;
+  loop_now = now_ms();
+  if (io_backend == IO_URING) {
+    run_uring_loop();
+  } else {
+    run_epoll_loop();
   }
 
-  // Shift elements
-  for (int i = pos; i < client_count - 1; i++) {
-    clients[i] = clients[i + 1];
-  }
-  clients[--client_count] = 0;
+  // Bring down the other shards too if this one failed
+  stop_shards();
+}
 
-  pthread_mutex_unlock(&clients_mutex);
+// Shard was shutdown:
+//   1. tell every client of the shard the connection is closing and close it
+//   2. close the shard's listening socket and event loop
+void shutdown_shard()
+{
+  flush_clients();
+  closing_list = NULL;
+  while (clients.count > 0) {
+    client_t *client = client_at(clients.count - 1);
+    unwatch_client(client);
+    send_closed_signal(client);
+    log_disconnect(client);
+    delete_client(client);
+  }
+  while (pending_head)
+    drop_connection(pending_head);
+  if (io_backend == IO_URING) {
+    drain_lingering();
+    uring_free(&self->ring);
+  }
 
-  free(client); // free the memory
+  // Close the listening socket
+  close(self->listening_sock);
+  close(self->epoll_fd);
+  registry_free(&clients);
+  for (int i = 0; i < MAX_ROOMS; i++)
+    registry_free(&self->rooms[i]);
+  free(self->rooms);
+  history_free(&self->history);
+  slab_destroy(&self->client_slab);
+  slab_destroy(&self->send_slab);
+  frame_pool_drain();
+  thread_metrics = NULL;  // the shard's metrics go away with the shards array
 }
 
-// Sends a message to a client
-// If src is null then the message is being sent by the server
-void send_message_to_client(char *s, client_t *dst, client_t *src)
+// Logs how many send calls it took to deliver each message, across every shard
+// Only called once the shards have stopped
+void log_write_stats()
 {
-  struct server_message msg;
   char log_buff[1024];
+  unsigned long syscalls = 0, frames = 0;
 
-  msg.status = OPEN;
-  strcpy(msg.data, s);
-  if (src == NULL) {
-    msg.uid = 0;
-    strcpy(msg.username, SERVER_USERNAME);
-  } else {
-    msg.uid = src->id;
-    strcpy(msg.username, src->name);
+  for (int i = 0; i < num_shards; i++) {
+    syscalls += counter_get(&shards[i].writes.syscalls);
+    frames += counter_get(&shards[i].writes.frames);
   }
-  if (send(dst->connection_sock, &msg, sizeof(msg), 0) < 0) {
-    // todo: better error handling??
-    sprintf(log_buff, "Write to client %d failed\n", dst->id);
+  if (frames == 0)
+    return;
+
+  sprintf(log_buff, "Wrote %lu frames to clients in %lu send calls (%.3f syscalls per message)\n",
+          frames, syscalls, (double)syscalls / frames);
+  server_log(log_buff);
+
+  if (io_backend == IO_URING) {
+    unsigned long enters = 0;
+    for (int i = 0; i < num_shards; i++)
+      enters += shards[i].ring.enters;
+    sprintf(log_buff, "io_uring submitted them with %lu io_uring_enter calls\n", enters);
     server_log(log_buff);
-  } 
+  }
 }
 
-// Sends messages to all clients connected to server
-void send_message_to_all(char *s, client_t *src)
+// Returns the memory one connection may hold: its connection object alone when idle, and when busy
+// also a frame being received, its decompressed data and up to queue_limit bytes of frames queued
+size_t connection_bytes(int busy)
 {
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < client_count; i++) {
-    if (clients[i]) {
-      send_message_to_client(s, clients[i], src);
-    }
-  }
-  pthread_mutex_unlock(&clients_mutex);
+  size_t bytes = sizeof(client_t);
+  if (busy)
+    bytes += frame_length(USERNAME_LENGTH, MAX_FRAME_DATA) + MAX_FRAME_DATA + queue_limit;
+  return bytes;
 }
 
-// Sends message to all clients in server except the client who sent the message
-void send_message_to_all_except(char *s, client_t *src, client_t *except)
+// Raises the soft limit on open files so max_clients connections fit, as far as the hard limit allows
+// Lowers max_clients if even the hard limit is too low
+// Runs before anything is opened, the log included: returns the soft limit in effect and sets *raised
+// if this raised it, for main() to log once it can
+rlim_t raise_open_files_limit(int *raised)
 {
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < client_count; i++) {
-    if (clients[i] && clients[i] != except) {
-      send_message_to_client(s, clients[i], src);
+  struct rlimit limit;
+
+  *raised = 0;
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+    return RLIM_INFINITY;
+  rlim_t want = (rlim_t)max_clients + FD_RESERVE;
+  if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < want) {
+    rlim_t next_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > want ? want : limit.rlim_max;
+    struct rlimit next = { next_cur, limit.rlim_max };
+    if (next_cur > limit.rlim_cur && setrlimit(RLIMIT_NOFILE, &next) == 0) {
+      limit.rlim_cur = next_cur;
+      *raised = 1;
     }
   }
-  pthread_mutex_unlock(&clients_mutex);
+  if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < want)
+    max_clients = limit.rlim_cur > 2 * FD_RESERVE ? (int)(limit.rlim_cur - FD_RESERVE) : (int)(limit.rlim_cur / 2);
+  return limit.rlim_cur;
 }
 
-// Sends the chat room list of commands to a client
-void send_menu(client_t *client)
+// Renders the stats report: server wide gauges, then every shard's metrics added up
+// Shards keep running while their counters are read, so the report is not an exact snapshot
+size_t render_stats(char *buff, size_t size)
 {
-  char buff_out[2048];
-  strcat(buff_out, "*** :)        Send 'Feeling happy'\r\n");
-  strcat(buff_out, "*** :(        Send 'Feeling sad'\r\n");
-  strcat(buff_out, "*** :mytime   Send the current time\r\n");
-  strcat(buff_out, "*** :+1hr     Send the current time + 1 hour\r\n");
-  strcat(buff_out, "*** :Exit     Quit\r\n");
-  strcat(buff_out, "*** :help     Show help\r\n");
+  metrics_t total;
+  unsigned long syscalls = 0, frames = 0, bytes = 0;
+
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < num_shards; i++) {
+    metrics_sum(&total, &shards[i].metrics);
+    syscalls += counter_get(&shards[i].writes.syscalls);
+    frames += counter_get(&shards[i].writes.frames);
+    bytes += counter_get(&shards[i].writes.bytes);
+  }
 
-  send_message_to_client(buff_out, client, NULL);
-}
+  unsigned long conns = 0, conn_slots = 0, sends = 0, send_slots = 0;
+  for (int i = 0; i < num_shards; i++) {
+    conns += counter_get(&shards[i].client_slab.in_use);
+    conn_slots += counter_get(&shards[i].client_slab.capacity);
+    sends += counter_get(&shards[i].send_slab.in_use);
+    send_slots += counter_get(&shards[i].send_slab.capacity);
+  }
 
-// Sends a signal to a client indicating that it is going to close its connection
-void send_closed_signal(client_t *client) {
-  struct server_message msg;
-
-  msg.status = CLOSED;
-  msg.uid = 0;
-  strcpy(msg.username, SERVER_USERNAME);
-  strcpy(msg.data, "*** Server has terminated connection\n");
-  if (send(client->connection_sock, &msg, sizeof(msg), 0) < 0) {
-    // todo: better error handling??
-    printf("Write to client %d failed\n", client->id);
-  } 
+  int len = snprintf(buff, size, "uptime_ms %lld\nshards %d\nclients %d\nrooms %d\n"
+                     "frames_out %lu\nbytes_out %lu\nsend_calls %lu\n"
+                     "connection_slab %lu/%lu (%zu bytes each)\nsend_slab %lu/%lu\ninterned_names %lu\n"
+                     "overloaded_shards %d\nmax_clients %d\nconnection_bytes_idle %zu\nconnection_bytes_busy %zu\n",
+                     now_ms() - started_ms, num_shards, client_count, rooms_in_use(),
+                     frames, bytes, syscalls,
+                     conns, conn_slots, sizeof(client_t), sends, send_slots, intern_count(),
+                     overloaded_shards, max_clients, connection_bytes(0), connection_bytes(1));
+  if (len < 0 || (size_t)len >= size)
+    return 0;
+
+  if (store_path) {
+    unsigned long stored, dropped;
+    unsigned segments;
+    store_stats(&stored, &segments, &dropped);
+    int n = snprintf(buff + len, size - len, "store_records %lu\nstore_segments %u\nstore_dropped %lu\n",
+                     stored, segments, dropped);
+    if (n < 0 || (size_t)n >= size - len)
+      return len;
+    len += n;
+  }
+  if (cluster_port || peer_count) {
+    unsigned links;
+    unsigned long relayed_out, relayed_in;
+    relay_stats(&links, &relayed_out, &relayed_in);
+    int n = snprintf(buff + len, size - len, "node_id %d\nrelay_links %u\nrelay_frames_out %lu\nrelay_frames_in %lu\n",
+                     node_id, links, relayed_out, relayed_in);
+    if (n < 0 || (size_t)n >= size - len)
+      return len;
+    len += n;
+  }
+  return len + metrics_render(&total, buff + len, size - len);
 }
 
-// Closes a client connection
-void close_connection(client_t *client)
+// Stats endpoint thread, writes a report to every connection on the stats socket and closes it
+// Runs until the socket is shut down by shutdown_server()
+void *stats_thread()
 {
-  char log_buff[2048];
+  char buff[8192];
+
+  for (;;) {
+    int conn = accept4(stats_sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
 
-  close(client->connection_sock);  // close the socket
+    size_t len = render_stats(buff, sizeof(buff)), done = 0;
+    while (done < len) {
+      ssize_t n = send(conn, buff + done, len - done, MSG_NOSIGNAL);
+      if (n <= 0)
+        break;
+      done += n;
+    }
+    close(conn);
+  }
 
-  sprintf(log_buff, "Client %d (%s) disconnected\n", client->id, client->name);
-  server_log(log_buff);
+  return NULL;
 }
 
-// Per-connection server thread for communicating with a client
-// Client information (i.e. display name, id, socket number) passed in via arg
-// Reads in input from client and sends it to all other clients in the server
-void *client_comm(void *arg)
+// Creates the stats socket at stats_path and starts the thread that serves it
+// Returns -1 on failure
+int start_stats()
 {
-  char in_buff[2048], out_buff[2048], log_buff[2048];
-  struct client_message client_msg;   // data received from client
+  struct sockaddr_un addr;
 
-  client_t *client = (client_t *)arg;
+  if (strlen(stats_path) >= sizeof(addr.sun_path)) {
+    server_error((char *)"Stats socket path is too long\n");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, stats_path);
+
+  stats_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (stats_sock < 0) {
+    server_error((char *)"stats socket");
+    return -1;
+  }
+  unlink(stats_path);  // left over from a server that did not shut down cleanly
+  if (bind(stats_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(stats_sock, 16) < 0) {
+    server_error((char *)"stats socket bind");
+    close(stats_sock);
+    stats_sock = -1;
+    return -1;
+  }
+  if (pthread_create(&stats_tid, NULL, &stats_thread, NULL) != 0) {
+    server_error((char *)"pthread_create");
+    close(stats_sock);
+    unlink(stats_path);
+    stats_sock = -1;
+    return -1;
+  }
 
-  // Time info
-  time_t tme;
-  struct tm *time_info;
+  return 0;
+}
 
-  sprintf(log_buff, "Client %d (%s) accepted from ", client->id, client->name);
-  append_sock_addr(client->addr, log_buff);
-  strcat(log_buff, "\n");
-  server_log(log_buff);
+// Stops the stats thread, shutting the socket down makes its accept() fail
+void stop_stats()
+{
+  if (stats_sock < 0)
+    return;
 
-  // Tell other clients that a new client has joined
-  sprintf(out_buff, "*** %s has joined the chat room!\n", client->name);
-  server_log(out_buff);
-  send_message_to_all_except(out_buff, NULL, client);
+  shutdown(stats_sock, SHUT_RDWR);
+  pthread_join(stats_tid, NULL);
+  close(stats_sock);
+  unlink(stats_path);
+}
 
-  // Print the help menu to the new client
-  send_menu(client);
+// Tells the next server the handoff is complete and waits for it to confirm it took every connection over
+// Returns -1 if it did not, or did not answer within HANDOFF_TIMEOUT seconds
+int confirm_handoff(int conn, unsigned sent)
+{
+  handoff_end_t end = { HANDOFF_END, node_id * RELAY_ID_SPACE + 1 + (int)(client_seq % RELAY_ID_SPACE) };
+  handoff_ack_t ack;
+  char *buff = malloc(HANDOFF_MSG_MAX);
+  int fds[HANDOFF_MAX_FDS], nfds = 0;
+  ssize_t n = -1;
+
+  if (buff && handoff_send(conn, &end, sizeof(end), NULL, 0) == 0)
+    n = handoff_recv(conn, buff, fds, &nfds);
+  if (n == sizeof(ack))
+    memcpy(&ack, buff, sizeof(ack));
+  for (int i = 0; i < nfds; i++)
+    close(fds[i]);
+  free(buff);
+
+  return n == sizeof(ack) && ack.type == HANDOFF_ACK && ack.connections == sent ? 0 : -1;
+}
 
-  // Spin as long as server is still running and the connection is still alive
-  fd_set rfds;
-  int rc;
-  struct timeval no_timeout; 
-  no_timeout.tv_sec = 0;  // set timeout to 0 so select() immediately returns
-  no_timeout.tv_usec = 0;
-  while (server_running) {
-    // Use select() to check if there is data to be read in the socket
-    // Can go right to next iteration of loop if no data to read instead of blocking on recv() all the time
-    FD_ZERO(&rfds);
-    FD_SET(client->connection_sock, &rfds);
-    if ((rc = select(client->connection_sock + 1, &rfds, NULL, NULL, &no_timeout)) < 0) {
-      // Error, close connection
-      server_error((char *)"select() error after connection established\n");
+// Handoff thread, waits for the next server to connect to the handoff socket and runs the handoff
+// Every shard stops and sends its connections, but only lets go of them once the next server confirms
+// it has them all; otherwise the shards carry on and the thread waits for another server.
+// Runs until a handoff succeeds or the socket is shut down by stop_handoff()
+void *handoff_thread()
+{
+  handoff_hello_t hello = { HANDOFF_HELLO, HANDOFF_VERSION, sizeof(handoff_conn_t), (uint32_t)num_shards };
+  struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+
+  for (;;) {
+    int conn = accept4(handoff_sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
       break;
     }
-
-    // Check if the data is available
-    if (!FD_ISSET(client->connection_sock, &rfds))
+    // A next server that stops reading or answering must not hold the shards up for good
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (handoff_send(conn, &hello, sizeof(hello), NULL, 0) < 0) {
+      close(conn);
       continue;
+    }
 
-    // Read the data
-    // Break the loop if recv() does not return > 0 (error or connection was closed client side)
-    if (recv(client->connection_sock, &client_msg, sizeof(client_msg), 0) <= 0)
-      break;
+    pthread_mutex_lock(&handoff_lock);
+    if (handoff_closed) {
+      pthread_mutex_unlock(&handoff_lock);
+      close(conn);
+      break;  // the server is shutting down
+    }
+    handoff_conn = conn;
+    handoff_reports = 0;
+    handoff_failed = 0;
+    handoff_sent = 0;
+    pthread_mutex_unlock(&handoff_lock);
+
+    server_log((char *)"A new server is taking over, handing connections over\n");
+    stop_shards();
+
+    pthread_mutex_lock(&handoff_lock);
+    while (handoff_reports < num_shards)
+      pthread_cond_wait(&handoff_cond, &handoff_lock);
+    unsigned sent = handoff_sent;
+    int failed = handoff_failed;
+    pthread_mutex_unlock(&handoff_lock);
+
+    int done = !failed && confirm_handoff(conn, sent) == 0;
+    if (!done) {
+      server_log((char *)"The new server did not take over, carrying on\n");
+      close(conn);
+    }
 
-    // Setup buffers
-    memset(out_buff, 0, sizeof(out_buff));
-    memset(log_buff, 0, sizeof(log_buff));
-    sprintf(log_buff, "> %s: ", client->name); // need to log the message from the client 
-
-    if (client_msg.command == HAPPY_COMMAND) {
-      sprintf(out_buff, "Feeling happy\n");
-      send_message_to_all(out_buff, client);
-    } else if (client_msg.command == SAD_COMMAND) {
-      sprintf(out_buff, "Feeling sad\n");
-      send_message_to_all(out_buff, client);
-    } else if (client_msg.command == MYTIME_COMMAND) {
-      time(&tme);
-      time_info = localtime(&tme);
-      sprintf(out_buff, "My current time is: %02d:%02d:%02d\n", time_info->tm_hour, time_info->tm_min, time_info->tm_sec);
-      send_message_to_all(out_buff, client);
-    } else if (client_msg.command == MYTIMEPLUS_COMMAND) {
-      time(&tme);
-      time_info = localtime(&tme);
-      sprintf(out_buff, "My time in one hour will be: %02d:%02d:%02d\n", 
-              (time_info->tm_hour == 23 ? 0 : time_info->tm_hour + 1), time_info->tm_min, time_info->tm_sec);
-      send_message_to_all(out_buff, client);
-    } else if (client_msg.command == HELP_COMMAND) {
-      send_menu(client);
-    } else if (client_msg.command == QUIT_COMMAND) {
-      // Break the loop and close the connection to this client
-      break;
-    } else if (client_msg.command == SENDMSG_COMMAND) {
-      strcpy(in_buff, client_msg.data);
-      strcat(out_buff, in_buff);
-      strcat(out_buff, "\n");
-      send_message_to_all_except(out_buff, client, client);
-    } else {
-      // unknown command
-      memset(log_buff, 0, sizeof(log_buff)); // clear the log buffer (remove the user name from the front)
-      sprintf(out_buff, "*** Unknown command passed in by client %d: %d\n", client->id, client_msg.command);
-      send_message_to_client(out_buff, client, NULL);
+    // Tell the shards, which either let go of their connections or run again
+    pthread_mutex_lock(&handoff_lock);
+    if (!done) {
+      handoff_conn = -1;
+      server_running = !stop_requested;
     }
-    
-    // Log whatever message was sent to client(s)
-    strcat(log_buff, out_buff);
-    server_log(log_buff);
+    handoff_done = done;
+    handoff_round++;
+    pthread_cond_broadcast(&handoff_cond);
+    pthread_mutex_unlock(&handoff_lock);
+    if (done)
+      break;
   }
 
-  // Client entered QUIT or closed the connection otherwise (i.e. Ctrl-C)
-  // Send a message that the client left the chat room
-  sprintf(out_buff, "*** %s has left the chat room!\n", client->name);
-  server_log(out_buff);
-  send_message_to_all_except(out_buff, NULL, client);
-  
-  // Close connection
-  send_closed_signal(client);   // send a CLOSED status code to the client
-  close_connection(client);
-  delete_client(client);
+  return NULL;
+}
 
-  // Release the thread
-  pthread_detach(pthread_self());
+// Creates the handoff socket at handoff_path and starts the thread that waits on it
+// Returns -1 on failure
+int start_handoff()
+{
+  if ((handoff_sock = handoff_listen(handoff_path)) < 0) {
+    server_error((char *)"handoff socket");
+    return -1;
+  }
+  if (pthread_create(&handoff_tid, NULL, &handoff_thread, NULL) != 0) {
+    server_error((char *)"pthread_create");
+    close(handoff_sock);
+    unlink(handoff_path);
+    handoff_sock = -1;
+    return -1;
+  }
 
   return 0;
 }
 
-// Prints CLI usage
-void print_usage()
+// Stops the handoff thread, shutting the socket down makes its accept() fail
+void stop_handoff()
 {
-  printf("Usage: server -s -p <portnumber>\n");
+  if (handoff_sock < 0)
+    return;
+
+  shutdown(handoff_sock, SHUT_RDWR);
+  pthread_join(handoff_tid, NULL);
+  close(handoff_sock);
+  unlink(handoff_path);
 }
 
-// Set the shutdown flag upon Ctrl-C
-// Server was shutdown:
-//   1. wait for all threads to finish so connections are closed
-//   2. close the log file
-// Other threads will see the change and close their connections
-// Only the main thread runs this code since the handler is set inside main()
-void catch_ctrl_c()
+// Takes over from the server listening on handoff_path
+// Its listening sockets and connections are staged in adopted_listeners and adopted_list until
+// the shards are set up. Only once everything arrived intact is it acknowledged; until then the
+// old server still owns every connection, so a failed handoff leaves it serving them. Returns once
+// that server has exited, so the log, the message store and the ports it held are free. Runs before
+// the log is open, so errors go to stderr
+// Returns -1 if there is no server to take over from or the handoff failed
+int take_over(int port)
 {
-  // Reset back to the default signal
-  signal(SIGINT, SIG_DFL);
+  int fds[HANDOFF_MAX_FDS], nfds, ended = 0, connections = 0;
+  adopted_t *last = NULL;
+  frame_buf_t *fill = NULL;     // Frame the DATA messages are filling in, NULL when they are input
+  size_t filled = 0, expected = 0;
+  outq_stats_t skipped;
+  ssize_t n;
+
+  int conn = handoff_connect(handoff_path);
+  if (conn < 0) {
+    fprintf(stderr, "No server to take over from at %s: %s\n", handoff_path, strerror(errno));
+    return -1;
+  }
+  char *buff = malloc(HANDOFF_MSG_MAX);
+  if (buff == NULL) {
+    close(conn);
+    return -1;
+  }
+  memset(&skipped, 0, sizeof(skipped));
+
+  handoff_hello_t hello;
+  n = handoff_recv(conn, buff, fds, &nfds);
+  if (n == sizeof(hello))
+    memcpy(&hello, buff, sizeof(hello));
+  if (n != sizeof(hello) || hello.type != HANDOFF_HELLO || hello.version != HANDOFF_VERSION ||
+      hello.conn_size != sizeof(handoff_conn_t)) {
+    fprintf(stderr, "The server at %s cannot hand over to this one\n", handoff_path);
+    free(buff);
+    close(conn);
+    return -1;
+  }
+  adopted_shards = hello.shards;
+  adopted_listeners = malloc(sizeof(int) * adopted_shards);
+  for (unsigned i = 0; adopted_listeners && i < adopted_shards; i++)
+    adopted_listeners[i] = -1;
+
+  // Everything the old server sends up to END
+  while (adopted_listeners && !ended && (n = handoff_recv(conn, buff, fds, &nfds)) > 0) {
+    uint32_t type;
+    memcpy(&type, buff, sizeof(type));
+
+    // Every block must be complete before the next message starts
+    if (type != HANDOFF_DATA && filled != expected) {
+      fprintf(stderr, "Incomplete message from the server at %s\n", handoff_path);
+      break;
+    }
+
+    if (type == HANDOFF_LISTENER && n == sizeof(handoff_listener_t) && nfds == 1) {
+      handoff_listener_t listener;
+      struct sockaddr_in addr;
+      socklen_t addrlen = sizeof(addr);
+      memcpy(&listener, buff, sizeof(listener));
+      if (listener.shard >= adopted_shards || getsockname(fds[0], (struct sockaddr *)&addr, &addrlen) < 0 ||
+          ntohs(addr.sin_port) != port) {
+        fprintf(stderr, "The server at %s is not listening on port %d\n", handoff_path, port);
+        close(fds[0]);
+        break;
+      }
+      adopted_listeners[listener.shard] = fds[0];
+      nfds = 0;
+    } else if (type == HANDOFF_CONN && n == sizeof(handoff_conn_t) && nfds >= 1) {
+      adopted_t *a = calloc(1, sizeof(adopted_t));
+      if (a == NULL)
+        break;
+      memcpy(&a->meta, buff, sizeof(a->meta));
+      a->meta.name[USERNAME_LENGTH - 1] = '\0';
+      a->meta.room[ROOM_NAME_LENGTH - 1] = '\0';
+      a->sock = fds[0];
+      a->upload_fd = nfds > 1 ? fds[1] : -1;
+      if (last) {
+        last->next = a;
+      } else {
+        adopted_list = a;
+      }
+      last = a;
+      connections++;
+      fill = NULL;
+      filled = expected = 0;
+      nfds = 0;
+    } else if ((type == HANDOFF_INPUT || type == HANDOFF_OUTPUT) && n == sizeof(handoff_block_t) && last) {
+      handoff_block_t block;
+      memcpy(&block, buff, sizeof(block));
+      fill = NULL;
+      filled = 0;
+      expected = block.len;
+      if (type == HANDOFF_OUTPUT) {
+        if (block.file_len > 0 && nfds == 1) {
+          fill = frame_buf_file(block.len, fds[0], block.file_len);
+          nfds = 0;
+        } else {
+          fill = frame_buf_alloc(block.len);
+        }
+        if (fill == NULL || outq_push(&last->outq, fill) < 0)
+          break;
+        frame_buf_release(fill);  // the queue holds it
+        if (block.skip > 0)
+          outq_advance(&last->outq, block.skip, &skipped);
+      }
+    } else if (type == HANDOFF_DATA && last && filled + (n - sizeof(type)) <= expected) {
+      size_t len = n - sizeof(type);
+      if (fill) {
+        memcpy(fill->data + filled, buff + sizeof(type), len);
+      } else if (frame_reader_append(&last->reader, buff + sizeof(type), len) < 0) {
+        break;
+      }
+      filled += len;
+    } else if (type == HANDOFF_END && n == sizeof(handoff_end_t)) {
+      handoff_end_t end;
+      memcpy(&end, buff, sizeof(end));
+      int first = node_id * RELAY_ID_SPACE + 1;
+      if (end.next_id >= first && end.next_id < first + RELAY_ID_SPACE)
+        client_seq = (unsigned)(end.next_id - first);
+      ended = 1;
+    } else {
+      fprintf(stderr, "Unexpected message from the server at %s\n", handoff_path);
+      break;
+    }
+
+    // Descriptors a message should not have carried
+    for (int i = 0; i < nfds; i++)
+      close(fds[i]);
+  }
+
+  // Every listening socket must have arrived, then the old server can let go and exit
+  for (unsigned i = 0; ended && i < adopted_shards; i++)
+    ended = adopted_listeners[i] >= 0;
+  handoff_ack_t ack = { HANDOFF_ACK, (uint32_t)connections };
+  if (ended && handoff_send(conn, &ack, sizeof(ack), NULL, 0) == 0) {
+    // The connections are this server's now, wait for the old one to exit
+    while (handoff_recv(conn, buff, fds, &nfds) > 0) {
+      for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+    }
+  } else {
+    ended = 0;
+  }
 
+  free(buff);
+  close(conn);
+  if (!ended) {
+    fprintf(stderr, "The handoff from the server at %s failed\n", handoff_path);
+    return -1;
+  }
+  printf("Took over %d connections from the previous server\n", connections);
+  return 0;
+}
+
+// Server was shutdown:
+//   1. shut down the main thread's shard and wait for the others to do the same
+//      (when a new server took over, every shard has already handed its connections over)
+//   2. stop the relay, log the write statistics, close the message store and drop broadcasts posted to shards that had already stopped
+//   3. close the log file, and last the handoff connection, which tells the new server it may start
+void shutdown_server()
+{
   server_log((char *)"Server shutting down...\n");
 
-  // Set the server_running flag so all threads will begin to shut down
-  server_running = 0;
-  
-  // Wait for all threads to finish
-  while (client_count != 0);
+  stop_shards();
+  shutdown_shard();
+  for (int i = 1; i < num_shards; i++)
+    pthread_join(shards[i].thread, NULL);
+  stop_handoff();
+  stop_stats();
+  relay_stop();
+
+  log_write_stats();
+  store_close();
+
+  for (int i = 0; i < num_shards; i++) {
+    inbox_node_t *node = inbox_take(&shards[i].inbox);
+    while (node)
+      node = inbox_node_free(node);
+    close(shards[i].wake_fd);
+  }
+  free(shards);
+  rooms_free();
+  users_free();
 
-  // Close the listening socket
-  close(listening_sock);
+  frame_buf_release(menu_frame);
+  frame_buf_release(closed_frame);
+  frame_buf_release(accepted_frame);
+  frame_buf_release(rejected_frame);
+  frame_buf_release(unauthorized_frame);
+  frame_buf_release(ping_frame);
+
+  frame_pool_drain();
 
   server_log((char *)"Server has terminated all connections.\n-----\n");
-  fclose(log_file);
-  printf("Server logs are available at server_log.txt");
+  logger_close();
+  printf("Server logs are available at %s\n", log_format == LOG_FORMAT_BINARY ? LOG_BIN_PATH : LOG_FILE_PATH);
   fflush(stdout); // immediately print what is in the stdout buffer
+  if (handoff_conn >= 0)
+    close(handoff_conn);
+}
 
-  raise(SIGINT); // raise the signal so the main process gets killed
+// Worker thread, runs one shard other than the main thread's
+void *shard_thread(void *arg)
+{
+  self = (shard_t *)arg;
+  do {
+    run_event_loop();
+  } while (!hand_over_shard());
+  shutdown_shard();
+  return NULL;
 }
-   
-// Main server thread for accepting new client connections   
+
 int main(int argc, char *argv[])
 {
   // Parse command line arguments
   int opt, option_index;
   int start_flag = 0;
-  int port;
+  int port = 0;
 
   struct option long_options[] = {
     {"start", no_argument, NULL, 's'},
     {"port", required_argument, NULL, 'p'},
+    {"queue-limit", required_argument, NULL, OPT_QUEUE_LIMIT},
+    {"slow-policy", required_argument, NULL, OPT_SLOW_POLICY},
+    {"backlog", required_argument, NULL, OPT_BACKLOG},
+    {"auth-timeout", required_argument, NULL, OPT_AUTH_TIMEOUT},
+    {"workers", required_argument, NULL, OPT_WORKERS},
+    {"log-format", required_argument, NULL, OPT_LOG_FORMAT},
+    {"log-flush-ms", required_argument, NULL, OPT_LOG_FLUSH},
+    {"log-fsync", required_argument, NULL, OPT_LOG_FSYNC},
+    {"history", required_argument, NULL, OPT_HISTORY},
+    {"history-secs", required_argument, NULL, OPT_HISTORY_SECS},
+    {"history-bytes", required_argument, NULL, OPT_HISTORY_BYTES},
+    {"tcp-mode", required_argument, NULL, OPT_TCP_MODE},
+    {"io", required_argument, NULL, OPT_IO},
+    {"max-attachment", required_argument, NULL, OPT_MAX_ATTACHMENT},
+    {"spool-dir", required_argument, NULL, OPT_SPOOL_DIR},
+    {"stats-socket", required_argument, NULL, OPT_STATS_SOCKET},
+    {"compress-min", required_argument, NULL, OPT_COMPRESS_MIN},
+    {"store-dir", required_argument, NULL, OPT_STORE_DIR},
+    {"store-segment-mb", required_argument, NULL, OPT_STORE_SEGMENT},
+    {"node-id", required_argument, NULL, OPT_NODE_ID},
+    {"cluster-port", required_argument, NULL, OPT_CLUSTER_PORT},
+    {"cluster-bind", required_argument, NULL, OPT_CLUSTER_BIND},
+    {"cluster-secret", required_argument, NULL, OPT_CLUSTER_SECRET},
+    {"peer", required_argument, NULL, OPT_PEER},
+    {"ping-interval", required_argument, NULL, OPT_PING_INTERVAL},
+    {"idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT},
+    {"rate", required_argument, NULL, OPT_RATE},
+    {"burst", required_argument, NULL, OPT_BURST},
+    {"overload-queue", required_argument, NULL, OPT_OVERLOAD_QUEUE},
+    {"overload-lag-ms", required_argument, NULL, OPT_OVERLOAD_LAG},
+    {"handoff-socket", required_argument, NULL, OPT_HANDOFF_SOCKET},
+    {"takeover", no_argument, NULL, OPT_TAKEOVER},
+    {"max-clients", required_argument, NULL, OPT_MAX_CLIENTS},
     {0, 0, 0, 0}
   };
 
@@ -363,6 +3221,246 @@ int main(int argc, char *argv[])
       case 'p': 
         port = atoi(optarg);
         break;
+      case OPT_QUEUE_LIMIT:
+        if (atol(optarg) <= 0) {
+          printf("Queue limit must be a positive number of bytes\n");
+          return EXIT_FAILURE;
+        }
+        queue_limit = (size_t)atol(optarg);
+        break;
+      case OPT_SLOW_POLICY:
+        if (strcmp(optarg, "drop") == 0) {
+          slow_policy = POLICY_DROP_OLDEST;
+        } else if (strcmp(optarg, "disconnect") == 0) {
+          slow_policy = POLICY_DISCONNECT;
+        } else if (strcmp(optarg, "coalesce") == 0) {
+          slow_policy = POLICY_COALESCE;
+        } else {
+          printf("Slow policy must be one of drop, disconnect or coalesce\n");
+          print_usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_BACKLOG:
+        listen_backlog = atoi(optarg);
+        if (listen_backlog <= 0) {
+          printf("Backlog must be a positive number of connections\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_AUTH_TIMEOUT:
+        auth_timeout = atoi(optarg);
+        if (auth_timeout <= 0) {
+          printf("Auth timeout must be a positive number of seconds\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_WORKERS:
+        num_shards = atoi(optarg);
+        if (num_shards <= 0) {
+          printf("Workers must be a positive number of threads\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_LOG_FORMAT:
+        if (strcmp(optarg, "text") == 0) {
+          log_format = LOG_FORMAT_TEXT;
+        } else if (strcmp(optarg, "binary") == 0) {
+          log_format = LOG_FORMAT_BINARY;
+        } else {
+          printf("Log format must be one of text or binary\n");
+          print_usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_LOG_FLUSH:
+        log_flush_ms = atoi(optarg);
+        if (log_flush_ms <= 0) {
+          printf("Log flush interval must be a positive number of milliseconds\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_LOG_FSYNC:
+        if (strcmp(optarg, "never") == 0) {
+          log_fsync = LOG_FSYNC_NEVER;
+        } else if (strcmp(optarg, "batch") == 0) {
+          log_fsync = LOG_FSYNC_BATCH;
+        } else if (strcmp(optarg, "second") == 0) {
+          log_fsync = LOG_FSYNC_SECOND;
+        } else {
+          printf("Log fsync policy must be one of never, batch or second\n");
+          print_usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_HISTORY:
+        if (atoi(optarg) < 0) {
+          printf("History must be a number of messages (0 to disable)\n");
+          return EXIT_FAILURE;
+        }
+        history_msgs = (unsigned)atoi(optarg);
+        break;
+      case OPT_HISTORY_SECS:
+        history_secs = atoi(optarg);
+        if (history_secs < 0) {
+          printf("History age must be a number of seconds (0 for no limit)\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_HISTORY_BYTES:
+        if (atol(optarg) <= 0) {
+          printf("History size must be a positive number of bytes\n");
+          return EXIT_FAILURE;
+        }
+        history_bytes = (size_t)atol(optarg);
+        break;
+      case OPT_TCP_MODE:
+        if (strcmp(optarg, "nagle") == 0) {
+          tcp_mode = TCP_MODE_NAGLE;
+        } else if (strcmp(optarg, "nodelay") == 0) {
+          tcp_mode = TCP_MODE_NODELAY;
+        } else if (strcmp(optarg, "cork") == 0) {
+          tcp_mode = TCP_MODE_CORK;
+        } else {
+          printf("TCP mode must be one of nagle, nodelay or cork\n");
+          print_usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_IO:
+        if (strcmp(optarg, "epoll") == 0) {
+          io_backend = IO_EPOLL;
+        } else if (strcmp(optarg, "uring") == 0) {
+          io_backend = IO_URING;
+        } else {
+          printf("I/O backend must be one of epoll or uring\n");
+          print_usage();
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_MAX_ATTACHMENT:
+        // The frame also carries the file name, leave room for it under the protocol limit
+        if (atol(optarg) <= 0 || atol(optarg) > MAX_ATTACHMENT_DATA - USERNAME_LENGTH) {
+          printf("Max attachment must be 1 to %d bytes\n", MAX_ATTACHMENT_DATA - USERNAME_LENGTH);
+          return EXIT_FAILURE;
+        }
+        max_attachment = (size_t)atol(optarg);
+        break;
+      case OPT_SPOOL_DIR:
+        spool_dir = optarg;
+        break;
+      case OPT_STATS_SOCKET:
+        stats_path = optarg;
+        break;
+      case OPT_COMPRESS_MIN:
+        if (atol(optarg) < 0) {
+          printf("Compression threshold must be a number of bytes (0 to disable compression)\n");
+          return EXIT_FAILURE;
+        }
+        compress_min = (size_t)atol(optarg);
+        break;
+      case OPT_STORE_DIR:
+        store_path = optarg;
+        break;
+      case OPT_STORE_SEGMENT:
+        if (atol(optarg) <= 0 || (size_t)atol(optarg) * 1024 * 1024 < STORE_MIN_SEGMENT) {
+          printf("Store segment size must be a positive number of megabytes\n");
+          return EXIT_FAILURE;
+        }
+        store_segment = (size_t)atol(optarg) * 1024 * 1024;
+        break;
+      case OPT_NODE_ID:
+        node_id = atoi(optarg);
+        if (node_id < 0 || node_id > INT_MAX / RELAY_ID_SPACE - 1) {
+          printf("Node id must be 0 to %d\n", INT_MAX / RELAY_ID_SPACE - 1);
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_CLUSTER_PORT:
+        cluster_port = atoi(optarg);
+        if (cluster_port < 1 || cluster_port > 65535) {
+          printf("Cluster port must be between 1 and 65535\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_CLUSTER_BIND: {
+        struct in_addr bind_addr;
+        if (inet_pton(AF_INET, optarg, &bind_addr) != 1) {
+          printf("Cluster bind address must be an IPv4 address\n");
+          return EXIT_FAILURE;
+        }
+        cluster_bind = optarg;
+        break;
+      }
+      case OPT_CLUSTER_SECRET:
+        if (optarg[0] == '\0' || strlen(optarg) >= PASSWORD_LENGTH) {
+          printf("Cluster secret must be 1 to %d characters long\n", PASSWORD_LENGTH - 1);
+          return EXIT_FAILURE;
+        }
+        cluster_secret = optarg;
+        break;
+      case OPT_PEER:
+        if (relay_add_peer(optarg) < 0) {
+          printf("Peer %s must be a reachable host:port (at most %d peers)\n", optarg, RELAY_MAX_LINKS);
+          return EXIT_FAILURE;
+        }
+        peer_count++;
+        break;
+      case OPT_PING_INTERVAL:
+        ping_interval = atoi(optarg);
+        if (ping_interval < 0) {
+          printf("Ping interval must be a number of seconds (0 to disable heartbeats)\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_IDLE_TIMEOUT:
+        idle_timeout = atoi(optarg);
+        if (idle_timeout <= 0) {
+          printf("Idle timeout must be a positive number of seconds\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_RATE:
+        rate_limit = atoi(optarg);
+        if (rate_limit < 0) {
+          printf("Rate must be a number of commands per second (0 to disable rate limiting)\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_BURST:
+        rate_burst = atoi(optarg);
+        if (rate_burst <= 0) {
+          printf("Burst must be a positive number of commands\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_OVERLOAD_QUEUE:
+        if (atol(optarg) < 0) {
+          printf("Overload queue must be a number of bytes (0 to ignore queued bytes)\n");
+          return EXIT_FAILURE;
+        }
+        overload_queue = (size_t)atol(optarg);
+        break;
+      case OPT_OVERLOAD_LAG:
+        overload_lag = atoi(optarg);
+        if (overload_lag < 0) {
+          printf("Overload lag must be a number of milliseconds (0 to ignore event loop lag)\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPT_HANDOFF_SOCKET:
+        handoff_path = optarg;
+        break;
+      case OPT_TAKEOVER:
+        takeover = 1;
+        break;
+      case OPT_MAX_CLIENTS:
+        max_clients = atoi(optarg);
+        if (max_clients < 1) {
+          printf("Max clients must be a positive number\n");
+          return EXIT_FAILURE;
+        }
+        break;
       default: 
         printf("Error!\n");
         return EXIT_FAILURE;
@@ -376,118 +3474,178 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
+  if (ping_interval > 0 && idle_timeout <= ping_interval) {
+    printf("Idle timeout must be longer than the ping interval\n");
+    return EXIT_FAILURE;
+  }
+
   if (port < 1 || port > 65535) {
     printf("Must provide a port number between 1 and 65535\n");
     print_usage();
     return EXIT_FAILURE;
   }
 
-  // Create the log file
-  log_file = fopen(LOG_FILE_PATH, "w");
+  if ((cluster_port || peer_count) && cluster_secret == NULL) {
+    printf("Cluster nodes need the --cluster-secret they all share\n");
+    return EXIT_FAILURE;
+  }
+
+  if (takeover && handoff_path == NULL) {
+    printf("--takeover needs the --handoff-socket of the server to take over from\n");
+    return EXIT_FAILURE;
+  }
+
+  // Make room for max_clients connections before any socket is opened or taken over
+  int asked_clients = max_clients, files_raised;
+  rlim_t files_limit = raise_open_files_limit(&files_raised);
 
-  // Socket file descriptor for new incoming connections
-  int connection_sock;
+  // Size the users index and the names for that many clients, peers' users grow them further
+  if (users_init(max_clients) < 0 || intern_init(max_clients) < 0) {
+    perror("Could not allocate the users index");
+    return EXIT_FAILURE;
+  }
 
-  // Socket address and port metadata for client and server 
-  struct sockaddr_in server_addr, client_addr; 
+  // Take the connections over from the running server, which exits before the log is opened
+  // Client ids carry on from where that server left off
+  if (takeover && take_over(port) < 0)
+    return EXIT_FAILURE;
 
-  // Login info passed from client to server
-  struct login_request login_request;
+  // Create the log file and start the log writer
+  if (logger_open(log_format == LOG_FORMAT_BINARY ? LOG_BIN_PATH : LOG_FILE_PATH, log_format, log_flush_ms, log_fsync, takeover) < 0) {
+    perror("Could not open the server log");
+    return EXIT_FAILURE;
+  }
 
-  // Login response sent back to client
-  struct login_response login_resp;
-      
-  // Create TCP listening socket for accepting connections
-  if ((listening_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) { 
-    server_error((char *)"Socket creation failed.\n"); 
+  // Recover the message store and start its writer
+  if (store_path && store_open(store_path, store_segment) < 0) {
+    perror("Could not open the message store");
     return EXIT_FAILURE;
-  } 
-      
-  // Set SO_REUSEADDR option to avoid binding issues after the server was previously shutdown
-  int sock_opt = 1;
-  if (setsockopt(listening_sock, SOL_SOCKET, SO_REUSEADDR, &sock_opt, sizeof(sock_opt))) { 
-    server_error((char *)"setsockopt failed"); 
+  }
+
+  build_static_frames();
+  if (menu_frame == NULL || closed_frame == NULL || accepted_frame == NULL ||
+      rejected_frame == NULL || unauthorized_frame == NULL || ping_frame == NULL) {
+    server_error((char *)"Could not allocate message frames\n");
     return EXIT_FAILURE;
-  } 
+  }
+
+  // Socket address and port metadata for server 
+  struct sockaddr_in server_addr; 
 
   // Set server socket information
   server_addr.sin_family = AF_INET; 
   server_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
   server_addr.sin_port = htons(port); 
-      
-  // Forcefully attaching socket to the port number and IP address
-  // Incoming messages to the IP + port combo will come through this socket 
-  if (bind(listening_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) { 
-    server_error((char *)"Binding failed"); 
-    return EXIT_FAILURE;
-  } 
 
-  // Starting listening for new connections
-  if (listen(listening_sock, 3) < 0) { 
-    server_error((char *)"listen"); 
+  // Peers count as extra shards in the rooms directory, see relay.h
+  int clustered = cluster_port || peer_count;
+  shards = (shard_t *)calloc(num_shards, sizeof(shard_t));
+  if (shards == NULL || rooms_init(num_shards + (clustered ? RELAY_MAX_LINKS : 0)) < 0) {
+    server_error((char *)"Could not allocate shards\n");
     return EXIT_FAILURE;
   }
+  for (int i = 0; i < num_shards; i++) {
+    if (setup_shard(&shards[i], &server_addr, (unsigned)i < adopted_shards ? adopted_listeners[i] : -1) < 0)
+      return EXIT_FAILURE;
+  }
 
   char log_buff[2048];
   sprintf(log_buff, "-----\nSERVER STARTED. Listening on port %d...\n", port);
   server_log(log_buff);
+  if (num_shards > 1) {
+    sprintf(log_buff, "Running %d worker shards\n", num_shards);
+    server_log(log_buff);
+  }
 
-  // Set handler for ctrl-c
-  signal(SIGINT, catch_ctrl_c);
-
-  // Loop forever accepting new clients until server encounters an error or is shut down
-  while (1) {
-    socklen_t addrlen = sizeof(client_addr);
-    // Accept connection from client and create a new socket for the connection
-    // Places source information about client in client_addr struct
-    if ((connection_sock = accept(listening_sock, (struct sockaddr *)&client_addr, (socklen_t*)&addrlen)) < 0) { 
-      server_error((char *)"accept"); 
-      close(listening_sock);
-      return EXIT_FAILURE;
-    } 
+  // Say what the open files limit allows and what the clients may cost
+  if (files_raised) {
+    sprintf(log_buff, "Raised the open files limit to %lu\n", (unsigned long)files_limit);
+    server_log(log_buff);
+  }
+  if (max_clients < asked_clients) {
+    sprintf(log_buff, "The open files limit is %lu, so the client limit is %d instead of the %d asked for\n",
+            (unsigned long)files_limit, max_clients, asked_clients);
+    server_log(log_buff);
+  }
+  sprintf(log_buff, "Room for %d clients, each holding %zu bytes when idle and at most %zu when busy "
+          "(%zu MB idle, %zu MB busy in all)\n", max_clients, connection_bytes(0), connection_bytes(1),
+          connection_bytes(0) * max_clients >> 20, connection_bytes(1) * max_clients >> 20);
+  server_log(log_buff);
 
-    // Check if max number of clients have been reached
-    int conn_successful;
-    if (client_count == MAX_CLIENTS) {
-      char buff[1024];
-      sprintf(buff, "Max clients reached, rejecting login attempt by user at "); 
-      append_sock_addr(client_addr, buff);
-      strcat(buff, "\n");
-      server_log(buff);
-      conn_successful = REJECTED;
-      send(connection_sock, &conn_successful, sizeof(conn_successful), 0);
-      close(connection_sock);
-      continue;
+  // Spread what the previous server handed over across the shards, which adopt it once they run
+  // The connections waiting in the queue of a listening socket no shard took over are lost
+  if (takeover) {
+    int adopted = 0;
+    for (unsigned i = num_shards; i < adopted_shards; i++) {
+      if (adopted_listeners[i] >= 0)
+        close(adopted_listeners[i]);
     }
-    conn_successful = ACCEPTED;
-    send(connection_sock, &conn_successful, sizeof(conn_successful), 0);
-
-    // Receive login request and evaluate
-    recv(connection_sock, &login_request, sizeof(login_request), 0);
-    if (strcmp(login_request.password, PASSWORD) == 0) {
-      login_resp.status = AUTHORIZED;
-      // Initialize client and start communication
-      client_t *new_client = (client_t*)malloc(sizeof(client_t));
-      new_client->addr = client_addr;
-      new_client->connection_sock = connection_sock;
-      strcpy(new_client->name, login_request.username);
-      new_client->id = client_id++;
-
-      // Setup response to send back to client
-      login_resp.id = new_client->id;
-
-      // Add client to list of server's clients and create new thread for the connection
-      add_client(new_client);
-      pthread_create(&new_client->tid, NULL, &client_comm, (void*)new_client);
+    free(adopted_listeners);
+    while (adopted_list) {
+      adopted_t *a = adopted_list;
+      adopted_list = a->next;
+      a->next = shards[adopted % num_shards].adopted;
+      shards[adopted % num_shards].adopted = a;
+      adopted++;
+    }
+    sprintf(log_buff, "Took over %d connections and %u listening sockets from the previous server\n",
+            adopted, adopted_shards < (unsigned)num_shards ? adopted_shards : (unsigned)num_shards);
+    server_log(log_buff);
+  }
+
+  // Check the kernel can run the io_uring backend before any shard relies on it
+  if (io_backend == IO_URING) {
+    uring_t probe;
+    if (uring_init(&probe, 8, 1, 64) < 0) {
+      sprintf(log_buff, "io_uring is not available (%s), falling back to epoll\n", strerror(errno));
+      io_backend = IO_EPOLL;
     } else {
-      // Password does not match send rejection message and continue listening
-      login_resp.status = UNAUTHORIZED;
+      uring_free(&probe);
+      sprintf(log_buff, "Using the io_uring backend\n");
+    }
+    server_log(log_buff);
+  }
+
+  // A client that disconnects mid-write must not kill the server, send() reports EPIPE instead
+  signal(SIGPIPE, SIG_IGN);
+
+  // Start the other shards with Ctrl-C blocked so the signal always lands on the main thread
+  sigset_t sigint, old_mask;
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint, &old_mask);
+  started_ms = now_ms();
+  if (stats_path && start_stats() < 0)
+    return EXIT_FAILURE;
+  if (handoff_path && start_handoff() < 0)
+    return EXIT_FAILURE;
+  if (clustered) {
+    relay_handlers_t handlers = { relayed_room_frame, relayed_user_frame };
+    if (relay_start(node_id, cluster_bind, cluster_port, num_shards, cluster_secret, &handlers) < 0) {
+      server_error((char *)"Could not start the cluster relay\n");
+      return EXIT_FAILURE;
+    }
+    sprintf(log_buff, "Cluster node %d, peer port %s:%d, %d peers to dial\n", node_id, cluster_bind, cluster_port, peer_count);
+    server_log(log_buff);
+  }
+  for (int i = 1; i < num_shards; i++) {
+    if (pthread_create(&shards[i].thread, NULL, &shard_thread, &shards[i]) != 0) {
+      server_error((char *)"pthread_create");
+      return EXIT_FAILURE;
     }
-    send(connection_sock, &login_resp, sizeof(login_resp), 0);
   }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  // Set handler for ctrl-c
+  signal(SIGINT, catch_ctrl_c);
+
+  // The main thread runs the first shard
+  self = &shards[0];
+  do {
+    run_event_loop();
+  } while (!hand_over_shard());
 
-  // Unreachable, but close the listening sock just in case
-  close(listening_sock);
+  shutdown_server();
 
   return EXIT_SUCCESS;
 }
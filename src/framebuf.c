@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "framebuf.h"
+#include "metrics.h"
+
+// Released buffers of each size class, kept by each thread for its next allocations
+static _Thread_local struct {
+  frame_buf_t *head;   // Linked through the first bytes of data
+  unsigned count;
+} pool[FRAME_POOL_CLASSES];
+
+// Returns the size of a pool class's buffers, header included
+static size_t class_size(int size_class)
+{
+  return (size_t)128 << size_class;
+}
+
+frame_buf_t *frame_buf_create(int type, int uid, const char *name, const char *data)
+{
+  size_t name_len = name ? strlen(name) : 0;
+  size_t data_len = data ? strlen(data) : 0;
+
+  if (name_len > 255)
+    name_len = 255;
+
+  frame_buf_t *fb = frame_buf_alloc(frame_length(name_len, data_len));
+  if (fb == NULL)
+    return NULL;
+
+  frame_encode(fb->data, type, uid, name, name_len, data, data_len);
+
+  return fb;
+}
+
+frame_buf_t *frame_buf_alloc(size_t len)
+{
+  int size_class = 0;
+  while (size_class < FRAME_POOL_CLASSES && class_size(size_class) < sizeof(frame_buf_t) + len)
+    size_class++;
+
+  frame_buf_t *fb;
+  if (size_class == FRAME_POOL_CLASSES) {
+    size_class = -1;
+    fb = malloc(sizeof(frame_buf_t) + len);
+  } else if (pool[size_class].head) {
+    fb = pool[size_class].head;
+    memcpy(&pool[size_class].head, fb->data, sizeof(frame_buf_t *));
+    pool[size_class].count--;
+    if (thread_metrics) {
+      counter_add(&thread_metrics->frame_pool_hits, 1);
+      counter_add(&thread_metrics->frame_pool_cached, (unsigned long)-1);
+    }
+  } else {
+    fb = malloc(class_size(size_class));
+  }
+  if (thread_metrics)
+    counter_add(&thread_metrics->frame_allocs, 1);
+  if (fb == NULL)
+    return NULL;
+
+  atomic_init(&fb->refs, 1);
+  fb->size_class = size_class;
+  fb->file_fd = -1;
+  fb->file_len = 0;
+  atomic_init(&fb->compressed, NULL);
+  fb->len = len;
+
+  return fb;
+}
+
+frame_buf_t *frame_buf_compressed(frame_buf_t *fb, size_t min_data)
+{
+  frame_buf_t *twin = atomic_load_explicit(&fb->compressed, memory_order_acquire);
+  if (twin)
+    return twin;
+
+  // Only whole frames carry a header to mark as compressed, not batches or attachments
+  struct frame f;
+  twin = NULL;
+  if (fb->file_len == 0 && frame_decode(fb->data, fb->len, &f) == 0 &&
+      !(f.hdr.flags & FRAME_FLAG_COMPRESSED) && f.hdr.data_len >= min_data) {
+    twin = frame_buf_alloc(fb->len);
+    if (twin) {
+      twin->len = frame_encode_compressed(twin->data, fb->len, f.hdr.type, f.hdr.uid, f.name, f.hdr.name_len,
+                                          f.data, f.hdr.data_len);
+      if (twin->len == 0 || twin->len >= fb->len) {
+        frame_buf_release(twin);
+        twin = NULL;
+      } else if (thread_metrics) {
+        counter_add(&thread_metrics->compressions, 1);
+        counter_add(&thread_metrics->compress_saved, fb->len - twin->len);
+      }
+    }
+  }
+
+  // Another shard may have raced us to it, keep whichever was published first
+  frame_buf_t *expected = NULL;
+  frame_buf_t *result = twin ? twin : fb;
+  if (!atomic_compare_exchange_strong_explicit(&fb->compressed, &expected, result,
+                                               memory_order_acq_rel, memory_order_acquire)) {
+    frame_buf_release(twin);
+    return expected;
+  }
+  return result;
+}
+
+frame_buf_t *frame_buf_file(size_t len, int file_fd, size_t file_len)
+{
+  frame_buf_t *fb = frame_buf_alloc(len);
+  if (fb == NULL) {
+    close(file_fd);
+    return NULL;
+  }
+
+  fb->file_fd = file_fd;
+  fb->file_len = file_len;
+
+  return fb;
+}
+
+size_t frame_buf_wire_len(const frame_buf_t *fb)
+{
+  return fb->len + fb->file_len;
+}
+
+frame_buf_t *frame_buf_retain(frame_buf_t *fb)
+{
+  atomic_fetch_add_explicit(&fb->refs, 1, memory_order_relaxed);
+  return fb;
+}
+
+void frame_buf_release(frame_buf_t *fb)
+{
+  if (fb && atomic_fetch_sub_explicit(&fb->refs, 1, memory_order_acq_rel) == 1) {
+    if (fb->file_fd >= 0)
+      close(fb->file_fd);
+    frame_buf_t *twin = atomic_load_explicit(&fb->compressed, memory_order_relaxed);
+    if (twin && twin != fb)
+      frame_buf_release(twin);
+
+    int size_class = fb->size_class;
+    if (size_class < 0 || pool[size_class].count >= FRAME_POOL_CACHE) {
+      free(fb);
+      return;
+    }
+    memcpy(fb->data, &pool[size_class].head, sizeof(frame_buf_t *));
+    pool[size_class].head = fb;
+    pool[size_class].count++;
+    if (thread_metrics)
+      counter_add(&thread_metrics->frame_pool_cached, 1);
+  }
+}
+
+void frame_pool_drain()
+{
+  for (int i = 0; i < FRAME_POOL_CLASSES; i++) {
+    while (pool[i].head) {
+      frame_buf_t *fb = pool[i].head;
+      memcpy(&pool[i].head, fb->data, sizeof(frame_buf_t *));
+      free(fb);
+      if (thread_metrics)
+        counter_add(&thread_metrics->frame_pool_cached, (unsigned long)-1);
+    }
+    pool[i].count = 0;
+  }
+}
@@ -0,0 +1,74 @@
+#ifndef FRAMEBUF_H
+#define FRAMEBUF_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define FRAME_POOL_CLASSES 6      // Size classes of 128, 256, ... 4096 bytes, header included
+#define FRAME_POOL_CACHE   256    // Most released buffers a thread keeps per class
+
+// An encoded frame shared by every connection it is delivered to
+// The frame is serialized once and never modified afterwards, so the same
+// buffer can be handed to any number of recipients. It is freed when the last
+// reference is released.
+//
+// A frame may end with the contents of a file instead of bytes in memory:
+// data then holds only the start of the frame, and the next file_len bytes
+// on the wire are sent straight from file_fd with sendfile(). Each recipient
+// reads the file at its own offset, so one file serves every queue.
+//
+// Buffers come from a size-classed pool (see frame_buf_alloc()), so the
+// buffer of a typical chat message is recycled rather than malloc()ed.
+//
+// The compressed version of a frame, for recipients that negotiated
+// compression, is made the first time one of them needs it and then shared
+// by all of them, so a broadcast is compressed at most once.
+typedef struct frame_buf {
+  atomic_int refs;   // Number of holders of this frame
+  int size_class;    // Pool class the buffer belongs to, -1 if it was malloc()ed for its size alone
+  int file_fd;       // File whose contents follow data on the wire (-1 for none), closed with the frame
+  size_t file_len;   // Number of bytes sent from file_fd
+  _Atomic(struct frame_buf *) compressed;   // Compressed twin, the frame itself if it does not
+                                            // compress, NULL until first asked for
+  size_t len;        // Number of bytes in data
+  char data[];       // Encoded frame, ready to be written to a socket
+} frame_buf_t;
+
+// Encodes a frame into a new buffer holding one reference
+// name and data are '\0' terminated strings (either may be NULL)
+// Returns NULL if memory could not be allocated
+frame_buf_t *frame_buf_create(int type, int uid, const char *name, const char *data);
+
+// Allocates an uninitialized buffer of len bytes holding one reference
+// Used to batch several encoded frames into a single write, or to encode a frame in place
+// Buffers up to FRAME_POOL_MAX bytes come from the calling thread's cache of
+// released buffers of the same size class when it has one
+// Returns NULL if memory could not be allocated
+frame_buf_t *frame_buf_alloc(size_t len);
+
+// Allocates an uninitialized buffer of len bytes followed on the wire by the
+// first file_len bytes of file_fd, holding one reference
+// The frame owns file_fd from then on, even if this fails
+// Returns NULL if memory could not be allocated
+frame_buf_t *frame_buf_file(size_t len, int file_fd, size_t file_len);
+
+// Returns the number of bytes a frame occupies on the wire
+size_t frame_buf_wire_len(const frame_buf_t *fb);
+
+// Returns the version of a frame to send to a client that negotiated compression:
+// its compressed twin, made on the first call, or the frame itself if it is not
+// a single frame with at least min_data bytes of data that shrink when compressed
+// The twin belongs to the frame, callers take their own reference as usual
+frame_buf_t *frame_buf_compressed(frame_buf_t *fb, size_t min_data);
+
+// Takes another reference to a frame
+frame_buf_t *frame_buf_retain(frame_buf_t *fb);
+
+// Drops a reference to a frame, freeing it with the last one
+// Pooled buffers go back to the cache of the thread that drops the last reference
+void frame_buf_release(frame_buf_t *fb);
+
+// Frees every buffer cached by the calling thread, called before it exits
+void frame_pool_drain();
+
+#endif
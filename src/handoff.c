@@ -0,0 +1,153 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+// Fills in the address of the handoff socket at path
+// Returns -1 if the path does not fit
+static int socket_addr(const char *path, struct sockaddr_un *addr)
+{
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+int handoff_listen(const char *path)
+{
+  struct sockaddr_un addr;
+
+  if (socket_addr(path, &addr) < 0)
+    return -1;
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  unlink(path);  // left over from a server that did not shut down cleanly
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+    int err = errno;
+    close(sock);
+    errno = err;
+    return -1;
+  }
+  return sock;
+}
+
+int handoff_connect(const char *path)
+{
+  struct sockaddr_un addr;
+
+  if (socket_addr(path, &addr) < 0)
+    return -1;
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    close(sock);
+    errno = err;
+    return -1;
+  }
+  return sock;
+}
+
+// Sends one message made of two parts, with file descriptors attached
+static int send_parts(int sock, const void *a, size_t a_len, const void *b, size_t b_len, const int *fds, int nfds)
+{
+  union {
+    struct cmsghdr hdr;
+    char buff[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  } control;
+  struct iovec iov[2] = { { (void *)a, a_len }, { (void *)b, b_len } };
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = b_len ? 2 : 1;
+  if (nfds > 0) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buff;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+
+  ssize_t n;
+  do {
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  return n == (ssize_t)(a_len + b_len) ? 0 : -1;
+}
+
+int handoff_send(int sock, const void *msg, size_t len, const int *fds, int nfds)
+{
+  return send_parts(sock, msg, len, NULL, 0, fds, nfds);
+}
+
+int handoff_send_data(int sock, const char *data, size_t len)
+{
+  uint32_t type = HANDOFF_DATA;
+
+  while (len > 0) {
+    size_t n = len < HANDOFF_CHUNK ? len : HANDOFF_CHUNK;
+    if (send_parts(sock, &type, sizeof(type), data, n, NULL, 0) < 0)
+      return -1;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+ssize_t handoff_recv(int sock, char *buff, int *fds, int *nfds)
+{
+  union {
+    struct cmsghdr hdr;
+    char buff[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+  } control;
+  struct iovec iov = { buff, HANDOFF_MSG_MAX };
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buff;
+  msg.msg_controllen = sizeof(control.buff);
+
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+
+  *nfds = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    for (int i = 0; i < count; i++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (*nfds < HANDOFF_MAX_FDS) {
+        fds[(*nfds)++] = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+
+  if (n > 0 && (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    for (int i = 0; i < *nfds; i++)
+      close(fds[i]);
+    *nfds = 0;
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return n;
+}
@@ -0,0 +1,124 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "protocol.h"
+
+//////// UPGRADE HANDOFF ////////
+//
+// Lets a new server binary take over from a running one without dropping a
+// connection. The running server listens on a Unix socket (SOCK_SEQPACKET,
+// so every message arrives whole); the new one connects to it, which starts
+// the handoff. The old server stops its event loops and sends its listening
+// sockets and every connection over the socket with SCM_RIGHTS, together
+// with what the new server needs to carry on: the client's id, name and room,
+// the bytes it sent that were not processed yet and the frames still queued
+// for it. The old server keeps every connection until the new one confirms
+// it received them all, so a new server that fails midway costs nothing: it
+// exits before adopting anything, and the old server, which sees the socket
+// close or time out instead of the confirmation, carries on serving. Once it
+// is confirmed, the old server lets go of its connections, shuts down as
+// usual, minus the goodbyes, and closes the handoff socket last, so once the
+// new server sees the end of the stream the log, the message store and the
+// stats and cluster ports are free.
+//
+// Connections never notice: their sockets stay open the whole time, anything
+// they send meanwhile waits in the socket, and new connections wait in the
+// listening sockets' accept queues.
+//
+// Messages, each starting with its type:
+//   HELLO                               first, from the old server
+//   LISTENER                            one per shard of the old server
+//   CONN [INPUT DATA...] [OUTPUT DATA...]...   one group per connection
+//   END                                 last from the old server
+//   ACK                                 from the new server, then the old server exits
+
+#define HANDOFF_VERSION 1
+
+#define HANDOFF_HELLO    1   // handoff_hello_t
+#define HANDOFF_LISTENER 2   // handoff_listener_t, the listening socket attached
+#define HANDOFF_CONN     3   // handoff_conn_t, the connection's socket (and upload spool file) attached
+#define HANDOFF_INPUT    4   // handoff_block_t, followed by DATA messages with the bytes the last
+                             // connection sent that were not processed yet
+#define HANDOFF_OUTPUT   5   // handoff_block_t, followed by DATA messages with one frame queued for
+                             // the last connection (its file attached if it ends with file contents)
+#define HANDOFF_DATA     6   // uint32_t type, then up to HANDOFF_CHUNK bytes of the block being sent
+#define HANDOFF_END      7   // handoff_end_t
+#define HANDOFF_ACK      8   // handoff_ack_t
+
+#define HANDOFF_CHUNK    (64 * 1024)   // Most bytes in one DATA message
+#define HANDOFF_MSG_MAX  (HANDOFF_CHUNK + sizeof(uint32_t))   // Largest message (every struct is smaller)
+#define HANDOFF_MAX_FDS  2
+#define HANDOFF_TIMEOUT  10   // Seconds the old server waits on a stalled send or for the ACK before giving up
+
+typedef struct {
+  uint32_t type;
+  uint32_t version;     // HANDOFF_VERSION, both servers must agree on the format
+  uint32_t conn_size;   // sizeof(handoff_conn_t)
+  uint32_t shards;      // Listening sockets that follow
+} handoff_hello_t;
+
+typedef struct {
+  uint32_t type;
+  uint32_t shard;       // Shard of the old server that owned the socket
+} handoff_listener_t;
+
+typedef struct {
+  uint32_t type;
+  int32_t id;                       // Client id, 0 if the connection has not logged in yet
+  int32_t compress;                 // The client negotiated compression
+  int32_t pinged;                   // A PING went out and nothing was heard since
+  int32_t throttled;                // The client was told it sends too fast
+  int32_t upload_failed;            // The upload in progress went wrong
+  struct sockaddr_in addr;
+  int64_t last_heard;               // Monotonic times (ms), which both servers share
+  int64_t tokens;
+  int64_t tokens_at;
+  uint64_t dropped;                 // Messages dropped because the client read too slowly
+  uint64_t upload_len;              // Bytes of the upload in progress received so far
+  char name[USERNAME_LENGTH];
+  char room[ROOM_NAME_LENGTH];
+} handoff_conn_t;
+
+typedef struct {
+  uint32_t type;
+  uint32_t pad;
+  uint64_t len;         // Bytes that follow in DATA messages
+  uint64_t skip;        // OUTPUT only: bytes of the frame the client already has
+  uint64_t file_len;    // OUTPUT only: bytes of the attached file that follow the frame on the wire
+} handoff_block_t;
+
+typedef struct {
+  uint32_t type;
+  int32_t next_id;      // Client id the new server hands out next
+} handoff_end_t;
+
+typedef struct {
+  uint32_t type;
+  uint32_t connections; // Connections received, the old server checks it sent as many
+} handoff_ack_t;
+
+// Creates the handoff socket at path, replacing a stale one
+// Returns the listening socket, or -1 and sets errno
+int handoff_listen(const char *path);
+
+// Connects to the server listening at path
+// Returns the socket, or -1 and sets errno
+int handoff_connect(const char *path);
+
+// Sends one message with nfds file descriptors attached (at most HANDOFF_MAX_FDS)
+// Returns -1 if the other server went away
+int handoff_send(int sock, const void *msg, size_t len, const int *fds, int nfds);
+
+// Sends len bytes as DATA messages
+// Returns -1 if the other server went away
+int handoff_send_data(int sock, const char *data, size_t len);
+
+// Receives one message into buff (HANDOFF_MSG_MAX bytes) and the file descriptors attached to it
+// Returns its length, 0 at the end of the stream or -1 on failure
+ssize_t handoff_recv(int sock, char *buff, int *fds, int *nfds);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+
+int history_init(history_t *h, size_t arena_size, unsigned max_msgs, void (*evicted)(int room))
+{
+  memset(h, 0, sizeof(history_t));
+  h->evicted = evicted;
+  if (arena_size == 0 || max_msgs == 0)
+    return 0;  // history disabled
+
+  h->arena = malloc(arena_size);
+  h->entries = malloc(max_msgs * sizeof(history_entry_t));
+  if (h->arena == NULL || h->entries == NULL) {
+    history_free(h);
+    return -1;
+  }
+  h->arena_size = arena_size;
+  h->cap = max_msgs;
+
+  return 0;
+}
+
+// Returns the i-th entry from the oldest
+static const history_entry_t *entry_at(const history_t *h, unsigned i)
+{
+  return &h->entries[(h->head + i) % h->cap];
+}
+
+// Copies len bytes into the arena at position pos, wrapping around its end
+static void arena_write(history_t *h, size_t pos, const char *src, size_t len)
+{
+  size_t off = pos % h->arena_size;
+  size_t first = h->arena_size - off < len ? h->arena_size - off : len;
+
+  memcpy(h->arena + off, src, first);
+  memcpy(h->arena, src + first, len - first);
+}
+
+// Copies len bytes out of the arena at position pos, wrapping around its end
+static void arena_read(const history_t *h, size_t pos, char *dst, size_t len)
+{
+  size_t off = pos % h->arena_size;
+  size_t first = h->arena_size - off < len ? h->arena_size - off : len;
+
+  memcpy(dst, h->arena + off, first);
+  memcpy(dst + first, h->arena, len - first);
+}
+
+int history_add(history_t *h, int room, const char *frame, size_t len, long long now_ms)
+{
+  if (h->cap == 0 || len > h->arena_size)
+    return 0;
+
+  // Evict the oldest frames until both the arena and the entries ring have room
+  while (h->count > 0 &&
+         (h->count == h->cap || h->arena_size - (h->end - entry_at(h, 0)->start) < len)) {
+    if (h->evicted)
+      h->evicted(entry_at(h, 0)->room);
+    h->head = (h->head + 1) % h->cap;
+    h->count--;
+  }
+
+  history_entry_t *e = &h->entries[(h->head + h->count) % h->cap];
+  e->start = h->end;
+  e->len = len;
+  e->time_ms = now_ms;
+  e->room = room;
+  arena_write(h, e->start, frame, len);
+
+  h->end += len;
+  h->count++;
+  return 1;
+}
+
+frame_buf_t *history_replay(const history_t *h, int room, unsigned max_msgs, long long since_ms)
+{
+  // Walk back from the newest frame to find the first one to replay
+  unsigned first = h->count, msgs = 0;
+  size_t len = 0;
+  while (first > 0 && msgs < max_msgs && entry_at(h, first - 1)->time_ms >= since_ms) {
+    first--;
+    if (entry_at(h, first)->room == room) {
+      msgs++;
+      len += entry_at(h, first)->len;
+    }
+  }
+  if (len == 0)
+    return NULL;
+
+  frame_buf_t *fb = frame_buf_alloc(len);
+  if (fb == NULL)
+    return NULL;
+
+  // Other rooms' frames are interleaved in the arena, copy the room's frames one by one
+  size_t off = 0;
+  for (unsigned i = first; i < h->count; i++) {
+    const history_entry_t *e = entry_at(h, i);
+    if (e->room == room) {
+      arena_read(h, e->start, fb->data + off, e->len);
+      off += e->len;
+    }
+  }
+
+  return fb;
+}
+
+void history_free(history_t *h)
+{
+  free(h->arena);
+  free(h->entries);
+  memset(h, 0, sizeof(history_t));
+}
@@ -0,0 +1,52 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include "framebuf.h"
+
+// Recent chat room messages, kept as encoded frames for replay to joining clients
+//
+// Frames are copied back to back into one fixed size byte arena used as a
+// ring, and a fixed size ring of entries records where each frame starts.
+// Both are allocated once, so recording a message never calls malloc: the
+// oldest messages are evicted until the new frame fits. Memory use is
+// arena_size plus max_msgs entries, no matter how busy the room is. One
+// history is shared by every room on a shard and each frame is tagged with
+// the room it was broadcast to. The owner is told when a frame is evicted,
+// so it can keep the room alive as long as it has history.
+typedef struct {
+  size_t start;        // Position of the frame in the arena (free running, wraps modulo arena_size)
+  size_t len;          // Length of the encoded frame
+  long long time_ms;   // When the message was recorded
+  int room;            // Room the frame was broadcast to
+} history_entry_t;
+
+typedef struct {
+  char *arena;                // arena_size bytes of encoded frames
+  size_t arena_size;
+  history_entry_t *entries;   // Ring of recorded frames, oldest first from head
+  unsigned cap;               // Size of the entries ring
+  unsigned head;              // Index of the oldest entry
+  unsigned count;             // Number of recorded frames
+  size_t end;                 // Position one past the newest frame
+  void (*evicted)(int room);  // Called with the room of every frame evicted
+} history_t;
+
+// Allocates the arena and the entries ring
+// Returns -1 if memory could not be allocated
+int history_init(history_t *h, size_t arena_size, unsigned max_msgs, void (*evicted)(int room));
+
+// Records a frame broadcast to a room, evicting the oldest ones to make room
+// Frames larger than the whole arena (or any frame, if history is disabled) are not recorded
+// Returns 1 if the frame was recorded, 0 if not
+int history_add(history_t *h, int room, const char *frame, size_t len, long long now_ms);
+
+// Copies the newest max_msgs frames of a room recorded at or after since_ms
+// into one buffer, oldest first, so they can be sent with a single write
+// Returns NULL if there is nothing to replay or memory could not be allocated
+frame_buf_t *history_replay(const history_t *h, int room, unsigned max_msgs, long long since_ms);
+
+// Releases the arena and the entries ring, without reporting the frames still in it as evicted
+void history_free(history_t *h);
+
+#endif
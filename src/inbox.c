@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include "inbox.h"
+
+int inbox_push(inbox_t *in, frame_buf_t *fb, int room, int uid)
+{
+  inbox_node_t *node = malloc(sizeof(inbox_node_t));
+  if (node == NULL)
+    return -1;
+  node->fb = frame_buf_retain(fb);
+  node->room = room;
+  node->uid = uid;
+
+  inbox_node_t *head = atomic_load_explicit(&in->head, memory_order_relaxed);
+  do {
+    node->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&in->head, &head, node,
+                                                  memory_order_release, memory_order_relaxed));
+
+  return head == NULL;
+}
+
+inbox_node_t *inbox_take(inbox_t *in)
+{
+  inbox_node_t *node = atomic_exchange_explicit(&in->head, NULL, memory_order_acquire);
+
+  // The stack holds the newest frame first, reverse it
+  inbox_node_t *oldest = NULL;
+  while (node) {
+    inbox_node_t *next = node->next;
+    node->next = oldest;
+    oldest = node;
+    node = next;
+  }
+
+  return oldest;
+}
+
+inbox_node_t *inbox_node_free(inbox_node_t *node)
+{
+  inbox_node_t *next = node->next;
+
+  frame_buf_release(node->fb);
+  free(node);
+  return next;
+}
@@ -0,0 +1,38 @@
+#ifndef INBOX_H
+#define INBOX_H
+
+#include <stdatomic.h>
+#include "framebuf.h"
+
+// One frame posted to an inbox
+typedef struct inbox_node {
+  struct inbox_node *next;
+  frame_buf_t *fb;
+  int room;   // Room the frame is broadcast to
+  int uid;    // Client the frame is addressed to, 0 for a room broadcast
+} inbox_node_t;
+
+// Frames posted to one event loop by other threads
+// Any number of threads may push, only the owning thread takes. Pushes are a
+// single compare-and-swap onto a stack; the owner takes the whole stack with
+// one exchange and reverses it, so frames come out in the order each producer
+// pushed them and no node is ever reused while another thread can see it.
+typedef struct {
+  _Atomic(inbox_node_t *) head;
+} inbox_t;
+
+// Posts a frame broadcast to a room, or addressed to one client if uid is not 0,
+// taking a new reference to it
+// Returns 1 if the inbox was empty (the owner needs a wakeup), 0 if not,
+// or -1 if memory could not be allocated
+int inbox_push(inbox_t *in, frame_buf_t *fb, int room, int uid);
+
+// Takes every posted frame, oldest first
+// Returns NULL if the inbox is empty
+inbox_node_t *inbox_take(inbox_t *in);
+
+// Frees a taken node and drops its reference to the frame
+// Returns the next node in the taken list
+inbox_node_t *inbox_node_free(inbox_node_t *node);
+
+#endif
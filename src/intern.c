@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "intern.h"
+
+typedef struct interned {
+  struct interned *next;   // Next string on the same chain
+  unsigned hash;
+  unsigned long refs;
+  char str[];
+} interned_t;
+
+static interned_t **table;
+static unsigned buckets;   // A power of two
+static unsigned long total;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a hash of a string
+static unsigned hash_str(const char *s)
+{
+  unsigned h = 2166136261u;
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return h;
+}
+
+// Returns the table entry holding an interned string
+static interned_t *entry_of(const char *s)
+{
+  return (interned_t *)(s - offsetof(interned_t, str));
+}
+
+int intern_init(unsigned expected)
+{
+  buckets = INTERN_MIN_BUCKETS;
+  while (buckets < expected && buckets < (1u << 30))
+    buckets <<= 1;
+  table = calloc(buckets, sizeof(interned_t *));
+  return table ? 0 : -1;
+}
+
+// Doubles the table, called with the lock held
+// Keeps the old table if the new one cannot be allocated
+static void grow()
+{
+  interned_t **bigger = calloc(buckets * 2, sizeof(interned_t *));
+  if (bigger == NULL)
+    return;
+
+  for (unsigned i = 0; i < buckets; i++) {
+    while (table[i]) {
+      interned_t *e = table[i];
+      table[i] = e->next;
+      e->next = bigger[e->hash & (buckets * 2 - 1)];
+      bigger[e->hash & (buckets * 2 - 1)] = e;
+    }
+  }
+  free(table);
+  table = bigger;
+  buckets *= 2;
+}
+
+const char *intern_get(const char *s)
+{
+  unsigned h = hash_str(s);
+  interned_t *e;
+
+  pthread_mutex_lock(&intern_lock);
+  for (e = table[h & (buckets - 1)]; e; e = e->next) {
+    if (e->hash == h && strcmp(e->str, s) == 0)
+      break;
+  }
+  if (e == NULL) {
+    size_t len = strlen(s);
+    e = malloc(sizeof(interned_t) + len + 1);
+    if (e) {
+      if (total >= buckets && buckets < (1u << 30))
+        grow();
+      e->hash = h;
+      e->refs = 0;
+      memcpy(e->str, s, len + 1);
+      e->next = table[h & (buckets - 1)];
+      table[h & (buckets - 1)] = e;
+      total++;
+    }
+  }
+  if (e)
+    e->refs++;
+  pthread_mutex_unlock(&intern_lock);
+
+  return e ? e->str : NULL;
+}
+
+const char *intern_retain(const char *s)
+{
+  pthread_mutex_lock(&intern_lock);
+  entry_of(s)->refs++;
+  pthread_mutex_unlock(&intern_lock);
+  return s;
+}
+
+void intern_put(const char *s)
+{
+  interned_t *e = entry_of(s);
+
+  pthread_mutex_lock(&intern_lock);
+  if (--e->refs > 0) {
+    pthread_mutex_unlock(&intern_lock);
+    return;
+  }
+  interned_t **link = &table[e->hash & (buckets - 1)];
+  while (*link != e)
+    link = &(*link)->next;
+  *link = e->next;
+  total--;
+  pthread_mutex_unlock(&intern_lock);
+
+  free(e);
+}
+
+unsigned long intern_count()
+{
+  pthread_mutex_lock(&intern_lock);
+  unsigned long n = total;
+  pthread_mutex_unlock(&intern_lock);
+  return n;
+}
@@ -0,0 +1,32 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+// Server wide table of interned strings
+//
+// Each distinct string is stored once with a reference count, so clients
+// that share a username, and the users index entries that point at them,
+// all share one copy and a connection only holds a pointer. The table is
+// a hash of chains under a mutex, which only logins and disconnects take.
+// It is sized for the expected number of strings at startup and doubled
+// whenever the strings outnumber the buckets, so chains stay short.
+
+#define INTERN_MIN_BUCKETS 4096   // Fewest buckets in the table, a power of two
+
+// Sizes the table for about expected strings, before any is interned
+// Returns -1 if memory could not be allocated
+int intern_init(unsigned expected);
+
+// Returns the shared copy of s, taking a reference to it
+// Returns NULL if memory could not be allocated
+const char *intern_get(const char *s);
+
+// Takes another reference to a string returned by intern_get()
+const char *intern_retain(const char *s);
+
+// Drops a reference to a string returned by intern_get(), freeing it with the last one
+void intern_put(const char *s);
+
+// Returns the number of distinct strings in the table
+unsigned long intern_count();
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "logger.h"
+
+#define DEFAULT_LOG_PATH "server_log.bin"
+
+// Prints CLI usage
+void print_usage()
+{
+  printf("Usage: chatlogdecode [binary log file, default " DEFAULT_LOG_PATH "]\n");
+}
+
+// Prints one record as "[date time.usec] text"
+void print_record(const struct log_record *r, char *text, size_t size)
+{
+  char stamp[64];
+  time_t secs = (time_t)(r->timestamp / 1000000);
+  struct tm *time_info = localtime(&secs);
+
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", time_info);
+  log_record_render(r, text, size);
+  printf("[%s.%06u] %s", stamp, (unsigned)(r->timestamp % 1000000), text);
+}
+
+// Decodes a binary server log (--log-format binary) back into readable text
+int main(int argc, char *argv[])
+{
+  const char *path = argc > 1 ? argv[1] : DEFAULT_LOG_PATH;
+  if (argc > 2 || (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))) {
+    print_usage();
+    return argc > 2 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  FILE *log = fopen(path, "rb");
+  if (log == NULL) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+
+  char magic[LOG_FILE_MAGIC_LENGTH];
+  if (fread(magic, 1, sizeof(magic), log) != sizeof(magic) || memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)) != 0) {
+    printf("%s is not a binary server log\n", path);
+    fclose(log);
+    return EXIT_FAILURE;
+  }
+
+  // Records never exceed a header, a 255 byte name and LOG_MAX_TEXT of text
+  size_t cap = 2 * (LOG_RECORD_HEADER_LENGTH + 255 + LOG_MAX_TEXT);
+  char *buff = malloc(cap);
+  char *text = malloc(cap);
+  if (buff == NULL || text == NULL) {
+    printf("Out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  size_t start = 0, len = 0;
+  int status = EXIT_SUCCESS;
+  for (;;) {
+    struct log_record r;
+    long n = log_record_decode(buff + start, len - start, &r);
+    if (n > 0) {
+      print_record(&r, text, cap);
+      start += n;
+      continue;
+    }
+    if (n < 0) {
+      printf("Malformed record, stopping\n");
+      status = EXIT_FAILURE;
+      break;
+    }
+
+    // Need more bytes, move the partial record to the front and read
+    memmove(buff, buff + start, len - start);
+    len -= start;
+    start = 0;
+    size_t got = fread(buff + len, 1, cap - len, log);
+    if (got == 0) {
+      if (len > 0) {
+        printf("Log ends with a partial record\n");
+        status = EXIT_FAILURE;
+      }
+      break;
+    }
+    len += got;
+  }
+
+  free(buff);
+  free(text);
+  fclose(log);
+  return status;
+}
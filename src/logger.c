@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include "logger.h"
+#include "spsc.h"
+
+#define RING_SIZE   (4 << 20)     // Bytes of records one thread can have waiting, power of two
+#define BATCH_SIZE  (256 * 1024)  // Bytes rendered before the writer issues a write()
+#define MAX_RECORD  (LOG_RECORD_HEADER_LENGTH + 255 + LOG_MAX_TEXT)
+
+// Ring of the calling thread, created on its first record
+static _Thread_local spsc_ring_t *thread_ring;
+
+// Writer state
+static spsc_writer_t writer;
+static int running = 0;
+static int log_fd = -1;
+static int log_format;
+static int log_fsync;
+
+// Writer buffers: rendered text for the console (and a text log file), raw records for a binary file
+static char *text_batch;
+static size_t text_batch_len;
+static char *file_batch;
+static size_t file_batch_len;
+static char *record;   // one record copied out of a ring
+static int dirty;      // set when the file was written after the last fsync()
+static long long last_sync;
+
+// Returns the current time in microseconds since the Unix epoch
+static uint64_t now_usec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Writes the whole buffer, retrying short writes
+static void write_all(int fd, const char *buff, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buff, len);
+    if (n <= 0)
+      return;  // nowhere to report a failing log, give up on this batch
+    buff += n;
+    len -= n;
+  }
+}
+
+// Encodes a record header into buff
+static void encode_header(char *buff, int type, uint32_t uid, size_t name_len, size_t text_len, uint64_t timestamp)
+{
+  uint32_t uid_n = htonl(uid);
+  uint32_t text_len_n = htonl((uint32_t)text_len);
+  uint32_t ts_hi = htonl((uint32_t)(timestamp >> 32));
+  uint32_t ts_lo = htonl((uint32_t)timestamp);
+
+  buff[0] = (char)type;
+  buff[1] = (char)name_len;
+  buff[2] = 0;
+  buff[3] = 0;
+  memcpy(buff + 4, &uid_n, sizeof(uid_n));
+  memcpy(buff + 8, &text_len_n, sizeof(text_len_n));
+  memcpy(buff + 12, &ts_hi, sizeof(ts_hi));
+  memcpy(buff + 16, &ts_lo, sizeof(ts_lo));
+}
+
+// Appends a record to the calling thread's ring
+// Never blocks: if the ring is full the record is dropped and counted
+static void log_record(int type, uint32_t uid, const char *name, size_t name_len,
+                       const char *text, size_t text_len)
+{
+  if (name_len > 255)
+    name_len = 255;  // name_len is a single byte
+  if (text_len > LOG_MAX_TEXT)
+    text_len = LOG_MAX_TEXT;
+
+  // No writer yet (e.g. an error during startup), print straight to the console
+  if (!running) {
+    if (type == LOG_RECORD_CHAT)
+      printf("> %.*s: ", (int)name_len, name);
+    printf("%.*s", (int)text_len, text);
+    return;
+  }
+
+  char hdr[LOG_RECORD_HEADER_LENGTH];
+  encode_header(hdr, type, uid, name_len, text_len, now_usec());
+  struct iovec parts[3] = { { hdr, sizeof(hdr) }, { (void *)name, name_len }, { (void *)text, text_len } };
+  spsc_append(&writer, &thread_ring, parts, 3);
+}
+
+void logger_text(const char *s)
+{
+  log_record(LOG_RECORD_TEXT, 0, NULL, 0, s, strlen(s));
+}
+
+void logger_chat(int uid, const char *name, const char *text)
+{
+  log_record(LOG_RECORD_CHAT, (uint32_t)uid, name, strlen(name), text, strlen(text));
+}
+
+/* writer side */
+
+// Writes out the batch buffers
+static void flush_batch()
+{
+  if (text_batch_len > 0) {
+    write_all(STDOUT_FILENO, text_batch, text_batch_len);
+    if (log_format == LOG_FORMAT_TEXT) {
+      write_all(log_fd, text_batch, text_batch_len);
+      dirty = 1;
+    }
+    text_batch_len = 0;
+  }
+  if (file_batch_len > 0) {
+    write_all(log_fd, file_batch, file_batch_len);
+    file_batch_len = 0;
+    dirty = 1;
+  }
+}
+
+// Adds a record to the batch, rendered for the console and raw for a binary file
+static void emit_record(const struct log_record *r, const char *raw, size_t len)
+{
+  if (text_batch_len + len + 8 > BATCH_SIZE || file_batch_len + len > BATCH_SIZE)
+    flush_batch();
+
+  text_batch_len += log_record_render(r, text_batch + text_batch_len, BATCH_SIZE - text_batch_len);
+  if (log_format == LOG_FORMAT_BINARY) {
+    memcpy(file_batch + file_batch_len, raw, len);
+    file_batch_len += len;
+  }
+}
+
+// Adds a message generated by the writer itself to the batch
+static void emit_text(const char *s)
+{
+  struct log_record r;
+  size_t len = LOG_RECORD_HEADER_LENGTH + strlen(s);
+
+  encode_header(record, LOG_RECORD_TEXT, 0, 0, strlen(s), now_usec());
+  memcpy(record + LOG_RECORD_HEADER_LENGTH, s, strlen(s));
+  log_record_decode(record, len, &r);
+  emit_record(&r, record, len);
+}
+
+// Returns the length of the record whose header is hdr
+static size_t record_len(const char *hdr)
+{
+  struct log_record r;
+  log_record_decode(hdr, LOG_RECORD_HEADER_LENGTH, &r);
+  return LOG_RECORD_HEADER_LENGTH + r.name_len + r.text_len;
+}
+
+// Returns the timestamp of the record whose header is hdr
+static uint64_t record_time(const char *hdr)
+{
+  struct log_record r;
+  log_record_decode(hdr, LOG_RECORD_HEADER_LENGTH, &r);
+  return r.timestamp;
+}
+
+// Moves the next record of a ring into the batch
+static int take_record(spsc_writer_t *w, const spsc_ring_t *ring, size_t pos, size_t len)
+{
+  struct log_record r;
+
+  spsc_copy_out(w, ring, pos, record, len);
+  log_record_decode(record, len, &r);
+  emit_record(&r, record, len);
+  return 0;
+}
+
+// Writes out the batch, then syncs according to the fsync policy
+static void batch_done(spsc_writer_t *w, unsigned long dropped)
+{
+  char buff[128];
+  (void)w;
+
+  if (dropped > 0) {
+    sprintf(buff, "*** %lu log records dropped, the log writer fell behind\n", dropped);
+    emit_text(buff);
+  }
+
+  flush_batch();
+
+  if (dirty && log_fsync != LOG_FSYNC_NEVER) {
+    long long now = (long long)(now_usec() / 1000);
+    if (log_fsync == LOG_FSYNC_BATCH || now - last_sync >= 1000) {
+      fsync(log_fd);
+      dirty = 0;
+      last_sync = now;
+    }
+  }
+}
+
+int logger_open(const char *path, int format, int flush_ms, int fsync_policy, int append)
+{
+  log_format = format;
+  log_fsync = fsync_policy;
+
+  if ((log_fd = open(path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC) | O_CLOEXEC, 0644)) < 0)
+    return -1;
+  if (format == LOG_FORMAT_BINARY && lseek(log_fd, 0, SEEK_END) == 0)
+    write_all(log_fd, LOG_FILE_MAGIC, LOG_FILE_MAGIC_LENGTH);
+
+  text_batch = malloc(BATCH_SIZE);
+  file_batch = malloc(BATCH_SIZE);
+  record = malloc(MAX_RECORD);
+  if (text_batch == NULL || file_batch == NULL || record == NULL)
+    return -1;
+  writer.ring_size = RING_SIZE;
+  writer.header_len = LOG_RECORD_HEADER_LENGTH;
+  writer.flush_ms = flush_ms;
+  writer.record_len = record_len;
+  writer.record_time = record_time;
+  writer.take = take_record;
+  writer.batch_done = batch_done;
+  if (spsc_start(&writer) < 0)
+    return -1;
+
+  running = 1;
+  return 0;
+}
+
+void logger_close()
+{
+  if (!running)
+    return;
+
+  spsc_stop(&writer, &thread_ring);
+  running = 0;
+
+  if (log_fsync != LOG_FSYNC_NEVER)
+    fsync(log_fd);
+  close(log_fd);
+  free(text_batch);
+  free(file_batch);
+  free(record);
+}
+
+/* record format */
+
+long log_record_decode(const char *buff, size_t len, struct log_record *r)
+{
+  uint32_t uid_n, text_len_n, ts_hi, ts_lo;
+
+  if (len < LOG_RECORD_HEADER_LENGTH)
+    return 0;
+
+  r->type = (uint8_t)buff[0];
+  r->name_len = (uint8_t)buff[1];
+  memcpy(&uid_n, buff + 4, sizeof(uid_n));
+  memcpy(&text_len_n, buff + 8, sizeof(text_len_n));
+  memcpy(&ts_hi, buff + 12, sizeof(ts_hi));
+  memcpy(&ts_lo, buff + 16, sizeof(ts_lo));
+  r->uid = ntohl(uid_n);
+  r->text_len = ntohl(text_len_n);
+  r->timestamp = ((uint64_t)ntohl(ts_hi) << 32) | ntohl(ts_lo);
+
+  if ((r->type != LOG_RECORD_TEXT && r->type != LOG_RECORD_CHAT) || r->text_len > LOG_MAX_TEXT)
+    return -1;
+
+  size_t total = LOG_RECORD_HEADER_LENGTH + r->name_len + r->text_len;
+  r->name = buff + LOG_RECORD_HEADER_LENGTH;
+  r->text = r->name + r->name_len;
+  if (len < total)
+    return 0;
+
+  return (long)total;
+}
+
+size_t log_record_render(const struct log_record *r, char *buff, size_t size)
+{
+  int n;
+
+  if (r->type == LOG_RECORD_CHAT) {
+    n = snprintf(buff, size, "> %.*s: %.*s", (int)r->name_len, r->name, (int)r->text_len, r->text);
+  } else {
+    n = snprintf(buff, size, "%.*s", (int)r->text_len, r->text);
+  }
+
+  if (n < 0)
+    return 0;
+  return (size_t)n < size ? (size_t)n : size - 1;
+}
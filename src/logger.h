@@ -0,0 +1,83 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//////// ASYNCHRONOUS SERVER LOG ////////
+//
+// Threads that log never touch the disk or the console. Each thread appends
+// records to its own lock-free single producer ring, and a background writer
+// thread drains every ring in batches, renders the records and writes each
+// batch with one write() per destination. A full ring drops records (and
+// counts them) instead of blocking the thread that logs.
+
+// Log file formats
+#define LOG_FORMAT_TEXT   0   // Rendered text, the same lines printed to the console
+#define LOG_FORMAT_BINARY 1   // Raw records, read back with chatlogdecode
+
+// When the writer calls fsync() on the log file
+#define LOG_FSYNC_NEVER   0   // Leave write back to the kernel
+#define LOG_FSYNC_BATCH   1   // After every batch it writes
+#define LOG_FSYNC_SECOND  2   // At most once per second
+
+// Record types
+#define LOG_RECORD_TEXT   1   // Free form server message
+#define LOG_RECORD_CHAT   2   // Chat line sent by a client, rendered as "> name: text"
+
+//////// BINARY FORMAT ////////
+//
+// A binary log file starts with LOG_FILE_MAGIC followed by records:
+//
+//   +------+----------+----------+-----+----------+-----------+----------+------+
+//   | type | name_len | reserved | uid | text_len | timestamp | name ... | text |
+//   |  u8  |    u8    |   u16    | u32 |   u32    |    u64    |          |      |
+//   +------+----------+----------+-----+----------+-----------+----------+------+
+//
+// Multi-byte fields are in network byte order, timestamp is in microseconds
+// since the Unix epoch. Text records have no name and a uid of 0.
+
+#define LOG_FILE_MAGIC         "CHATLOG1"
+#define LOG_FILE_MAGIC_LENGTH  8
+#define LOG_RECORD_HEADER_LENGTH 20
+#define LOG_MAX_TEXT           (64 * 1024)   // Longer text is truncated
+
+// A decoded record
+// name and text point into the buffer the record was decoded from
+struct log_record {
+  uint8_t type;
+  uint8_t name_len;
+  uint32_t uid;
+  uint32_t text_len;
+  uint64_t timestamp;
+  const char *name;
+  const char *text;
+};
+
+// Opens the log file and starts the writer thread
+// Records are written within flush_ms milliseconds, sooner if a ring fills up
+// With append set the records already in the file are kept (a server that took over from
+// another carries on its log), otherwise the file starts empty
+// Returns -1 if the file could not be opened or the thread could not start
+int logger_open(const char *path, int format, int flush_ms, int fsync_policy, int append);
+
+// Logs a '\0' terminated message
+void logger_text(const char *s);
+
+// Logs a chat line sent by a client
+void logger_chat(int uid, const char *name, const char *text);
+
+// Writes out every record logged so far, stops the writer and closes the file
+// Must only be called once no other thread is logging
+void logger_close();
+
+// Decodes the record at the start of buff
+// Returns the record's length, 0 if more bytes are needed or -1 if it is malformed
+long log_record_decode(const char *buff, size_t len, struct log_record *r);
+
+// Renders a record as text into buff, which should hold at least
+// name_len + text_len + 8 bytes (longer records are truncated)
+// Returns the number of bytes written, not counting the '\0'
+size_t log_record_render(const struct log_record *r, char *buff, size_t size);
+
+#endif
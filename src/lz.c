@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define MIN_MATCH     4      // Shortest match worth encoding
+#define LAST_LITERALS 5      // The block always ends with at least this many literals
+#define MATCH_LIMIT   12     // No match starts in the last MATCH_LIMIT bytes
+#define MAX_OFFSET    65535
+#define HASH_BITS     12
+
+// Reads 4 bytes without alignment requirements
+static uint32_t read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Hashes a 4 byte sequence into the match table (Fibonacci hashing)
+static unsigned hash_seq(uint32_t seq)
+{
+  return (seq * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes a length that did not fit in its nibble as a run of 255s and a remainder
+static unsigned char *write_length(unsigned char *op, size_t n)
+{
+  while (n >= 255) {
+    *op++ = 255;
+    n -= 255;
+  }
+  *op++ = (unsigned char)n;
+  return op;
+}
+
+// Emits one step: the literals in [lit, lit + lit_len), then a match unless match_len is 0
+// Returns the new output position, or NULL if the step would not fit before end
+static unsigned char *emit(unsigned char *op, unsigned char *end, const unsigned char *lit, size_t lit_len,
+                           size_t offset, size_t match_len)
+{
+  size_t need = 1 + lit_len + lit_len / 255 + 1 + (match_len ? 2 + match_len / 255 + 1 : 0);
+  if (need > (size_t)(end - op))
+    return NULL;
+
+  unsigned char *token = op++;
+  if (lit_len >= 15) {
+    *token = 15 << 4;
+    op = write_length(op, lit_len - 15);
+  } else {
+    *token = (unsigned char)(lit_len << 4);
+  }
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+
+  if (match_len == 0)
+    return op;
+
+  *op++ = (unsigned char)(offset & 0xff);
+  *op++ = (unsigned char)(offset >> 8);
+  if (match_len - MIN_MATCH >= 15) {
+    *token |= 15;
+    op = write_length(op, match_len - MIN_MATCH - 15);
+  } else {
+    *token |= (unsigned char)(match_len - MIN_MATCH);
+  }
+  return op;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *op = (unsigned char *)dst, *end = op + cap;
+  uint32_t table[1 << HASH_BITS];
+  size_t ip = 0, anchor = 0;
+
+  if (len >= LZ_MAX_INPUT)
+    return 0;
+
+  if (len > MATCH_LIMIT) {
+    memset(table, 0, sizeof(table));
+    size_t limit = len - MATCH_LIMIT;
+    while (ip < limit) {
+      uint32_t seq = read32(in + ip);
+      unsigned h = hash_seq(seq);
+      size_t cand = table[h];
+      table[h] = (uint32_t)ip;
+
+      if (cand >= ip || ip - cand > MAX_OFFSET || read32(in + cand) != seq) {
+        ip++;
+        continue;
+      }
+
+      // Extend the match forwards, stopping short of the final literals, then backwards
+      size_t match_len = MIN_MATCH;
+      while (ip + match_len < len - LAST_LITERALS && in[cand + match_len] == in[ip + match_len])
+        match_len++;
+      while (ip > anchor && cand > 0 && in[ip - 1] == in[cand - 1]) {
+        ip--;
+        cand--;
+        match_len++;
+      }
+
+      op = emit(op, end, in + anchor, ip - anchor, ip - cand, match_len);
+      if (op == NULL)
+        return 0;
+      ip += match_len;
+      anchor = ip;
+    }
+  }
+
+  op = emit(op, end, in + anchor, len - anchor, 0, 0);
+  if (op == NULL)
+    return 0;
+  return (size_t)(op - (unsigned char *)dst);
+}
+
+// Reads the extension bytes of a length whose nibble was 15
+// Returns -1 if the input ends first
+static int read_length(const unsigned char *in, size_t len, size_t *ip, size_t *n)
+{
+  unsigned char b;
+  do {
+    if (*ip >= len)
+      return -1;
+    b = in[(*ip)++];
+    *n += b;
+  } while (b == 255);
+  return 0;
+}
+
+long lz_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *out = (unsigned char *)dst;
+  size_t ip = 0, op = 0;
+
+  while (ip < len) {
+    unsigned token = in[ip++];
+
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && read_length(in, len, &ip, &lit_len) < 0)
+      return -1;
+    if (lit_len > len - ip || lit_len > cap - op)
+      return -1;
+    memcpy(out + op, in + ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+    if (ip == len)
+      break;  // the last step has no match
+
+    if (len - ip < 2)
+      return -1;
+    size_t offset = in[ip] | (size_t)in[ip + 1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > op)
+      return -1;
+
+    size_t match_len = token & 15;
+    if (match_len == 15 && read_length(in, len, &ip, &match_len) < 0)
+      return -1;
+    match_len += MIN_MATCH;
+    if (match_len > cap - op)
+      return -1;
+
+    // Byte by byte, a match may overlap the bytes it produces
+    for (size_t i = 0; i < match_len; i++, op++)
+      out[op] = out[op - offset];
+  }
+
+  return (long)op;
+}
@@ -0,0 +1,26 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// Fast LZ77 compression in the LZ4 block format
+//
+// A block is a sequence of (token, literals, match) steps: the token's high
+// nibble is the literal count and its low nibble the match length minus 4,
+// either extended by following bytes of 255 when it is 15, then the
+// literals, then the match as a 2 byte little endian offset back into the
+// output. The last step has literals only. Matches are found through a hash
+// of 4 byte sequences, a single probe per position, which trades ratio for
+// speed the way LZ4's fast mode does.
+
+#define LZ_MAX_INPUT (64 * 1024 * 1024)   // Inputs must be smaller than this
+
+// Compresses len bytes of src into dst, which holds cap bytes
+// Returns the compressed length, or 0 if it would not fit in cap
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap);
+
+// Decompresses a block of len bytes into dst, which holds cap bytes
+// Returns the decompressed length, or -1 if the block is malformed or does not fit
+long lz_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include "protocol.h"
+#include "metrics.h"
+
+_Thread_local metrics_t *thread_metrics;
+
+// Names of the counted command codes, NULL for codes with no command
+static const char *command_names[METRIC_COMMANDS] = {
+  [0] = "unknown",
+  [HAPPY_COMMAND] = "happy",
+  [SAD_COMMAND] = "sad",
+  [MYTIME_COMMAND] = "mytime",
+  [MYTIMEPLUS_COMMAND] = "mytimeplus",
+  [HELP_COMMAND] = "help",
+  [SENDMSG_COMMAND] = "sendmsg",
+  [QUIT_COMMAND] = "quit",
+  [LOGIN_COMMAND] = "login",
+  [JOIN_COMMAND] = "join",
+  [LEAVE_COMMAND] = "leave",
+  [LIST_COMMAND] = "list",
+  [DM_COMMAND] = "dm",
+  [ATTACH_COMMAND] = "attach",
+  [ATTACH_END_COMMAND] = "attach_end",
+  [HISTORY_COMMAND] = "history",
+  [PONG_COMMAND] = "pong",
+};
+
+void histogram_add(histogram_t *h, unsigned long v)
+{
+  unsigned b = v ? 64 - __builtin_clzl(v) : 0;
+  if (b >= HIST_BUCKETS)
+    b = HIST_BUCKETS - 1;
+
+  counter_add(&h->buckets[b], 1);
+  counter_add(&h->count, 1);
+  counter_add(&h->sum, v);
+}
+
+long long metrics_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_lock_held(long long since_ns)
+{
+  if (thread_metrics)
+    histogram_add(&thread_metrics->lock_hold_ns, (unsigned long)(metrics_now_ns() - since_ns));
+}
+
+// Adds one histogram to another
+static void histogram_sum(histogram_t *total, const histogram_t *h)
+{
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    counter_add(&total->buckets[i], counter_get(&h->buckets[i]));
+  counter_add(&total->count, counter_get(&h->count));
+  counter_add(&total->sum, counter_get(&h->sum));
+}
+
+void metrics_sum(metrics_t *total, const metrics_t *m)
+{
+  for (int i = 0; i < METRIC_COMMANDS; i++)
+    counter_add(&total->commands[i], counter_get(&m->commands[i]));
+  counter_add(&total->bytes_in, counter_get(&m->bytes_in));
+  counter_add(&total->accepts, counter_get(&m->accepts));
+  counter_add(&total->logins, counter_get(&m->logins));
+  counter_add(&total->login_failures, counter_get(&m->login_failures));
+  counter_add(&total->send_failures, counter_get(&m->send_failures));
+  counter_add(&total->slow_drops, counter_get(&m->slow_drops));
+  counter_add(&total->slow_disconnects, counter_get(&m->slow_disconnects));
+  counter_add(&total->pings, counter_get(&m->pings));
+  counter_add(&total->idle_disconnects, counter_get(&m->idle_disconnects));
+  counter_add(&total->rate_limited, counter_get(&m->rate_limited));
+  counter_add(&total->sampled_out, counter_get(&m->sampled_out));
+  counter_add(&total->overload_rejects, counter_get(&m->overload_rejects));
+  counter_add(&total->frame_allocs, counter_get(&m->frame_allocs));
+  counter_add(&total->frame_pool_hits, counter_get(&m->frame_pool_hits));
+  counter_add(&total->frame_pool_cached, counter_get(&m->frame_pool_cached));
+  counter_add(&total->compressions, counter_get(&m->compressions));
+  counter_add(&total->compress_saved, counter_get(&m->compress_saved));
+  histogram_sum(&total->fanout, &m->fanout);
+  histogram_sum(&total->queue_depth, &m->queue_depth);
+  histogram_sum(&total->login_us, &m->login_us);
+  histogram_sum(&total->lock_hold_ns, &m->lock_hold_ns);
+}
+
+// Returns the upper bound of the bucket holding the given fraction of a histogram's values
+static unsigned long percentile(const histogram_t *h, double fraction)
+{
+  unsigned long rank = (unsigned long)(fraction * counter_get(&h->count)), seen = 0;
+
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += counter_get(&h->buckets[i]);
+    if (seen > rank)
+      return i ? (1UL << i) - 1 : 0;
+  }
+  return 0;
+}
+
+// Returns the upper bound of the highest non empty bucket of a histogram
+static unsigned long highest(const histogram_t *h)
+{
+  for (int i = HIST_BUCKETS - 1; i > 0; i--) {
+    if (counter_get(&h->buckets[i]))
+      return (1UL << i) - 1;
+  }
+  return 0;
+}
+
+// Appends formatted text at buff + *len, truncating at size
+static void append(char *buff, size_t size, size_t *len, const char *fmt, ...)
+{
+  va_list args;
+
+  if (*len + 1 >= size)
+    return;
+  va_start(args, fmt);
+  int n = vsnprintf(buff + *len, size - *len, fmt, args);
+  va_end(args);
+  if (n > 0)
+    *len = (size_t)n < size - *len ? *len + n : size - 1;
+}
+
+// Appends one histogram as "name count=N avg=X p50<=Y p99<=Z max<=W"
+static void append_histogram(char *buff, size_t size, size_t *len, const char *name, const histogram_t *h)
+{
+  unsigned long count = counter_get(&h->count);
+  double avg = count ? (double)counter_get(&h->sum) / count : 0;
+
+  append(buff, size, len, "%s count=%lu avg=%.1f p50<=%lu p99<=%lu max<=%lu\n", name, count, avg,
+         percentile(h, 0.5), percentile(h, 0.99), highest(h));
+}
+
+size_t metrics_render(const metrics_t *m, char *buff, size_t size)
+{
+  size_t len = 0;
+
+  buff[0] = '\0';
+  for (int i = 0; i < METRIC_COMMANDS; i++) {
+    if (command_names[i])
+      append(buff, size, &len, "commands.%s %lu\n", command_names[i], counter_get(&m->commands[i]));
+  }
+  append(buff, size, &len, "bytes_in %lu\n", counter_get(&m->bytes_in));
+  append(buff, size, &len, "accepts %lu\n", counter_get(&m->accepts));
+  append(buff, size, &len, "logins %lu\n", counter_get(&m->logins));
+  append(buff, size, &len, "login_failures %lu\n", counter_get(&m->login_failures));
+  append(buff, size, &len, "send_failures %lu\n", counter_get(&m->send_failures));
+  append(buff, size, &len, "slow_drops %lu\n", counter_get(&m->slow_drops));
+  append(buff, size, &len, "slow_disconnects %lu\n", counter_get(&m->slow_disconnects));
+  append(buff, size, &len, "pings %lu\n", counter_get(&m->pings));
+  append(buff, size, &len, "idle_disconnects %lu\n", counter_get(&m->idle_disconnects));
+  append(buff, size, &len, "rate_limited %lu\n", counter_get(&m->rate_limited));
+  append(buff, size, &len, "sampled_out %lu\n", counter_get(&m->sampled_out));
+  append(buff, size, &len, "overload_rejects %lu\n", counter_get(&m->overload_rejects));
+  append(buff, size, &len, "frame_allocs %lu\n", counter_get(&m->frame_allocs));
+  append(buff, size, &len, "frame_pool_hits %lu\n", counter_get(&m->frame_pool_hits));
+  append(buff, size, &len, "frame_pool_cached %ld\n", (long)counter_get(&m->frame_pool_cached));
+  append(buff, size, &len, "compressions %lu\n", counter_get(&m->compressions));
+  append(buff, size, &len, "compress_saved %lu\n", counter_get(&m->compress_saved));
+  append_histogram(buff, size, &len, "fanout", &m->fanout);
+  append_histogram(buff, size, &len, "queue_depth", &m->queue_depth);
+  append_histogram(buff, size, &len, "login_us", &m->login_us);
+  append_histogram(buff, size, &len, "lock_hold_ns", &m->lock_hold_ns);
+
+  return len;
+}
@@ -0,0 +1,85 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+//////// SERVER METRICS ////////
+//
+// Every event loop thread records into its own metrics_t and is the only
+// thread that writes to it, so recording is a plain load and store with no
+// locked instruction. Readers (the stats endpoint) add up every thread's
+// copy with relaxed loads when a report is asked for, so the numbers are
+// not a consistent snapshot but never block the threads that record them.
+
+#define HIST_BUCKETS    40   // Bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zeros
+#define METRIC_COMMANDS 17   // Command codes counted one by one (up to PONG_COMMAND), others count as unknown
+
+// A counter written by one thread and read by any
+typedef atomic_ulong counter_t;
+
+// Adds n to a counter owned by the calling thread
+static inline void counter_add(counter_t *c, unsigned long n)
+{
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Reads a counter from any thread
+static inline unsigned long counter_get(const counter_t *c)
+{
+  return atomic_load_explicit((counter_t *)c, memory_order_relaxed);
+}
+
+// Distribution of a value over power of two buckets
+typedef struct {
+  counter_t buckets[HIST_BUCKETS];
+  counter_t count;   // Values recorded
+  counter_t sum;     // Sum of the values recorded
+} histogram_t;
+
+typedef struct {
+  counter_t commands[METRIC_COMMANDS];   // Frames received per command code (0 counts unknown codes)
+  counter_t bytes_in;                    // Bytes received from clients
+  counter_t accepts;                     // Connections accepted
+  counter_t logins;                      // Successful logins
+  counter_t login_failures;              // Wrong passwords, full room, overload and login timeouts
+  counter_t send_failures;               // Writes that failed and frames that could not be queued
+  counter_t slow_drops;                  // Frames dropped because the client read too slowly
+  counter_t slow_disconnects;            // Clients disconnected for reading too slowly
+  counter_t pings;                       // Heartbeats sent to clients that went silent
+  counter_t idle_disconnects;            // Clients disconnected for not answering a heartbeat in time
+  counter_t rate_limited;                // Commands dropped because the client sent faster than its rate
+  counter_t sampled_out;                 // Low priority commands dropped while the server was overloaded
+  counter_t overload_rejects;            // Logins turned away while the server was overloaded
+  counter_t frame_allocs;                // Frame buffers allocated
+  counter_t frame_pool_hits;             // Frame buffers reused from the thread's pool instead of malloc()
+  counter_t compressions;                // Frames compressed for clients that negotiated compression
+  counter_t compress_saved;              // Bytes those compressed frames are smaller by, per copy
+  counter_t frame_pool_cached;           // Released frame buffers the thread's pool holds (goes negative
+                                         // on threads that take more than they release, the sum is exact)
+  histogram_t fanout;                    // Recipients per broadcast, on each shard it reaches
+  histogram_t queue_depth;               // Frames queued for a client when it is flushed
+  histogram_t login_us;                  // Microseconds from accept to a successful login
+  histogram_t lock_hold_ns;              // Nanoseconds the users index or rooms directory lock was held
+} metrics_t;
+
+// Metrics of the calling thread, NULL for threads that record none
+extern _Thread_local metrics_t *thread_metrics;
+
+// Records a value
+void histogram_add(histogram_t *h, unsigned long v);
+
+// Returns a monotonic time in nanoseconds
+long long metrics_now_ns();
+
+// Records that the calling thread held a lock since the given metrics_now_ns() time
+void metrics_lock_held(long long since_ns);
+
+// Adds the metrics recorded by one thread to a running total
+void metrics_sum(metrics_t *total, const metrics_t *m);
+
+// Renders metrics as text, one line per counter and per histogram
+// Returns the number of bytes written, not counting the '\0'
+size_t metrics_render(const metrics_t *m, char *buff, size_t size);
+
+#endif
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "outqueue.h"
+
+#define INITIAL_CAP 8
+
+// Returns the slot of the i-th frame from the head
+static unsigned slot(const out_queue_t *q, unsigned i)
+{
+  return (q->head + i) & (q->cap - 1);
+}
+
+// Returns the total length of an iovec array
+static size_t msg_len(const struct iovec *iov, unsigned n_iov)
+{
+  size_t len = 0;
+  for (unsigned i = 0; i < n_iov; i++)
+    len += iov[i].iov_len;
+  return len;
+}
+
+// Returns how many of the head frame's in memory bytes are still to be written
+static size_t head_memory_left(const out_queue_t *q)
+{
+  frame_buf_t *fb = q->frames[q->head];
+  return q->offset < fb->len ? fb->len - q->offset : 0;
+}
+
+// Retires n queued bytes from the queue and its running total
+static void retire_bytes(out_queue_t *q, size_t n)
+{
+  q->bytes -= n;
+  if (q->total)
+    *q->total -= n;
+}
+
+// Removes the head frame and drops the queue's reference to it
+static void pop_head(out_queue_t *q)
+{
+  frame_buf_t *fb = q->frames[q->head];
+
+  retire_bytes(q, head_memory_left(q));
+  q->offset = 0;
+  q->head = slot(q, 1);
+  q->count--;
+  frame_buf_release(fb);
+}
+
+void outq_account(out_queue_t *q, size_t *total)
+{
+  q->total = total;
+  if (total)
+    *total += q->bytes;
+}
+
+int outq_push(out_queue_t *q, frame_buf_t *fb)
+{
+  // Grow the ring, keeping its size a power of two so slot() can mask
+  if (q->count == q->cap) {
+    unsigned cap = q->cap ? q->cap * 2 : INITIAL_CAP;
+    frame_buf_t **frames = malloc(cap * sizeof(frame_buf_t *));
+    if (frames == NULL)
+      return -1;
+    for (unsigned i = 0; i < q->count; i++)
+      frames[i] = q->frames[slot(q, i)];
+    free(q->frames);
+    q->frames = frames;
+    q->head = 0;
+    q->cap = cap;
+  }
+
+  q->frames[slot(q, q->count)] = frame_buf_retain(fb);
+  q->count++;
+  q->bytes += fb->len;
+  if (q->total)
+    *q->total += fb->len;
+
+  return 0;
+}
+
+// Returns how many frames at the head must stay queued
+static unsigned kept_frames(const out_queue_t *q)
+{
+  unsigned keep = q->offset > 0 ? 1 : 0;
+  return q->pinned > keep ? q->pinned : keep;
+}
+
+unsigned outq_drop_oldest(out_queue_t *q, size_t need, size_t limit)
+{
+  unsigned keep = kept_frames(q);
+  unsigned dropped = 0;
+
+  while (q->count > keep && q->bytes + need > limit) {
+    if (keep > 0) {
+      // Drop the oldest frame behind the kept ones, moving the kept ones up a slot
+      unsigned victim = slot(q, keep);
+      frame_buf_t *fb = q->frames[victim];
+      retire_bytes(q, fb->len);
+      for (unsigned i = keep; i > 0; i--)
+        q->frames[slot(q, i)] = q->frames[slot(q, i - 1)];
+      q->head = slot(q, 1);
+      q->count--;
+      frame_buf_release(fb);
+    } else {
+      pop_head(q);
+    }
+    dropped++;
+  }
+
+  return dropped;
+}
+
+unsigned outq_drop_unsent(out_queue_t *q)
+{
+  unsigned keep = kept_frames(q);
+  unsigned dropped = 0;
+
+  while (q->count > keep) {
+    unsigned last = slot(q, q->count - 1);
+    retire_bytes(q, q->frames[last]->len);
+    frame_buf_release(q->frames[last]);
+    q->count--;
+    dropped++;
+  }
+
+  return dropped;
+}
+
+int outq_file_pending(const out_queue_t *q)
+{
+  return q->count > 0 && q->offset >= q->frames[q->head]->len && q->frames[q->head]->file_len > 0;
+}
+
+unsigned outq_gather(const out_queue_t *q, struct iovec *iov, unsigned max)
+{
+  if (outq_file_pending(q))
+    return 0;
+
+  unsigned n_iov = 0;
+  while (n_iov < q->count && n_iov < max) {
+    frame_buf_t *fb = q->frames[slot(q, n_iov)];
+    iov[n_iov].iov_base = fb->data;
+    iov[n_iov].iov_len = fb->len;
+    n_iov++;
+    if (fb->file_len > 0)
+      break;  // the file contents come next on the wire
+  }
+  if (n_iov > 0) {
+    iov[0].iov_base = (char *)iov[0].iov_base + q->offset;
+    iov[0].iov_len -= q->offset;
+  }
+
+  return n_iov;
+}
+
+void outq_advance(out_queue_t *q, size_t n, outq_stats_t *stats)
+{
+  counter_add(&stats->bytes, n);
+
+  // Retire every frame written whole, and note how much of the next one was written
+  while (n > 0 && q->count > 0) {
+    size_t rest = frame_buf_wire_len(q->frames[q->head]) - q->offset;
+    if (n < rest) {
+      size_t memory = head_memory_left(q);
+      retire_bytes(q, n < memory ? n : memory);
+      q->offset += n;
+      return;
+    }
+    n -= rest;
+    pop_head(q);
+    counter_add(&stats->frames, 1);
+  }
+}
+
+int outq_write(out_queue_t *q, int fd, outq_stats_t *stats)
+{
+  struct iovec iov[OUTQ_IOV_MAX];
+  struct msghdr msg;
+
+  while (q->count > 0) {
+    if (outq_file_pending(q)) {
+      // Send the rest of the head frame's file contents straight from the page cache
+      frame_buf_t *fb = q->frames[q->head];
+      off_t pos = (off_t)(q->offset - fb->len);
+      size_t want = fb->file_len - (size_t)pos;
+      ssize_t n = sendfile(fd, fb->file_fd, &pos, want);
+      counter_add(&stats->syscalls, 1);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return 0;
+        return -1;
+      }
+      if (n == 0)
+        return -1;  // the file is shorter than announced, the frame can never be completed
+      outq_advance(q, (size_t)n, stats);
+      if ((size_t)n < want)
+        return 0;  // short write, the socket buffer is full
+      continue;
+    }
+
+    unsigned n_iov = outq_gather(q, iov, OUTQ_IOV_MAX);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_iov;
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    counter_add(&stats->syscalls, 1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;  // socket buffer is full, wait for the peer to read
+      return -1;
+    }
+
+    outq_advance(q, (size_t)n, stats);
+    if (q->count > 0 && (size_t)n < msg_len(iov, n_iov))
+      return 0;  // short write, the socket buffer is full
+  }
+
+  return 0;
+}
+
+int outq_empty(const out_queue_t *q)
+{
+  return q->count == 0;
+}
+
+frame_buf_t *outq_at(const out_queue_t *q, unsigned i)
+{
+  return q->frames[slot(q, i)];
+}
+
+void outq_trim(out_queue_t *q)
+{
+  if (q->count == 0) {
+    free(q->frames);
+    q->frames = NULL;
+    q->head = 0;
+    q->cap = 0;
+  }
+}
+
+void outq_free(out_queue_t *q)
+{
+  while (q->count > 0)
+    pop_head(q);
+  free(q->frames);
+  q->frames = NULL;
+  q->cap = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "framebuf.h"
+#include "metrics.h"
+
+#define OUTQ_IOV_MAX 64   // Most frames gathered into one send call
+
+// Frames waiting to be written to one connection
+// The queue holds a reference to each frame, so broadcasts share one buffer
+// across every recipient's queue. Queued frames are gathered into a single
+// non-blocking sendmsg() (up to OUTQ_IOV_MAX at a time), and offset tracks
+// how much of the head frame the socket took. Frames handed to an
+// asynchronous send are pinned until it completes and are never dropped.
+// A frame that ends with file contents stops the gather; once its in memory
+// part is written the rest goes out with sendfile().
+typedef struct {
+  frame_buf_t **frames;   // Ring of queued frames
+  unsigned head;          // Index of the oldest frame
+  unsigned count;         // Number of queued frames
+  unsigned cap;           // Size of the frames ring
+  size_t offset;          // Bytes of the head frame already written
+  size_t bytes;           // Bytes queued in memory and not yet written (file contents are not counted)
+  size_t *total;          // Running total that bytes is also counted in, NULL for none (see outq_account())
+  unsigned pinned;        // Frames at the head an asynchronous send is still reading
+} out_queue_t;
+
+// Running totals of the work done by outq_write()
+// Written by the thread that owns the queues, readable from any thread
+typedef struct {
+  counter_t syscalls;   // Send calls made
+  counter_t frames;     // Frames completely written
+  counter_t bytes;      // Bytes written
+} outq_stats_t;
+
+// Counts the queue's bytes in *total from now on, as they are pushed, written and dropped
+// Every queue of a shard shares one total, so the shard knows what it has queued without walking them
+void outq_account(out_queue_t *q, size_t *total);
+
+// Appends a frame, taking a new reference to it
+// Returns -1 if memory could not be allocated
+int outq_push(out_queue_t *q, frame_buf_t *fb);
+
+// Drops queued frames, oldest first, until at least need bytes are free under limit
+// A partially written head frame is never dropped, since the peer already has part of it,
+// and neither are pinned frames
+// Returns the number of frames dropped
+unsigned outq_drop_oldest(out_queue_t *q, size_t need, size_t limit);
+
+// Drops every frame that has not started being written
+// Returns the number of frames dropped
+unsigned outq_drop_unsent(out_queue_t *q);
+
+// Fills iov with up to max of the queued frames, starting where the last write left off
+// and stopping after the in memory part of a frame that ends with file contents
+// Returns the number of iovecs filled (0 if outq_file_pending())
+unsigned outq_gather(const out_queue_t *q, struct iovec *iov, unsigned max);
+
+// Returns non zero if the head frame is partway through its file contents,
+// which only outq_write() can send
+int outq_file_pending(const out_queue_t *q);
+
+// Retires n written bytes from the head of the queue
+// Adds the frames completely written to stats
+void outq_advance(out_queue_t *q, size_t n, outq_stats_t *stats);
+
+// Writes as much of the queue to fd as the socket accepts without blocking
+// Adds the send calls made and frames written to stats
+// Returns -1 if the connection failed, 0 otherwise
+int outq_write(out_queue_t *q, int fd, outq_stats_t *stats);
+
+// Returns non zero if nothing is waiting to be written
+int outq_empty(const out_queue_t *q);
+
+// Returns the i-th queued frame, oldest first (the head frame may be partly written, see offset)
+frame_buf_t *outq_at(const out_queue_t *q, unsigned i);
+
+// Releases the ring if nothing is queued, so an idle connection holds none
+// The next outq_push() allocates it again
+void outq_trim(out_queue_t *q);
+
+// Releases every queued frame and the ring itself
+void outq_free(out_queue_t *q);
+
+#endif
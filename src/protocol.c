@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "lz.h"
+
+#define READ_CHUNK 4096   // Minimum free space requested from recv() per read
+
+size_t frame_length(size_t name_len, size_t data_len)
+{
+  return FRAME_HEADER_LENGTH + name_len + data_len;
+}
+
+size_t frame_encode_head(char *buff, int type, int uid, const char *name, size_t name_len, size_t data_len)
+{
+  uint32_t uid_n = htonl((uint32_t)uid);
+  uint32_t data_len_n = htonl((uint32_t)data_len);
+
+  if (name_len > 255)
+    name_len = 255;  // name_len is a single byte on the wire
+
+  buff[0] = PROTOCOL_VERSION;
+  buff[1] = (char)type;
+  buff[2] = 0;
+  buff[3] = (char)name_len;
+  memcpy(buff + 4, &uid_n, sizeof(uid_n));
+  memcpy(buff + 8, &data_len_n, sizeof(data_len_n));
+  if (name_len)
+    memcpy(buff + FRAME_HEADER_LENGTH, name, name_len);
+
+  return frame_length(name_len, 0);
+}
+
+size_t frame_encode(char *buff, int type, int uid, const char *name, size_t name_len,
+                    const char *data, size_t data_len)
+{
+  size_t head = frame_encode_head(buff, type, uid, name, name_len, data_len);
+  if (data_len)
+    memcpy(buff + head, data, data_len);
+
+  return head + data_len;
+}
+
+size_t frame_encode_compressed(char *buff, size_t cap, int type, int uid, const char *name, size_t name_len,
+                               const char *data, size_t data_len)
+{
+  if (name_len > 255)
+    name_len = 255;
+  size_t head = frame_length(name_len, 0) + sizeof(uint32_t);
+  if (cap <= head)
+    return 0;
+
+  size_t packed = lz_compress(data, data_len, buff + head, cap - head);
+  if (packed == 0)
+    return 0;
+
+  uint32_t raw_len_n = htonl((uint32_t)data_len);
+  frame_encode_head(buff, type, uid, name, name_len, sizeof(uint32_t) + packed);
+  frame_set_flags(buff, FRAME_FLAG_COMPRESSED);
+  memcpy(buff + head - sizeof(uint32_t), &raw_len_n, sizeof(raw_len_n));
+
+  return head + packed;
+}
+
+void frame_set_flags(char *buff, int flags)
+{
+  buff[2] = (char)flags;
+}
+
+size_t frame_encode_str(char *buff, int type, int uid, const char *name, const char *data)
+{
+  return frame_encode(buff, type, uid, name, name ? strlen(name) : 0, data, data ? strlen(data) : 0);
+}
+
+// Parses the fixed size header at the start of buff
+static void decode_header(const char *buff, struct frame_header *hdr)
+{
+  uint32_t uid_n, data_len_n;
+
+  hdr->version = (uint8_t)buff[0];
+  hdr->type = (uint8_t)buff[1];
+  hdr->flags = (uint8_t)buff[2];
+  hdr->name_len = (uint8_t)buff[3];
+  memcpy(&uid_n, buff + 4, sizeof(uid_n));
+  memcpy(&data_len_n, buff + 8, sizeof(data_len_n));
+  hdr->uid = ntohl(uid_n);
+  hdr->data_len = ntohl(data_len_n);
+}
+
+// Returns the largest data field the reader accepts for a frame type
+static size_t data_limit(const struct frame_reader *r, uint8_t type)
+{
+  return (type == ATTACHMENT && r->max_attachment) ? r->max_attachment : MAX_FRAME_DATA;
+}
+
+int frame_decode(const char *buff, size_t len, struct frame *f)
+{
+  if (len < FRAME_HEADER_LENGTH)
+    return -1;
+  decode_header(buff, &f->hdr);
+  if (frame_length(f->hdr.name_len, f->hdr.data_len) != len)
+    return -1;
+
+  f->name = buff + FRAME_HEADER_LENGTH;
+  f->data = f->name + f->hdr.name_len;
+  return 0;
+}
+
+// Replaces a compressed frame's data with its decompressed contents
+// Returns -1 if the data is corrupt or would inflate past MAX_FRAME_DATA
+static int inflate_frame(struct frame_reader *r, struct frame *f)
+{
+  uint32_t raw_len_n;
+
+  if (f->hdr.data_len < sizeof(raw_len_n))
+    return -1;
+  memcpy(&raw_len_n, f->data, sizeof(raw_len_n));
+  uint32_t raw_len = ntohl(raw_len_n);
+  if (raw_len > MAX_FRAME_DATA)
+    return -1;
+
+  if (r->inflated == NULL && (r->inflated = malloc(MAX_FRAME_DATA)) == NULL)
+    return -1;
+  long n = lz_decompress(f->data + sizeof(raw_len_n), f->hdr.data_len - sizeof(raw_len_n), r->inflated, raw_len);
+  if (n != (long)raw_len)
+    return -1;
+
+  f->data = r->inflated;
+  f->hdr.data_len = raw_len;
+  f->hdr.flags &= ~FRAME_FLAG_COMPRESSED;
+  return 0;
+}
+
+ssize_t frame_reader_fill(struct frame_reader *r, int fd)
+{
+  // Move the unconsumed bytes to the front of the buffer
+  if (r->start > 0) {
+    memmove(r->buff, r->buff + r->start, r->len - r->start);
+    r->len -= r->start;
+    r->start = 0;
+  }
+
+  // Make room for the rest of a partially received frame, or at least one chunk
+  size_t want = READ_CHUNK;
+  if (r->len >= FRAME_HEADER_LENGTH) {
+    struct frame_header hdr;
+    decode_header(r->buff, &hdr);
+    if (hdr.data_len <= data_limit(r, hdr.type) && frame_length(hdr.name_len, hdr.data_len) > r->len + want)
+      want = frame_length(hdr.name_len, hdr.data_len) - r->len;
+  }
+  if (r->cap - r->len < want) {
+    char *buff = realloc(r->buff, r->len + want);
+    if (buff == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    r->buff = buff;
+    r->cap = r->len + want;
+  }
+
+  ssize_t n = recv(fd, r->buff + r->len, r->cap - r->len, 0);
+  if (n > 0)
+    r->len += n;
+  return n;
+}
+
+int frame_reader_append(struct frame_reader *r, const char *data, size_t len)
+{
+  // Move the unconsumed bytes to the front of the buffer
+  if (r->start > 0) {
+    memmove(r->buff, r->buff + r->start, r->len - r->start);
+    r->len -= r->start;
+    r->start = 0;
+  }
+
+  if (r->cap - r->len < len) {
+    size_t cap = r->cap ? r->cap : READ_CHUNK;
+    while (cap - r->len < len)
+      cap *= 2;
+    char *buff = realloc(r->buff, cap);
+    if (buff == NULL)
+      return -1;
+    r->buff = buff;
+    r->cap = cap;
+  }
+
+  memcpy(r->buff + r->len, data, len);
+  r->len += len;
+  return 0;
+}
+
+int frame_reader_next(struct frame_reader *r, struct frame *f)
+{
+  size_t avail = r->len - r->start;
+  if (avail < FRAME_HEADER_LENGTH)
+    return 0;
+
+  const char *p = r->buff + r->start;
+  decode_header(p, &f->hdr);
+  if (f->hdr.version != PROTOCOL_VERSION || f->hdr.data_len > data_limit(r, f->hdr.type))
+    return -1;
+
+  size_t len = frame_length(f->hdr.name_len, f->hdr.data_len);
+  if (avail < len)
+    return 0;
+
+  f->name = p + FRAME_HEADER_LENGTH;
+  f->data = f->name + f->hdr.name_len;
+  r->start += len;
+
+  if ((f->hdr.flags & FRAME_FLAG_COMPRESSED) && inflate_frame(r, f) < 0)
+    return -1;
+
+  return 1;
+}
+
+size_t frame_reader_pending(const struct frame_reader *r, const char **bytes)
+{
+  *bytes = r->buff ? r->buff + r->start : NULL;
+  return r->len - r->start;
+}
+
+void frame_reader_trim(struct frame_reader *r)
+{
+  if (r->start == r->len)
+    frame_reader_free(r);
+}
+
+void frame_reader_free(struct frame_reader *r)
+{
+  free(r->buff);
+  free(r->inflated);
+  r->buff = NULL;
+  r->inflated = NULL;
+  r->start = r->len = r->cap = 0;
+}
+
+// Copies len bytes from src into a '\0' terminated buffer, truncating if needed
+static char *copy_field(const char *src, size_t len, char *buff, size_t buff_size)
+{
+  if (len >= buff_size)
+    len = buff_size - 1;
+  memcpy(buff, src, len);
+  buff[len] = '\0';
+  return buff;
+}
+
+char *frame_copy_name(const struct frame *f, char *buff, size_t buff_size)
+{
+  return copy_field(f->name, f->hdr.name_len, buff, buff_size);
+}
+
+char *frame_copy_data(const struct frame *f, char *buff, size_t buff_size)
+{
+  return copy_field(f->data, f->hdr.data_len, buff, buff_size);
+}
@@ -1,11 +1,24 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
 //////// PROTOCOL DEFINITION ////////
 
+#define PROTOCOL_VERSION 1
+
 #define SERVER_USERNAME "admin"  // Username added to messages sent explicitly by the server
 
 // Buffer size constants
-#define USERNAME_LENGTH   1024
-#define PASSWORD_LENGTH   1024
+#define USERNAME_LENGTH   256    // Max username is 255 bytes (one length byte on the wire), +1 for '\0'
+#define PASSWORD_LENGTH   256
 #define DATA_LENGTH       1026   // Max message size is 1024, need 2 extra to account for '\n' and '\0'
+#define ROOM_NAME_LENGTH  64     // Max room name is 63 bytes, +1 for '\0'
+
+#define LOBBY_ROOM_NAME   "lobby"  // Room every client is in after logging in
 
 // Commands available for client
 #define HAPPY_COMMAND      1
@@ -15,6 +28,18 @@
 #define HELP_COMMAND       5
 #define SENDMSG_COMMAND    6
 #define QUIT_COMMAND       7
+#define LOGIN_COMMAND      8     // Login request: username in the name field, password in the data field
+#define JOIN_COMMAND       9     // Move to the room named in the data field, creating it if needed
+#define LEAVE_COMMAND      10    // Leave the current room and go back to the lobby
+#define LIST_COMMAND       11    // List the rooms that have members
+#define DM_COMMAND         12    // Private message: target username in the name field (or target id
+                                 // in the uid field if there is no name), message in the data field
+#define ATTACH_COMMAND     13    // Next chunk of an attachment being uploaded, in the data field
+#define ATTACH_END_COMMAND 14    // Attachment upload is complete: file name in the name field,
+                                 // the server sends the file to the sender's room
+#define HISTORY_COMMAND    15    // Stored messages of the sender's room: "<from> <to>" in the data field,
+                                 // in seconds since the Unix epoch (a <to> of 0 means now)
+#define PONG_COMMAND       16    // Answer to a PING, any frame from the client also shows it is alive
 
 // Server response codes
 #define OPEN               0     // Connection to client is still open
@@ -23,37 +48,129 @@
 #define AUTHORIZED         3     // Login attempt successful
 #define ACCEPTED           4     // Client successfully connected to server
 #define REJECTED           5     // Client was rejected from the server (too many users)
+#define ATTACHMENT         6     // File sent to the room: file name, '\0', then the file's contents in data
+#define PING               7     // Heartbeat sent to a client that has been silent, answered with PONG_COMMAND
 
-// Struct for passing login information b/w client and server
-struct login_request {
-  char username[USERNAME_LENGTH];
-  char password[PASSWORD_LENGTH];
-};
+//////// WIRE FORMAT ////////
+//
+// Every message in either direction is a single frame:
+//
+//   +---------+------+-------+----------+-----+----------+----------+------+
+//   | version | type | flags | name_len | uid | data_len | name ... | data |
+//   |   u8    |  u8  |  u8   |    u8    | u32 |   u32    |          |      |
+//   +---------+------+-------+----------+-----+----------+----------+------+
+//
+// Multi-byte fields are in network byte order. The name and data fields are
+// not '\0' terminated on the wire, their lengths come from the header.
+//
+// Compression is negotiated at login: a client that sets FRAME_FLAG_COMPRESSION
+// on its login request gets it back on the AUTHORIZED response if the server
+// agrees. From then on either side may send frames with FRAME_FLAG_COMPRESSED,
+// whose data field is the uncompressed length (u32) followed by the data as
+// an LZ4 block (see lz.h). Frame readers inflate such frames transparently.
+//
+// Client to server frames carry a command code in type (LOGIN_COMMAND for the
+// login request). Server to client frames carry a response code in type, the
+// id and username of the sender in uid and name, and the message text in data.
+
+#define FRAME_HEADER_LENGTH 12
+#define MAX_FRAME_DATA      (64 * 1024)   // Receivers drop connections that announce more
+#define MAX_ATTACHMENT_DATA (64 * 1024 * 1024)   // Limit for ATTACHMENT frames, for readers that accept them
 
-// Struct to return to user after login attempt
-struct login_response {
-  int status;               // Response code
-  int id;                   // Client id
+// Frame flags
+#define FRAME_FLAG_COMPRESSION 0x01   // Login request/response: compression is offered/accepted
+#define FRAME_FLAG_COMPRESSED  0x02   // The data field is compressed
+
+#define COMPRESS_MIN_DATA 256   // Default size below which data is not worth compressing
+
+struct frame_header {
+  uint8_t version;     // PROTOCOL_VERSION
+  uint8_t type;        // Command code (client to server) or response code (server to client)
+  uint8_t flags;       // FRAME_FLAG_* bits
+  uint8_t name_len;    // Length of the name field
+  uint32_t uid;        // Id of the client who sent the message (0 if sent by server)
+  uint32_t data_len;   // Length of the data field
 };
 
-// Per TCP-connection client structure
-typedef struct {
-  struct sockaddr_in addr;     // Client source IP address and port
-  int connection_sock;         // Connection socket file descriptor
-  int id;                      // Client id
-  pthread_t tid;               // Thread id for sending and receiving messages w/ this client
-  char name[USERNAME_LENGTH];  // Client display name
-} client_t;
-
-// Client-server request/response definitions
-struct client_message {
-  int command;                // Command code for the type of message sent
-  char data[DATA_LENGTH];     // Input from client application
+// A decoded frame
+// name and data point into the buffer the frame was decoded from
+struct frame {
+  struct frame_header hdr;
+  const char *name;
+  const char *data;
 };
 
-struct server_message {
-  int status;                       // Response code
-  int uid;                          // Id of the client who sent the message (0 if sent by server)
-  char username[USERNAME_LENGTH];   // Name of the person who sent the message ("admin" if sent by server)
-  char data[DATA_LENGTH];           // Message from server to display in client
+// Reassembles frames from a stream socket
+// A single recv() may return part of a frame or several frames at once
+struct frame_reader {
+  char *buff;     // Received bytes (NULL until the first read)
+  size_t start;   // Offset of the first unconsumed byte
+  size_t len;     // Offset one past the last received byte
+  size_t cap;     // Size of buff
+  char *inflated;  // Data of the last compressed frame, decompressed (NULL until one arrives)
+  size_t max_attachment;   // Largest ATTACHMENT frame data accepted, 0 (the default) to treat
+                           // ATTACHMENT like any other type. Only clients set this, since the
+                           // code is a server response and the same value is a command the other way
 };
+
+// Returns the number of bytes a frame with the given field lengths occupies on the wire
+size_t frame_length(size_t name_len, size_t data_len);
+
+// Encodes a frame into buff, which must hold frame_length(name_len, data_len) bytes
+// Returns the number of bytes written
+size_t frame_encode(char *buff, int type, int uid, const char *name, size_t name_len,
+                    const char *data, size_t data_len);
+
+// Encodes only the header and name of a frame whose data_len bytes of data the caller writes
+// (or sends) separately
+// Returns the number of bytes written
+size_t frame_encode_head(char *buff, int type, int uid, const char *name, size_t name_len, size_t data_len);
+
+// Encodes a frame with its data compressed into buff, which holds cap bytes
+// Returns the number of bytes written, or 0 if the compressed frame would not fit
+// in cap (pass the uncompressed frame's length to only keep frames that shrink)
+size_t frame_encode_compressed(char *buff, size_t cap, int type, int uid, const char *name, size_t name_len,
+                               const char *data, size_t data_len);
+
+// Sets the flags of an encoded frame
+void frame_set_flags(char *buff, int flags);
+
+// Decodes a buffer that holds exactly one frame
+// Returns -1 if it does not
+int frame_decode(const char *buff, size_t len, struct frame *f);
+
+// Encodes a frame whose name and data are '\0' terminated strings (either may be NULL)
+size_t frame_encode_str(char *buff, int type, int uid, const char *name, const char *data);
+
+// Reads whatever is available on fd into the reader
+// Returns the result of recv(): bytes read, 0 on orderly shutdown or -1 on error
+ssize_t frame_reader_fill(struct frame_reader *r, int fd);
+
+// Appends bytes that were received some other way (e.g. by io_uring) to the reader
+// Returns -1 if memory could not be allocated, 0 otherwise
+int frame_reader_append(struct frame_reader *r, const char *data, size_t len);
+
+// Takes the next complete frame out of the reader
+// Compressed frames come out decompressed, with FRAME_FLAG_COMPRESSED cleared
+// Returns 1 if a frame was produced, 0 if more bytes are needed and -1 if the
+// stream is malformed (bad version, oversized frame or corrupt compressed data)
+// The frame points into the reader and is valid until the next frame_reader_fill(),
+// frame_reader_append() or frame_reader_next()
+int frame_reader_next(struct frame_reader *r, struct frame *f);
+
+// Returns how many received bytes are waiting to be taken out as frames, pointing bytes at them
+size_t frame_reader_pending(const struct frame_reader *r, const char **bytes);
+
+// Releases the reader's buffers if no received bytes are waiting, so an idle connection holds none
+// The next read allocates them again
+void frame_reader_trim(struct frame_reader *r);
+
+// Releases the reader's buffer
+void frame_reader_free(struct frame_reader *r);
+
+// Copies a frame's name or data into a '\0' terminated buffer of size buff_size
+// Returns buff
+char *frame_copy_name(const struct frame *f, char *buff, size_t buff_size);
+char *frame_copy_data(const struct frame *f, char *buff, size_t buff_size);
+
+#endif
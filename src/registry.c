@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include "registry.h"
+
+#define INITIAL_CAP 16
+
+// Spreads sequential ids over the table (Fibonacci hashing)
+static unsigned hash_id(int id, unsigned mask)
+{
+  return ((unsigned)id * 2654435769u) & mask;
+}
+
+// Inserts into the index, which must have a free bucket
+static void index_insert(reg_entry_t **index, unsigned cap, reg_entry_t *e)
+{
+  unsigned mask = cap - 1;
+  unsigned i = hash_id(e->id, mask);
+
+  while (index[i] != NULL)
+    i = (i + 1) & mask;
+  index[i] = e;
+}
+
+// Rebuilds the index with a new size
+static int index_resize(registry_t *r, unsigned cap)
+{
+  reg_entry_t **index = calloc(cap, sizeof(reg_entry_t *));
+  if (index == NULL)
+    return -1;
+
+  for (unsigned i = 0; i < r->count; i++)
+    index_insert(index, cap, r->members[i]);
+
+  free(r->index);
+  r->index = index;
+  r->index_cap = cap;
+  return 0;
+}
+
+int registry_add(registry_t *r, reg_entry_t *e)
+{
+  if (r->count == r->cap) {
+    unsigned cap = r->cap ? r->cap * 2 : INITIAL_CAP;
+    reg_entry_t **members = realloc(r->members, cap * sizeof(reg_entry_t *));
+    if (members == NULL)
+      return -1;
+    r->members = members;
+    r->cap = cap;
+  }
+
+  // Keep the index at most half full so probe sequences stay short
+  if ((r->count + 1) * 2 > r->index_cap) {
+    if (index_resize(r, r->index_cap ? r->index_cap * 2 : INITIAL_CAP * 2) < 0)
+      return -1;
+  }
+
+  e->slot = r->count;
+  r->members[r->count++] = e;
+  index_insert(r->index, r->index_cap, e);
+
+  return 0;
+}
+
+void registry_remove(registry_t *r, reg_entry_t *e)
+{
+  unsigned mask = r->index_cap - 1;
+  unsigned i = hash_id(e->id, mask);
+
+  // Find the entry's bucket
+  while (r->index[i] != e)
+    i = (i + 1) & mask;
+
+  // Backward shift deletion: pull later entries of the probe run into the hole
+  // so lookups never need tombstones
+  unsigned hole = i;
+  for (unsigned j = (i + 1) & mask; r->index[j] != NULL; j = (j + 1) & mask) {
+    unsigned home = hash_id(r->index[j]->id, mask);
+    // Move the entry if its home bucket is not between the hole and its current bucket
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      r->index[hole] = r->index[j];
+      hole = j;
+    }
+  }
+  r->index[hole] = NULL;
+
+  // Move the last member into the freed slot
+  reg_entry_t *last = r->members[--r->count];
+  r->members[e->slot] = last;
+  last->slot = e->slot;
+}
+
+reg_entry_t *registry_find(const registry_t *r, int id)
+{
+  if (r->count == 0)
+    return NULL;
+
+  unsigned mask = r->index_cap - 1;
+  for (unsigned i = hash_id(id, mask); r->index[i] != NULL; i = (i + 1) & mask) {
+    if (r->index[i]->id == id)
+      return r->index[i];
+  }
+
+  return NULL;
+}
+
+void registry_free(registry_t *r)
+{
+  free(r->members);
+  free(r->index);
+  r->members = r->index = NULL;
+  r->count = r->cap = r->index_cap = 0;
+}
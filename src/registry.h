@@ -0,0 +1,40 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+// Set of live connections, indexed by client id
+//
+// Members live in a dense array so broadcasts walk contiguous memory, and an
+// open addressing hash maps ids to array slots. Insert, lookup and removal are
+// all O(1): removal moves the last member into the freed slot.
+//
+// The registry is owned by a single event loop thread and takes no locks.
+// Because removal reorders the array, members must not be removed while the
+// array is being walked. The server defers every disconnect until the end of
+// the current batch of events (see reap_clients()), so broadcasts always see
+// a stable snapshot of the membership.
+typedef struct {
+  int id;           // Key, must be non zero
+  unsigned slot;    // Index in the registry's members array
+} reg_entry_t;
+
+typedef struct {
+  reg_entry_t **members;   // Dense array of members, in no particular order
+  unsigned count;          // Number of members
+  unsigned cap;            // Size of members
+  reg_entry_t **index;     // Hash of members by id, linear probing
+  unsigned index_cap;      // Size of index, a power of two
+} registry_t;
+
+// Adds an entry, returns -1 if memory could not be allocated
+int registry_add(registry_t *r, reg_entry_t *e);
+
+// Removes an entry that is in the registry
+void registry_remove(registry_t *r, reg_entry_t *e);
+
+// Returns the entry with the given id, or NULL
+reg_entry_t *registry_find(const registry_t *r, int id);
+
+// Releases the registry's memory (not the entries)
+void registry_free(registry_t *r);
+
+#endif
@@ -0,0 +1,672 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "inbox.h"
+#include "outqueue.h"
+#include "registry.h"
+#include "rooms.h"
+#include "users.h"
+#include "intern.h"
+#include "logger.h"
+#include "relay.h"
+
+#define RELAY_QUEUE_LIMIT (16 * 1024 * 1024)   // Bytes queued for a peer before the link is dropped as stuck
+#define RETRY_MIN_MS      100                  // First wait before redialing a peer
+#define RETRY_MAX_MS      5000                 // Longest wait between two dials
+#define RELAY_MAX_INNER   (MAX_FRAME_DATA - ROOM_NAME_LENGTH)   // Largest frame that still fits in a relay frame
+
+// Link states
+#define LINK_CLOSED     0   // No connection (a dialed link waits for retry_ms)
+#define LINK_CONNECTING 1   // Non-blocking connect() in progress
+#define LINK_HELLO      2   // Connected, waiting for the peer's HELLO
+#define LINK_UP         3   // Relaying
+
+// A link to one peer
+// Only the relay thread touches links, apart from the stats counters
+typedef struct {
+  int fd;
+  int state;
+  int dialed;                  // Set for links to a --peer address, which are redialed when they drop
+  struct sockaddr_in addr;     // Address dialed
+  long long retry_ms;          // When a closed dialed link is dialed again
+  int backoff_ms;
+  int node;                    // Peer's node id once known, -1 before
+  struct frame_reader reader;
+  out_queue_t outq;
+} link_t;
+
+// A client logged in on this node, remembered to tell peers that link up later
+typedef struct {
+  reg_entry_t entry;
+  const char *name;   // Interned username
+} local_user_t;
+
+static link_t links[RELAY_MAX_LINKS];
+static int dialed_count;
+static int node_id;
+static int first_peer;              // Shard number of the peer in links[0]
+static const char *secret;
+static relay_handlers_t handlers;
+
+static pthread_t relay_tid;
+static int running = 0;
+static atomic_int stopping;
+static int wake_fd = -1;
+static int listen_fd = -1;
+static inbox_t outbox;              // Frames posted by the shards for the relay thread
+static frame_buf_t *members_marker; // Posted by relay_members(), the relay thread fills in the count
+static registry_t local_users;      // Relay thread only
+static outq_stats_t relay_writes;
+static atomic_ulong frames_in;
+static atomic_uint links_up;
+
+// Returns a monotonic timestamp in milliseconds
+static long long now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Wakes the relay thread
+static void wake_relay()
+{
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0)
+    return;  // counter saturated, the thread is awake anyway
+}
+
+// Posts a frame for the relay thread
+// The room is held until the frame is relayed, frames for no room in particular pass the lobby
+static void post(frame_buf_t *fb, int room, int slot)
+{
+  room_hold(room);
+  int rc = inbox_push(&outbox, fb, room, slot);
+  if (rc < 0) {
+    room_release(room);
+  } else if (rc > 0) {
+    wake_relay();
+  }
+}
+
+// Encodes a relay frame carrying another frame in its data field
+static frame_buf_t *wrap_frame(int type, int uid, const char *name, const frame_buf_t *inner)
+{
+  size_t name_len = name ? strlen(name) : 0;
+  frame_buf_t *fb = frame_buf_alloc(frame_length(name_len, inner->len));
+  if (fb)
+    frame_encode(fb->data, type, uid, name, name_len, inner->data, inner->len);
+  return fb;
+}
+
+/* shard side */
+
+void relay_broadcast(frame_buf_t *fb, int room)
+{
+  if (!running || fb->file_len > 0 || fb->len > RELAY_MAX_INNER)
+    return;
+
+  // Nothing to do unless some peer has members in the room
+  int wanted = 0;
+  for (int i = 0; i < RELAY_MAX_LINKS && !wanted; i++)
+    wanted = room_shard_members(room, first_peer + i) > 0;
+  if (!wanted)
+    return;
+
+  frame_buf_t *relayed = wrap_frame(RELAY_ROOM, node_id, room_name(room), fb);
+  if (relayed) {
+    post(relayed, room, 0);
+    frame_buf_release(relayed);
+  }
+}
+
+void relay_direct(frame_buf_t *fb, int id, int shard)
+{
+  if (!running || fb->file_len > 0 || fb->len > RELAY_MAX_INNER)
+    return;
+
+  frame_buf_t *relayed = wrap_frame(RELAY_DIRECT, id, NULL, fb);
+  if (relayed) {
+    post(relayed, 0, shard - first_peer);
+    frame_buf_release(relayed);
+  }
+}
+
+void relay_presence(int id, const char *name, int online)
+{
+  if (!running)
+    return;
+
+  frame_buf_t *fb = frame_buf_create(RELAY_USER, id, name, online ? "1" : "0");
+  if (fb) {
+    post(fb, 0, 0);
+    frame_buf_release(fb);
+  }
+}
+
+void relay_members(int room)
+{
+  if (running)
+    post(members_marker, room, 0);
+}
+
+/* links */
+
+// Returns the number of members a room has on this node
+static int local_members(int room)
+{
+  int n = 0;
+  for (int i = 0; i < first_peer; i++)
+    n += room_shard_members(room, i);
+  return n;
+}
+
+// Queues a frame on a link
+// A peer that stops reading is dropped rather than queued for without limit
+static void link_send(link_t *link, frame_buf_t *fb);
+
+// Queues a newly encoded frame on a link
+static void link_send_new(link_t *link, frame_buf_t *fb)
+{
+  if (fb == NULL)
+    return;
+  link_send(link, fb);
+  frame_buf_release(fb);
+}
+
+// Closes a link and forgets everything its peer told us
+// A dialed link is dialed again later, a link the peer dialed frees its slot
+static void link_close(link_t *link, const char *reason)
+{
+  char log_buff[256];
+  int shard = first_peer + (int)(link - links);
+
+  if (link->state == LINK_UP) {
+    users_remove_shard(shard);
+    for (int room = 0; room < rooms_created(); room++)
+      room_set_count(room, shard, 0);
+    atomic_fetch_sub(&links_up, 1);
+    snprintf(log_buff, sizeof(log_buff), "Lost the link to node %d (%s)\n", link->node, reason);
+    logger_text(log_buff);
+  }
+
+  if (link->fd >= 0)
+    close(link->fd);
+  link->fd = -1;
+  link->state = LINK_CLOSED;
+  frame_reader_free(&link->reader);
+  outq_free(&link->outq);
+  memset(&link->outq, 0, sizeof(link->outq));
+
+  if (link->dialed) {
+    link->retry_ms = now_ms() + link->backoff_ms;
+    link->backoff_ms = link->backoff_ms * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : link->backoff_ms * 2;
+  }
+}
+
+static void link_send(link_t *link, frame_buf_t *fb)
+{
+  if (link->state == LINK_CLOSED)
+    return;
+  if (link->outq.bytes + fb->len > RELAY_QUEUE_LIMIT || outq_push(&link->outq, fb) < 0)
+    link_close(link, "peer is not keeping up");
+}
+
+// Writes what the socket takes of a link's queue
+static void link_flush(link_t *link)
+{
+  if (link->state >= LINK_HELLO && !outq_empty(&link->outq) && outq_write(&link->outq, link->fd, &relay_writes) < 0)
+    link_close(link, strerror(errno));
+}
+
+// Sets up a connected socket as a link and sends our HELLO
+static void link_open(link_t *link, int fd)
+{
+  int one = 1;
+
+  link->fd = fd;
+  link->state = LINK_HELLO;
+  memset(&link->reader, 0, sizeof(link->reader));
+  memset(&link->outq, 0, sizeof(link->outq));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  link_send_new(link, frame_buf_create(RELAY_HELLO, node_id, NULL, secret));
+}
+
+// Returns the link other than skip that is up with a node, or NULL
+static link_t *link_to_node(int node, const link_t *skip)
+{
+  for (int i = 0; i < RELAY_MAX_LINKS; i++) {
+    if (&links[i] != skip && links[i].state == LINK_UP && links[i].node == node)
+      return &links[i];
+  }
+  return NULL;
+}
+
+// Starts dialing a peer
+static void link_dial(link_t *link)
+{
+  // Don't dial a node that already linked up by dialing us
+  if (link->node >= 0 && link_to_node(link->node, link)) {
+    link->retry_ms = now_ms() + RETRY_MAX_MS;
+    return;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    link->retry_ms = now_ms() + RETRY_MAX_MS;
+    return;
+  }
+  if (connect(fd, (struct sockaddr *)&link->addr, sizeof(link->addr)) < 0 && errno != EINPROGRESS) {
+    close(fd);
+    link->retry_ms = now_ms() + link->backoff_ms;
+    link->backoff_ms = link->backoff_ms * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : link->backoff_ms * 2;
+    return;
+  }
+  link->fd = fd;
+  link->state = LINK_CONNECTING;
+}
+
+// Finishes a non-blocking connect once the socket is writable
+static void link_connected(link_t *link)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+    close(link->fd);
+    link->fd = -1;
+    link->state = LINK_CLOSED;
+    link->retry_ms = now_ms() + link->backoff_ms;
+    link->backoff_ms = link->backoff_ms * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : link->backoff_ms * 2;
+    return;
+  }
+  link_open(link, link->fd);
+}
+
+// Sends a peer that just linked up everything it has to know about this node
+static void send_snapshot(link_t *link)
+{
+  for (unsigned i = 0; i < local_users.count; i++) {
+    local_user_t *u = (local_user_t *)local_users.members[i];
+    link_send_new(link, frame_buf_create(RELAY_USER, u->entry.id, u->name, "1"));
+  }
+  for (int room = 0; room < rooms_created(); room++) {
+    if (!room_try_hold(room))
+      continue;  // free id
+    int n = local_members(room);
+    if (n > 0)
+      link_send_new(link, frame_buf_create(RELAY_MEMBERS, n, room_name(room), NULL));
+    room_release(room);
+  }
+}
+
+// Handles a peer's HELLO
+// Of two links between the same nodes, the one dialed by the lower node id is kept
+static void hello_received(link_t *link, struct frame *f)
+{
+  char hello_secret[PASSWORD_LENGTH], log_buff[256];
+  int node = (int)f->hdr.uid;
+
+  frame_copy_data(f, hello_secret, sizeof(hello_secret));
+  if (f->hdr.type != RELAY_HELLO || strcmp(hello_secret, secret) != 0) {
+    link_close(link, "bad HELLO");
+    return;
+  }
+  if (node == node_id) {
+    link->dialed = 0;  // dialed ourselves, never again
+    link_close(link, "node linked to itself");
+    return;
+  }
+
+  link->node = node;
+  link_t *other = link_to_node(node, link);
+  if (other) {
+    int dialer = link->dialed ? node_id : node;
+    int keep = node_id < node ? node_id : node;
+    if (dialer != keep) {
+      link_close(link, "duplicate link");
+      return;
+    }
+    link_close(other, "duplicate link");
+  }
+
+  link->state = LINK_UP;
+  link->backoff_ms = RETRY_MIN_MS;
+  atomic_fetch_add(&links_up, 1);
+  snprintf(log_buff, sizeof(log_buff), "Linked to node %d\n", node);
+  logger_text(log_buff);
+  send_snapshot(link);
+}
+
+// Copies the frame carried in a relay frame's data field into a frame buffer
+// Returns NULL if it is not exactly one frame or memory could not be allocated
+static frame_buf_t *unwrap_frame(const struct frame *f)
+{
+  struct frame inner;
+  if (frame_decode(f->data, f->hdr.data_len, &inner) < 0)
+    return NULL;
+
+  frame_buf_t *fb = frame_buf_alloc(f->hdr.data_len);
+  if (fb)
+    memcpy(fb->data, f->data, f->hdr.data_len);
+  return fb;
+}
+
+// Handles one frame from a peer that is up
+static void frame_received(link_t *link, struct frame *f)
+{
+  char name[USERNAME_LENGTH];
+  int shard = first_peer + (int)(link - links);
+  frame_buf_t *fb;
+
+  atomic_fetch_add_explicit(&frames_in, 1, memory_order_relaxed);
+  frame_copy_name(f, name, sizeof(name));
+
+  if (f->hdr.type == RELAY_ROOM) {
+    int room = room_lookup(name, 1, NULL);
+    if (room >= 0 && (fb = unwrap_frame(f)) != NULL) {
+      handlers.room_frame(fb, room);
+      frame_buf_release(fb);
+    }
+    if (room >= 0)
+      room_release(room);
+  } else if (f->hdr.type == RELAY_DIRECT) {
+    if ((fb = unwrap_frame(f)) != NULL) {
+      handlers.user_frame(fb, (int)f->hdr.uid);
+      frame_buf_release(fb);
+    }
+  } else if (f->hdr.type == RELAY_USER) {
+    int id = (int)f->hdr.uid;
+    if (f->hdr.data_len > 0 && f->data[0] == '1') {
+      const char *interned = users_find_id(id) < 0 ? intern_get(name) : NULL;
+      if (interned) {
+        users_add(interned, id, shard);
+        intern_put(interned);
+      }
+    } else if (users_find_id(id) == shard) {
+      users_remove(id);
+    }
+  } else if (f->hdr.type == RELAY_MEMBERS) {
+    int room = room_lookup(name, f->hdr.uid > 0, NULL);  // a room that is gone here need not be made to count 0
+    if (room >= 0) {
+      room_set_count(room, shard, (int)f->hdr.uid);
+      room_release(room);
+    }
+  }
+}
+
+// Reads and handles everything a peer sent
+static void link_readable(link_t *link)
+{
+  struct frame f;
+  int rc;
+
+  ssize_t n = frame_reader_fill(&link->reader, link->fd);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    link_close(link, n == 0 ? "closed by peer" : strerror(errno));
+    return;
+  }
+
+  while (link->state >= LINK_HELLO && (rc = frame_reader_next(&link->reader, &f)) > 0) {
+    if (link->state == LINK_HELLO) {
+      hello_received(link, &f);
+    } else {
+      frame_received(link, &f);
+    }
+  }
+  if (link->state >= LINK_HELLO && rc < 0)
+    link_close(link, "malformed frame");
+}
+
+// Accepts the links peers dial, each into a free slot
+static void accept_links()
+{
+  for (;;) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+      return;
+
+    link_t *link = NULL;
+    for (int i = dialed_count; i < RELAY_MAX_LINKS && link == NULL; i++) {
+      if (links[i].state == LINK_CLOSED)
+        link = &links[i];
+    }
+    if (link == NULL) {
+      logger_text("Too many peers, refused a link\n");
+      close(fd);
+      continue;
+    }
+    link->node = -1;
+    link_open(link, fd);
+  }
+}
+
+// Relays what the shards posted
+// A room's member count is read when it is sent, so the last count sent is always current
+static void drain_outbox()
+{
+  static unsigned members_sent[MAX_ROOMS];   // Generation of the room whose count was sent, 0 for none
+  uint64_t posted;
+
+  if (read(wake_fd, &posted, sizeof(posted)) < 0 && errno != EAGAIN)
+    return;
+  memset(members_sent, 0, sizeof(members_sent));
+
+  inbox_node_t *node = inbox_take(&outbox);
+  while (node) {
+    frame_buf_t *fb = node->fb;
+    int type = (uint8_t)fb->data[1];
+
+    if (type == RELAY_ROOM) {
+      for (int i = 0; i < RELAY_MAX_LINKS; i++) {
+        if (links[i].state == LINK_UP && room_shard_members(node->room, first_peer + i) > 0)
+          link_send(&links[i], fb);
+      }
+    } else if (type == RELAY_DIRECT) {
+      if (links[node->uid].state == LINK_UP)
+        link_send(&links[node->uid], fb);
+    } else if (type == RELAY_USER) {
+      struct frame f;
+      char name[USERNAME_LENGTH];
+      frame_decode(fb->data, fb->len, &f);
+      local_user_t *u = (local_user_t *)registry_find(&local_users, (int)f.hdr.uid);
+      if (f.data[0] == '1' && u == NULL && (u = calloc(1, sizeof(local_user_t))) != NULL) {
+        u->entry.id = (int)f.hdr.uid;
+        u->name = intern_get(frame_copy_name(&f, name, sizeof(name)));
+        if (u->name == NULL || registry_add(&local_users, &u->entry) < 0) {
+          if (u->name)
+            intern_put(u->name);
+          free(u);
+        }
+      } else if (f.data[0] == '0' && u) {
+        registry_remove(&local_users, &u->entry);
+        intern_put(u->name);
+        free(u);
+      }
+      for (int i = 0; i < RELAY_MAX_LINKS; i++) {
+        if (links[i].state == LINK_UP)
+          link_send(&links[i], fb);
+      }
+    } else if (type == RELAY_MEMBERS && members_sent[node->room] != room_generation(node->room)) {
+      members_sent[node->room] = room_generation(node->room);
+      frame_buf_t *count = frame_buf_create(RELAY_MEMBERS, local_members(node->room), room_name(node->room), NULL);
+      for (int i = 0; i < RELAY_MAX_LINKS && count; i++) {
+        if (links[i].state == LINK_UP)
+          link_send(&links[i], count);
+      }
+      if (count)
+        frame_buf_release(count);
+    }
+    room_release(node->room);
+    node = inbox_node_free(node);
+  }
+}
+
+// Relay thread: runs every link, dialing peers again when their links drop
+static void *relay_thread()
+{
+  struct pollfd pfds[RELAY_MAX_LINKS + 2];
+  int polled[RELAY_MAX_LINKS + 2];
+
+  while (!atomic_load(&stopping)) {
+    long long now = now_ms(), next = now + 1000;
+    int n = 0;
+
+    pfds[n].fd = wake_fd;
+    pfds[n++].events = POLLIN;
+    if (listen_fd >= 0) {
+      pfds[n].fd = listen_fd;
+      pfds[n++].events = POLLIN;
+    }
+    for (int i = 0; i < RELAY_MAX_LINKS; i++) {
+      link_t *link = &links[i];
+      if (link->dialed && link->state == LINK_CLOSED && link->retry_ms <= now)
+        link_dial(link);
+      if (link->dialed && link->state == LINK_CLOSED && link->retry_ms < next)
+        next = link->retry_ms;
+      if (link->state == LINK_CLOSED)
+        continue;
+      polled[n] = i;
+      pfds[n].fd = link->fd;
+      pfds[n++].events = POLLIN | (link->state == LINK_CONNECTING || !outq_empty(&link->outq) ? POLLOUT : 0);
+    }
+
+    if (poll(pfds, n, (int)(next > now ? next - now : 0)) <= 0)
+      continue;
+
+    int first_link = listen_fd >= 0 ? 2 : 1;
+    for (int j = first_link; j < n; j++) {
+      link_t *link = &links[polled[j]];
+      if (pfds[j].revents == 0 || link->fd != pfds[j].fd)
+        continue;
+      if (link->state == LINK_CONNECTING) {
+        link_connected(link);
+      } else if (pfds[j].revents & (POLLIN | POLLHUP | POLLERR)) {
+        link_readable(link);
+      }
+    }
+    if (pfds[0].revents & POLLIN)
+      drain_outbox();
+    if (listen_fd >= 0 && (pfds[1].revents & POLLIN))
+      accept_links();
+
+    for (int i = 0; i < RELAY_MAX_LINKS; i++)
+      link_flush(&links[i]);
+  }
+
+  frame_pool_drain();
+  return NULL;
+}
+
+int relay_add_peer(const char *addr)
+{
+  char host[256];
+  const char *colon = strrchr(addr, ':');
+  struct addrinfo hints, *res;
+
+  if (colon == NULL || colon == addr || (size_t)(colon - addr) >= sizeof(host) || dialed_count == RELAY_MAX_LINKS)
+    return -1;
+  memcpy(host, addr, colon - addr);
+  host[colon - addr] = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+    return -1;
+
+  link_t *link = &links[dialed_count++];
+  memcpy(&link->addr, res->ai_addr, sizeof(link->addr));
+  link->dialed = 1;
+  freeaddrinfo(res);
+  return 0;
+}
+
+int relay_start(int node, const char *bind_ip, int port, int num_shards, const char *shared_secret,
+                const relay_handlers_t *h)
+{
+  node_id = node;
+  first_peer = num_shards;
+  secret = shared_secret;
+  handlers = *h;
+
+  for (int i = 0; i < RELAY_MAX_LINKS; i++) {
+    links[i].fd = -1;
+    links[i].node = -1;
+    links[i].backoff_ms = RETRY_MIN_MS;
+  }
+  if ((members_marker = frame_buf_create(RELAY_MEMBERS, 0, NULL, NULL)) == NULL)
+    return -1;
+  if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    return -1;
+
+  if (port > 0) {
+    struct sockaddr_in addr;
+    int one = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, bind_ip, &addr.sin_addr) != 1 ||
+        (listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, RELAY_MAX_LINKS) < 0)
+      return -1;
+  }
+
+  if (pthread_create(&relay_tid, NULL, &relay_thread, NULL) != 0)
+    return -1;
+
+  running = 1;
+  return 0;
+}
+
+void relay_stats(unsigned *up, unsigned long *out, unsigned long *in)
+{
+  *up = atomic_load(&links_up);
+  *out = counter_get(&relay_writes.frames);
+  *in = atomic_load_explicit(&frames_in, memory_order_relaxed);
+}
+
+void relay_stop()
+{
+  if (!running)
+    return;
+
+  atomic_store(&stopping, 1);
+  wake_relay();
+  pthread_join(relay_tid, NULL);
+  running = 0;
+
+  for (int i = 0; i < RELAY_MAX_LINKS; i++) {
+    links[i].dialed = 0;
+    if (links[i].state != LINK_CLOSED)
+      link_close(&links[i], "server shutting down");
+  }
+  inbox_node_t *node = inbox_take(&outbox);
+  while (node)
+    node = inbox_node_free(node);
+  for (unsigned i = 0; i < local_users.count; i++) {
+    local_user_t *u = (local_user_t *)local_users.members[i];
+    intern_put(u->name);
+    free(u);
+  }
+  registry_free(&local_users);
+  frame_buf_release(members_marker);
+  if (listen_fd >= 0)
+    close(listen_fd);
+  close(wake_fd);
+}
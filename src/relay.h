@@ -0,0 +1,76 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "framebuf.h"
+
+//////// CLUSTER RELAY ////////
+//
+// Links several server processes into one chat room. Every node keeps one
+// TCP link to every other node, all run by a single relay thread with
+// poll(). When two nodes dial each other, both keep the link dialed by the
+// lower node id and the other is closed. Links carry frames in the client
+// frame format, with the RELAY_* types below.
+//
+// A broadcast leaves its node once per peer that has members in the room, no
+// matter how many members that is, and the peer fans it out to its own
+// clients like any other broadcast. Relayed frames are never forwarded
+// again, so every node must link to every other one (a full mesh).
+//
+// Nodes also tell each other who is logged in and how many members each of
+// their rooms has. Peers show up in the users index and the rooms directory
+// as extra shards, numbered after the local ones, so a direct message finds
+// a user on another node the same way it finds one on another shard, and
+// room member counts cover the whole cluster. A node that loses a link
+// forgets that peer's users and members until the link is back and the peer
+// has sent them again.
+
+#define RELAY_MAX_LINKS 16        // Most peers one node links to
+#define RELAY_ID_SPACE  1000000   // Client ids of node n run from n * RELAY_ID_SPACE + 1, wrapping within that range
+
+// Frame types only sent between nodes
+#define RELAY_HELLO   64   // First frame on a link: node id in the uid field, cluster secret in the data field
+#define RELAY_ROOM    65   // Broadcast: room name in the name field, the encoded client frame in the data field
+#define RELAY_DIRECT  66   // Frame for one client: its id in the uid field, the encoded client frame in the data field
+#define RELAY_USER    67   // Presence: client id in the uid field, username in the name field,
+                           // data "1" when the client logged in and "0" when it left
+#define RELAY_MEMBERS 68   // Room membership: room name in the name field, members on the sending node in the uid field
+
+// Delivery of frames relayed by other nodes
+// Called on the relay thread, which is not an event loop
+typedef struct {
+  void (*room_frame)(frame_buf_t *fb, int room);   // Send a broadcast to the local members of a room
+  void (*user_frame)(frame_buf_t *fb, int id);     // Send a frame to a local client
+} relay_handlers_t;
+
+// Adds a peer to dial, given as "host:port"
+// Returns -1 if the address cannot be resolved or there are too many peers
+int relay_add_peer(const char *addr);
+
+// Starts the relay thread, listening for peers on bind_ip:port (port 0 to only dial)
+// num_shards is the number of local shards, peers are counted as the shards after them
+// Peers must send the same secret in their HELLO, it is never the client passcode
+// Returns -1 if the port could not be bound or the thread could not start
+int relay_start(int node_id, const char *bind_ip, int port, int num_shards, const char *secret,
+                const relay_handlers_t *handlers);
+
+// Relays a frame broadcast to a room to every peer with members in it
+// Attachments stay on the node they were sent to
+void relay_broadcast(frame_buf_t *fb, int room);
+
+// Relays a frame to a client on another node, whose shard in the users index is shard
+void relay_direct(frame_buf_t *fb, int id, int shard);
+
+// Tells every peer a local client logged in (online set) or left
+void relay_presence(int id, const char *name, int online);
+
+// Tells every peer that the number of local members of a room changed
+void relay_members(int room);
+
+// Reports the links that are up and the frames sent to and received from peers
+void relay_stats(unsigned *links_up, unsigned long *frames_out, unsigned long *frames_in);
+
+// Closes every link and stops the relay thread
+// Must only be called once no other thread is relaying
+void relay_stop();
+
+#endif
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "rooms.h"
+#include "metrics.h"
+
+static room_info_t *directory[MAX_ROOMS];
+static atomic_int room_total;   // Entries ever allocated in directory, free ones included
+static atomic_int rooms_live;   // Rooms in use
+static int buckets[ROOM_BUCKETS];    // First room of each hash bucket, -1 if empty
+static int free_rooms = -1;          // First reclaimed id, chained through hash_next
+static int shard_total;
+static pthread_mutex_t directory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the hash bucket of a room name (FNV-1a)
+static unsigned name_bucket(const char *name)
+{
+  uint32_t hash = 2166136261u;
+  for (; *name; name++) {
+    hash ^= (unsigned char)*name;
+    hash *= 16777619u;
+  }
+  return hash & (ROOM_BUCKETS - 1);
+}
+
+// Allocates a directory entry
+static room_info_t *new_room()
+{
+  room_info_t *info = calloc(1, sizeof(room_info_t));
+  if (info == NULL)
+    return NULL;
+
+  info->shard_members = calloc(shard_total, sizeof(atomic_int));
+  if (info->shard_members == NULL) {
+    free(info);
+    return NULL;
+  }
+
+  return info;
+}
+
+// Gives a free directory entry a name and adds it to the hash index, holding it once
+// Must be called with the directory lock held
+static void name_room(int room, const char *name)
+{
+  room_info_t *info = directory[room];
+  unsigned b = name_bucket(name);
+
+  snprintf(info->name, sizeof(info->name), "%s", name);
+  info->generation++;
+  info->hash_next = buckets[b];
+  buckets[b] = room;
+  atomic_store(&info->refs, 1);  // publishes the name to threads that hold the room
+  atomic_fetch_add(&rooms_live, 1);
+}
+
+// Reclaims a room nothing refers to any more, unless it was looked up again in the meantime
+static void reclaim_room(int room)
+{
+  room_info_t *info = directory[room];
+
+  pthread_mutex_lock(&directory_lock);
+  long long locked = metrics_now_ns();
+  if (room != LOBBY_ROOM && info->name[0] != '\0' && atomic_load(&info->refs) == 0) {
+    int *link = &buckets[name_bucket(info->name)];
+    while (*link != room)
+      link = &directory[*link]->hash_next;
+    *link = info->hash_next;
+
+    info->name[0] = '\0';
+    info->hash_next = free_rooms;
+    free_rooms = room;
+    atomic_fetch_sub(&rooms_live, 1);
+  }
+  metrics_lock_held(locked);
+  pthread_mutex_unlock(&directory_lock);
+}
+
+// Adds delta to a room's references, reclaiming it when they drop to zero
+static void adjust_refs(int room, int delta)
+{
+  if (delta != 0 && atomic_fetch_add(&directory[room]->refs, delta) + delta == 0)
+    reclaim_room(room);
+}
+
+int rooms_init(int num_shards)
+{
+  shard_total = num_shards;
+  for (int i = 0; i < ROOM_BUCKETS; i++)
+    buckets[i] = -1;
+  if ((directory[LOBBY_ROOM] = new_room()) == NULL)
+    return -1;
+
+  name_room(LOBBY_ROOM, LOBBY_ROOM_NAME);  // never released
+  atomic_store(&room_total, 1);
+  return 0;
+}
+
+int room_lookup(const char *name, int can_create, int *created)
+{
+  int room;
+
+  if (created)
+    *created = 0;
+
+  pthread_mutex_lock(&directory_lock);
+  long long locked = metrics_now_ns();
+  for (room = buckets[name_bucket(name)]; room >= 0; room = directory[room]->hash_next) {
+    if (strcmp(directory[room]->name, name) == 0)
+      break;
+  }
+  if (room >= 0) {
+    atomic_fetch_add(&directory[room]->refs, 1);  // a pending reclaim sees this and backs off
+  } else if (can_create) {
+    int total = atomic_load(&room_total);
+    if (free_rooms >= 0) {
+      room = free_rooms;
+      free_rooms = directory[room]->hash_next;
+    } else if (total < MAX_ROOMS && (directory[total] = new_room()) != NULL) {
+      room = total;
+      atomic_store(&room_total, total + 1);  // publishes the entry to lock-free readers
+    }
+    if (room >= 0) {
+      name_room(room, name);
+      if (created)
+        *created = 1;
+    }
+  }
+  metrics_lock_held(locked);
+  pthread_mutex_unlock(&directory_lock);
+
+  return room;
+}
+
+void room_hold(int room)
+{
+  atomic_fetch_add(&directory[room]->refs, 1);
+}
+
+int room_try_hold(int room)
+{
+  int refs = atomic_load(&directory[room]->refs);
+  while (refs > 0) {
+    if (atomic_compare_exchange_weak(&directory[room]->refs, &refs, refs + 1))
+      return 1;
+  }
+  return 0;
+}
+
+void room_release(int room)
+{
+  adjust_refs(room, -1);
+}
+
+const char *room_name(int room)
+{
+  return directory[room]->name;
+}
+
+unsigned room_generation(int room)
+{
+  return directory[room]->generation;
+}
+
+void room_count(int room, int shard, int delta)
+{
+  atomic_fetch_add(&directory[room]->members, delta);
+  atomic_fetch_add(&directory[room]->shard_members[shard], delta);
+  adjust_refs(room, delta);
+}
+
+void room_set_count(int room, int shard, int n)
+{
+  int old = atomic_exchange(&directory[room]->shard_members[shard], n);
+  atomic_fetch_add(&directory[room]->members, n - old);
+  adjust_refs(room, n - old);
+}
+
+int room_shard_members(int room, int shard)
+{
+  return atomic_load_explicit(&directory[room]->shard_members[shard], memory_order_relaxed);
+}
+
+void room_list(char *buff, size_t size)
+{
+  size_t len = 0;
+  int total = atomic_load(&room_total);
+
+  // Names only change under the lock, and rooms listed may be reclaimed meanwhile
+  pthread_mutex_lock(&directory_lock);
+  long long locked = metrics_now_ns();
+  buff[0] = '\0';
+  for (int i = 0; i < total && len < size; i++) {
+    int members = atomic_load(&directory[i]->members);
+    if (members == 0 && i != LOBBY_ROOM)
+      continue;
+    int n = snprintf(buff + len, size - len, "%s%s (%d)", len ? ", " : "", directory[i]->name, members);
+    if (n < 0)
+      break;
+    len += n;
+  }
+  metrics_lock_held(locked);
+  pthread_mutex_unlock(&directory_lock);
+}
+
+int room_name_valid(const char *name)
+{
+  size_t len = strlen(name);
+  if (len == 0 || len >= ROOM_NAME_LENGTH)
+    return 0;
+
+  for (size_t i = 0; i < len; i++) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_')
+      return 0;
+  }
+  return 1;
+}
+
+int rooms_created()
+{
+  return atomic_load(&room_total);
+}
+
+int rooms_in_use()
+{
+  return atomic_load(&rooms_live);
+}
+
+void rooms_free()
+{
+  int total = atomic_load(&room_total);
+  for (int i = 0; i < total; i++) {
+    free(directory[i]->shard_members);
+    free(directory[i]);
+    directory[i] = NULL;
+  }
+  atomic_store(&room_total, 0);
+}
@@ -0,0 +1,86 @@
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "protocol.h"
+
+#define LOBBY_ROOM 0      // Id of the lobby, which always exists
+#define MAX_ROOMS  1024   // Rooms that exist at once, ids of reclaimed rooms are reused
+#define ROOM_BUCKETS (2 * MAX_ROOMS)   // Hash buckets of the name index, a power of two
+
+// Server wide directory of rooms, shared by every shard
+//
+// Room ids are small integers, so shards can keep their local membership in
+// arrays indexed by id. A hash index over the names makes looking a room up
+// O(1); lookups and creating a room take the directory lock. Each entry counts
+// its members per shard, which lets the relay skip peers that have none.
+//
+// A room lives as long as something refers to its id: its members across the
+// cluster, the broadcasts to it still waiting in an inbox, the frames of it
+// still in some shard's history, and callers between room_lookup() and
+// room_release(). Once nothing does, the room is reclaimed and its id reused,
+// so rooms a client made up and left do not fill the directory. Only a thread
+// that holds one of these references may take another with room_hold() or
+// resolve the id to a name; the lobby is never reclaimed.
+typedef struct {
+  char name[ROOM_NAME_LENGTH];
+  atomic_int members;          // Members across all shards
+  atomic_int *shard_members;   // Members on each shard
+  atomic_int refs;             // Members, holds and history entries that refer to the room
+  int hash_next;               // Next room in the same hash bucket, or the next free id (-1 for none)
+  unsigned generation;         // Times the id was given to a room, tells a reused id from its last room
+} room_info_t;
+
+// Creates the directory and the lobby
+// Returns -1 if memory could not be allocated
+int rooms_init(int num_shards);
+
+// Returns the id of the room with the given name, creating it if needed and can_create is set
+// (*created then tells whether it was), and holds it until room_release()
+// Returns -1 if the room does not exist and cannot be created: can_create is not set,
+// the directory is full or memory could not be allocated
+int room_lookup(const char *name, int can_create, int *created);
+
+// Takes another reference to a room, the caller must already hold one
+void room_hold(int room);
+
+// Takes a reference to a room if it is in use, for threads that walk every room id
+// Returns 0 if it is not (the id is free)
+int room_try_hold(int room);
+
+// Drops a reference to a room, reclaiming it if that was the last one
+void room_release(int room);
+
+// Returns the name of a room
+const char *room_name(int room);
+
+// Returns the generation of a room, which differs from that of any earlier room with the same id
+unsigned room_generation(int room);
+
+// Adjusts a room's member count for one shard, each member holds the room
+void room_count(int room, int shard, int delta);
+
+// Sets a room's member count for one shard
+void room_set_count(int room, int shard, int n);
+
+// Returns the number of members of a room on one shard
+int room_shard_members(int room, int shard);
+
+// Writes a '\0' terminated, comma separated list of the rooms that have
+// members (and the lobby) with their member counts into buff
+void room_list(char *buff, size_t size);
+
+// Returns non zero if name can be used as a room name
+int room_name_valid(const char *name);
+
+// Returns one past the highest room id handed out so far, the bound for walking every room
+int rooms_created();
+
+// Returns the number of rooms that exist, the lobby included
+int rooms_in_use();
+
+// Releases the directory
+void rooms_free();
+
+#endif
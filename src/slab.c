@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include "slab.h"
+
+// Chunks start with a link to the next chunk, padded so the objects after it stay aligned
+#define CHUNK_HEADER alignof(max_align_t)
+
+void slab_init(slab_t *s, size_t obj_size, unsigned per_chunk)
+{
+  size_t align = alignof(max_align_t);
+
+  if (obj_size < sizeof(void *))
+    obj_size = sizeof(void *);
+  s->obj_size = (obj_size + align - 1) & ~(align - 1);
+  s->per_chunk = per_chunk ? per_chunk : 1;
+  s->free_list = NULL;
+  s->chunks = NULL;
+  atomic_init(&s->in_use, 0);
+  atomic_init(&s->capacity, 0);
+}
+
+// Allocates a chunk and puts all of its objects on the free list
+static int add_chunk(slab_t *s)
+{
+  char *chunk = malloc(CHUNK_HEADER + s->obj_size * s->per_chunk);
+  if (chunk == NULL)
+    return -1;
+
+  *(void **)chunk = s->chunks;
+  s->chunks = chunk;
+
+  // Link the objects in address order, so a fresh chunk is handed out front to back
+  for (unsigned i = s->per_chunk; i > 0; i--) {
+    void *obj = chunk + CHUNK_HEADER + (i - 1) * s->obj_size;
+    *(void **)obj = s->free_list;
+    s->free_list = obj;
+  }
+  counter_add(&s->capacity, s->per_chunk);
+
+  return 0;
+}
+
+void *slab_alloc(slab_t *s)
+{
+  if (s->free_list == NULL && add_chunk(s) < 0)
+    return NULL;
+
+  void *obj = s->free_list;
+  s->free_list = *(void **)obj;
+  memset(obj, 0, s->obj_size);
+  counter_add(&s->in_use, 1);
+
+  return obj;
+}
+
+void slab_free(slab_t *s, void *obj)
+{
+  *(void **)obj = s->free_list;
+  s->free_list = obj;
+  counter_add(&s->in_use, (unsigned long)-1);
+}
+
+void slab_destroy(slab_t *s)
+{
+  while (s->chunks) {
+    void *next = *(void **)s->chunks;
+    free(s->chunks);
+    s->chunks = next;
+  }
+  s->free_list = NULL;
+  atomic_store(&s->in_use, 0);
+  atomic_store(&s->capacity, 0);
+}
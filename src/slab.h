@@ -0,0 +1,35 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include "metrics.h"
+
+// Allocator for objects of one fixed size, owned by a single thread
+//
+// Objects are carved out of chunks of per_chunk objects, and freed objects go
+// on a free list threaded through their first word, so allocating and freeing
+// are a few pointer moves with no call into malloc() once the slab has warmed
+// up. Chunks are only returned to the system by slab_destroy(). The occupancy
+// counters are written by the owning thread and may be read by any.
+typedef struct {
+  size_t obj_size;      // Bytes per object, rounded up to keep objects aligned
+  unsigned per_chunk;   // Objects carved out of each chunk
+  void *free_list;      // Free objects, linked through their first word
+  void *chunks;         // Chunks allocated so far, linked through their first word
+  counter_t in_use;     // Objects handed out and not yet freed
+  counter_t capacity;   // Objects carved out of every chunk so far
+} slab_t;
+
+// Sets up an empty slab for objects of obj_size bytes
+void slab_init(slab_t *s, size_t obj_size, unsigned per_chunk);
+
+// Returns a zeroed object, or NULL if a new chunk could not be allocated
+void *slab_alloc(slab_t *s);
+
+// Puts an object back on the free list
+void slab_free(slab_t *s, void *obj);
+
+// Releases every chunk, objects still in use included
+void slab_destroy(slab_t *s);
+
+#endif
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "spsc.h"
+
+// Wakes the writer thread
+static void wake_writer(spsc_writer_t *w)
+{
+  uint64_t one = 1;
+  if (write(w->wake_fd, &one, sizeof(one)) < 0)
+    return;  // counter saturated, the writer is awake anyway
+}
+
+/* producer side */
+
+// Returns the calling thread's ring, creating it on first use
+static spsc_ring_t *get_ring(spsc_writer_t *w, spsc_ring_t **slot)
+{
+  if (*slot)
+    return *slot;
+
+  spsc_ring_t *ring = calloc(1, sizeof(spsc_ring_t));
+  if (ring == NULL)
+    return NULL;
+  ring->buff = malloc(w->ring_size);
+  if (ring->buff == NULL) {
+    free(ring);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  ring->next = w->rings;
+  w->rings = ring;
+  pthread_mutex_unlock(&w->lock);
+
+  *slot = ring;
+  return ring;
+}
+
+// Copies n bytes into the ring at byte counter pos, wrapping around the end
+static void copy_in(const spsc_writer_t *w, spsc_ring_t *ring, size_t pos, const void *src, size_t n)
+{
+  size_t off = pos & (w->ring_size - 1);
+  size_t first = w->ring_size - off < n ? w->ring_size - off : n;
+
+  if (n == 0)
+    return;  // empty parts, such as the name of a text record
+  memcpy(ring->buff + off, src, first);
+  memcpy(ring->buff, (const char *)src + first, n - first);
+}
+
+void spsc_copy_out(const spsc_writer_t *w, const spsc_ring_t *ring, size_t pos, void *dst, size_t n)
+{
+  size_t off = pos & (w->ring_size - 1);
+  size_t first = w->ring_size - off < n ? w->ring_size - off : n;
+
+  memcpy(dst, ring->buff + off, first);
+  memcpy((char *)dst + first, ring->buff, n - first);
+}
+
+int spsc_append(spsc_writer_t *w, spsc_ring_t **slot, const struct iovec *parts, int nparts)
+{
+  spsc_ring_t *ring = get_ring(w, slot);
+  if (ring == NULL)
+    return -1;
+
+  size_t need = 0;
+  for (int i = 0; i < nparts; i++)
+    need += parts[i].iov_len;
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t used = head - atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (w->ring_size - used < need) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return -1;
+  }
+
+  size_t pos = head;
+  for (int i = 0; i < nparts; i++) {
+    copy_in(w, ring, pos, parts[i].iov_base, parts[i].iov_len);
+    pos += parts[i].iov_len;
+  }
+  atomic_store_explicit(&ring->head, head + need, memory_order_release);
+
+  // Don't wait for the flush interval once the ring is half full
+  if (used < w->ring_size / 2 && used + need >= w->ring_size / 2)
+    wake_writer(w);
+  return 0;
+}
+
+/* writer side */
+
+// Returns the time of the next record in a ring, or UINT64_MAX if the batch has none left
+static uint64_t peek_time(spsc_writer_t *w, spsc_ring_t *ring, char *hdr)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail == ring->batch_head)
+    return UINT64_MAX;
+
+  spsc_copy_out(w, ring, tail, hdr, w->header_len);
+  return w->record_time(hdr);
+}
+
+// Hands the next record of a ring to take() and frees its space in the ring
+static void take_record(spsc_writer_t *w, spsc_ring_t *ring, char *hdr)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  spsc_copy_out(w, ring, tail, hdr, w->header_len);
+  size_t len = w->record_len(hdr);
+  if (w->take(w, ring, tail, len) < 0)
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+}
+
+// Writes out everything appended so far, merging the rings by time
+static void write_batch(spsc_writer_t *w, char *hdr)
+{
+  pthread_mutex_lock(&w->lock);
+  spsc_ring_t *all = w->rings;
+  pthread_mutex_unlock(&w->lock);
+
+  // Records appended after this point wait for the next batch
+  for (spsc_ring_t *ring = all; ring; ring = ring->next)
+    ring->batch_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  for (;;) {
+    spsc_ring_t *oldest = NULL;
+    uint64_t oldest_time = UINT64_MAX;
+    for (spsc_ring_t *ring = all; ring; ring = ring->next) {
+      uint64_t t = peek_time(w, ring, hdr);
+      if (t < oldest_time) {
+        oldest = ring;
+        oldest_time = t;
+      }
+    }
+    if (oldest == NULL)
+      break;
+    take_record(w, oldest, hdr);
+  }
+
+  unsigned long dropped = 0;
+  for (spsc_ring_t *ring = all; ring; ring = ring->next)
+    dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+  w->batch_done(w, dropped);
+}
+
+// Background writer thread
+// Wakes every flush interval, or sooner when a ring is filling up
+static void *writer_thread(void *arg)
+{
+  spsc_writer_t *w = arg;
+  char hdr[SPSC_MAX_HEADER];
+  struct pollfd pfd;
+  pfd.fd = w->wake_fd;
+  pfd.events = POLLIN;
+
+  while (!atomic_load(&w->stopping)) {
+    if (poll(&pfd, 1, w->flush_ms) > 0) {
+      uint64_t wakeups;
+      if (read(w->wake_fd, &wakeups, sizeof(wakeups)) < 0)
+        continue;
+    }
+    write_batch(w, hdr);
+  }
+
+  // Producers have stopped, write whatever they left behind
+  write_batch(w, hdr);
+  return NULL;
+}
+
+int spsc_start(spsc_writer_t *w)
+{
+  pthread_mutex_init(&w->lock, NULL);
+  w->rings = NULL;
+  atomic_store(&w->stopping, 0);
+  if ((w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    return -1;
+
+  // The writer never handles signals, they belong to the event loops
+  sigset_t all, old_mask;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old_mask);
+  int rc = pthread_create(&w->thread, NULL, &writer_thread, w);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  if (rc != 0) {
+    close(w->wake_fd);
+    return -1;
+  }
+
+  w->running = 1;
+  return 0;
+}
+
+void spsc_stop(spsc_writer_t *w, spsc_ring_t **slot)
+{
+  if (!w->running)
+    return;
+
+  atomic_store(&w->stopping, 1);
+  wake_writer(w);
+  pthread_join(w->thread, NULL);
+  w->running = 0;
+  close(w->wake_fd);
+
+  while (w->rings) {
+    spsc_ring_t *next = w->rings->next;
+    free(w->rings->buff);
+    free(w->rings);
+    w->rings = next;
+  }
+  *slot = NULL;
+  pthread_mutex_destroy(&w->lock);
+}
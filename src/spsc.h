@@ -0,0 +1,71 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+// Per-thread record rings drained by one background writer, shared by the log and the message store
+//
+// Every thread that appends gets its own ring of ring_size bytes the first time it does. It is the
+// only producer and the writer the only consumer, so head and tail are free running byte counters
+// published with release/acquire ordering and appending never takes a lock or blocks: a record that
+// does not fit is dropped and counted. The writer wakes every flush_ms, or sooner once a ring is half
+// full, and hands the records of every ring to take() oldest first, merging the rings by the time
+// in each record's header. Records appended while a batch is written wait for the next batch.
+//
+// Every record starts with a header of header_len bytes from which record_len() and record_time()
+// read its total length and its time.
+
+#define SPSC_MAX_HEADER 64   // Largest header_len
+
+typedef struct spsc_ring {
+  char *buff;               // ring_size bytes of records
+  atomic_size_t head;       // Bytes ever appended, advanced by the producer
+  atomic_size_t tail;       // Bytes ever consumed, advanced by the writer
+  atomic_ulong dropped;     // Records dropped because the ring was full or take() failed
+  size_t batch_head;        // Writer only: head seen at the start of the current batch
+  struct spsc_ring *next;   // Next ring in the writer's list
+} spsc_ring_t;
+
+typedef struct spsc_writer {
+  // Set by the owner before spsc_start()
+  size_t ring_size;         // Power of two
+  size_t header_len;        // At most SPSC_MAX_HEADER
+  int flush_ms;
+  size_t (*record_len)(const char *hdr);
+  uint64_t (*record_time)(const char *hdr);
+  // Consumes the record of len bytes at byte counter pos of a ring, see spsc_copy_out()
+  // Returns -1 to count it as dropped
+  int (*take)(struct spsc_writer *w, const spsc_ring_t *ring, size_t pos, size_t len);
+  // Called at the end of every batch with the records dropped since the last one
+  void (*batch_done)(struct spsc_writer *w, unsigned long dropped);
+
+  // Owned by spsc.c
+  pthread_mutex_t lock;     // Only taken when a thread appends for the first time and once per batch
+  spsc_ring_t *rings;       // Every thread's ring, newest first
+  pthread_t thread;
+  atomic_int stopping;
+  int wake_fd;
+  int running;
+} spsc_writer_t;
+
+// Starts the writer thread, with every signal blocked
+// Returns -1 on failure
+int spsc_start(spsc_writer_t *w);
+
+// Writes out what is left, stops the writer thread and frees the rings
+// *slot, the calling thread's ring, is cleared; other threads must not append any more
+void spsc_stop(spsc_writer_t *w, spsc_ring_t **slot);
+
+// Appends a record made of nparts parts to the calling thread's ring, *slot, which is a
+// _Thread_local of the owner created on first use
+// Never blocks. Returns -1 if the record was dropped
+int spsc_append(spsc_writer_t *w, spsc_ring_t **slot, const struct iovec *parts, int nparts);
+
+// Copies n bytes out of a ring at byte counter pos, wrapping around the end
+void spsc_copy_out(const spsc_writer_t *w, const spsc_ring_t *ring, size_t pos, void *dst, size_t n);
+
+#endif
@@ -0,0 +1,855 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "logger.h"
+#include "store.h"
+#include "spsc.h"
+
+#define RING_SIZE    (1 << 20)   // Bytes of records one thread can have waiting, power of two
+#define FLUSH_MS     50          // Longest a message waits in a ring before it is stored
+#define MAX_RECORD   (STORE_RECORD_HEADER_LENGTH + 255 + 255 + MAX_FRAME_DATA)
+#define TIME_PREFIX  22          // "[YYYY-MM-DD HH:MM:SS] " in front of every queried message
+#define QUERY_QUEUE  64          // Queries waiting for the query thread, more are turned away
+
+// Sparse index entry: the first record at or after an offset of a segment
+typedef struct {
+  uint64_t time_ms;
+  uint64_t seq;
+  uint64_t offset;
+} store_index_t;
+
+// One segment file, mapped whole for as long as the store is open
+// The writer is the only thread that changes a segment, and it publishes end
+// and index_count with release ordering once the bytes they cover are written
+typedef struct {
+  uint64_t first_seq;
+  int fd;
+  char *map;
+  size_t map_size;
+  atomic_size_t end;            // Offset one past the last complete record
+  store_index_t *index;         // Sparse index, malloc'd or (for segments full before a restart) mapped
+  atomic_uint index_count;
+  unsigned index_cap;
+  size_t index_map_size;        // Size of the mapping if the index is mapped, 0 otherwise
+} segment_t;
+
+// Ring of the calling thread, created on its first message
+static _Thread_local spsc_ring_t *thread_ring;
+
+// Segments, oldest first
+// Queries hold the lock for reading while they scan, the writer only takes it to add a segment
+static pthread_rwlock_t segments_lock = PTHREAD_RWLOCK_INITIALIZER;
+static segment_t **segments;
+static unsigned segment_count;
+static unsigned segment_cap;
+
+// A query waiting for the query thread
+typedef struct store_job {
+  char room[256];
+  uint64_t from_ms;
+  uint64_t to_ms;
+  unsigned max_msgs;
+  store_reply_t reply;
+  int uid;
+  int shard;
+  struct store_job *next;
+} store_job_t;
+
+// Query thread state, jobs are served oldest first
+static pthread_t query_thread;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static store_job_t *jobs_head;
+static store_job_t *jobs_tail;
+static unsigned jobs_waiting;
+static int jobs_stopping;
+
+// Writer state
+static spsc_writer_t writer;
+static int running = 0;
+static char *store_dir;
+static size_t segment_size;
+static uint64_t next_seq = 1;
+static uint64_t last_time;
+static size_t next_index_at;    // Offset in the active segment at which the next index entry is due
+static atomic_ulong stored;
+static atomic_ulong dropped_total;
+
+// Returns the current time in milliseconds since the Unix epoch
+static uint64_t now_realtime_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void put_u32(char *p, uint32_t v)
+{
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get_u32(const char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static void put_u64(char *p, uint64_t v)
+{
+  put_u32(p, (uint32_t)(v >> 32));
+  put_u32(p + 4, (uint32_t)v);
+}
+
+static uint64_t get_u64(const char *p)
+{
+  return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+// FNV-1a hash of a record, everything after the checksum field
+static uint32_t record_checksum(const char *rec, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 8; i < len; i++) {
+    h ^= (uint8_t)rec[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Decodes a record header without checking the checksum
+// Returns the record's length, 0 if the bytes cannot be a complete record
+static size_t decode_record(const char *buff, size_t len, struct store_record *r)
+{
+  if (len < STORE_RECORD_HEADER_LENGTH)
+    return 0;
+
+  size_t rec_len = get_u32(buff);
+  r->seq = get_u64(buff + 8);
+  r->time_ms = get_u64(buff + 16);
+  r->uid = get_u32(buff + 24);
+  r->room_len = (uint8_t)buff[28];
+  r->name_len = (uint8_t)buff[29];
+  if (rec_len > len || rec_len < (size_t)STORE_RECORD_HEADER_LENGTH + r->room_len + r->name_len)
+    return 0;
+
+  r->text_len = (uint32_t)(rec_len - STORE_RECORD_HEADER_LENGTH - r->room_len - r->name_len);
+  r->room = buff + STORE_RECORD_HEADER_LENGTH;
+  r->name = r->room + r->room_len;
+  r->text = r->name + r->name_len;
+  return rec_len;
+}
+
+size_t store_record_decode(const char *buff, size_t len, struct store_record *r)
+{
+  size_t rec_len = decode_record(buff, len, r);
+  if (rec_len == 0 || record_checksum(buff, rec_len) != get_u32(buff + 4))
+    return 0;
+  return rec_len;
+}
+
+/* segments */
+
+// Writes the path of a segment's file with the given extension into buff
+static void segment_path(char *buff, size_t size, uint64_t first_seq, const char *ext)
+{
+  snprintf(buff, size, "%s/%020llu.%s", store_dir, (unsigned long long)first_seq, ext);
+}
+
+// Adds an index entry for the record at offset
+static void index_add(segment_t *seg, uint64_t time_ms, uint64_t seq, size_t offset)
+{
+  unsigned n = atomic_load_explicit(&seg->index_count, memory_order_relaxed);
+  if (n == seg->index_cap)
+    return;
+  seg->index[n].time_ms = time_ms;
+  seg->index[n].seq = seq;
+  seg->index[n].offset = offset;
+  atomic_store_explicit(&seg->index_count, n + 1, memory_order_release);
+}
+
+// Allocates an empty index large enough for a full segment
+static int index_alloc(segment_t *seg)
+{
+  seg->index_cap = segment_size / STORE_INDEX_INTERVAL + 2;
+  seg->index = malloc(seg->index_cap * sizeof(store_index_t));
+  return seg->index ? 0 : -1;
+}
+
+// Adds a segment to the end of the list
+static int segment_publish(segment_t *seg)
+{
+  pthread_rwlock_wrlock(&segments_lock);
+  if (segment_count == segment_cap) {
+    unsigned cap = segment_cap ? segment_cap * 2 : 16;
+    segment_t **grown = realloc(segments, cap * sizeof(segment_t *));
+    if (grown == NULL) {
+      pthread_rwlock_unlock(&segments_lock);
+      return -1;
+    }
+    segments = grown;
+    segment_cap = cap;
+  }
+  segments[segment_count++] = seg;
+  pthread_rwlock_unlock(&segments_lock);
+  return 0;
+}
+
+// Unmaps and closes a segment
+static void segment_free(segment_t *seg)
+{
+  if (seg->index_map_size) {
+    munmap(seg->index, seg->index_map_size);
+  } else {
+    free(seg->index);
+  }
+  if (seg->map)
+    munmap(seg->map, seg->map_size);
+  close(seg->fd);
+  free(seg);
+}
+
+// Walks a segment's records from the start, rebuilding its index
+// Stops at the first record that is torn, corrupt or out of sequence
+// Returns the offset one past the last good record
+static size_t segment_scan(segment_t *seg, size_t size)
+{
+  size_t off = STORE_SEGMENT_HEADER, index_at = off;
+  uint64_t seq = seg->first_seq;
+  struct store_record r;
+
+  for (;;) {
+    size_t len = store_record_decode(seg->map + off, size - off, &r);
+    if (len == 0 || r.seq != seq || r.time_ms < last_time)
+      break;
+    if (off >= index_at) {
+      index_add(seg, r.time_ms, r.seq, off);
+      index_at = off + STORE_INDEX_INTERVAL;
+    }
+    last_time = r.time_ms;
+    seq++;
+    off += len;
+  }
+
+  next_seq = seq;
+  next_index_at = index_at;
+  return off;
+}
+
+// Maps the saved index of a full segment
+// Returns -1 if it is missing or does not match the segment
+static int index_load(segment_t *seg, size_t end)
+{
+  char path[4096];
+  struct stat st;
+
+  segment_path(path, sizeof(path), seg->first_seq, "idx");
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size % sizeof(store_index_t) != 0) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  store_index_t *index = map;
+  unsigned n = st.st_size / sizeof(store_index_t);
+  if (index[0].seq != seg->first_seq || index[n - 1].offset >= end) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  seg->index = index;
+  seg->index_map_size = st.st_size;
+  seg->index_cap = n;
+  atomic_store(&seg->index_count, n);
+  return 0;
+}
+
+// Saves the index of a full segment next to it
+// Written to a temporary file and renamed, so a crash never leaves half an index
+static void index_save(segment_t *seg)
+{
+  char path[4096], tmp[4096];
+  unsigned n = atomic_load(&seg->index_count);
+
+  segment_path(path, sizeof(path), seg->first_seq, "idx");
+  segment_path(tmp, sizeof(tmp), seg->first_seq, "idx.tmp");
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  ssize_t len = (ssize_t)(n * sizeof(store_index_t));
+  if (write(fd, seg->index, len) != len || fsync(fd) < 0 || rename(tmp, path) < 0)
+    unlink(tmp);
+  close(fd);
+}
+
+// Opens a segment found in the store directory
+// The last segment is the active one: it is scanned for its end and mapped writable at full size
+// Returns NULL if it could not be opened or is not a segment
+static segment_t *segment_load(uint64_t first_seq, int active)
+{
+  char path[4096];
+  struct stat st;
+
+  segment_t *seg = calloc(1, sizeof(segment_t));
+  if (seg == NULL)
+    return NULL;
+  seg->first_seq = first_seq;
+  segment_path(path, sizeof(path), first_seq, "seg");
+  if ((seg->fd = open(path, O_RDWR | O_CLOEXEC)) < 0 || fstat(seg->fd, &st) < 0 ||
+      (size_t)st.st_size < STORE_SEGMENT_HEADER) {
+    if (seg->fd >= 0)
+      close(seg->fd);
+    free(seg);
+    return NULL;
+  }
+
+  seg->map_size = active && (size_t)st.st_size < segment_size ? segment_size : (size_t)st.st_size;
+  if (active && (errno = posix_fallocate(seg->fd, 0, seg->map_size)) != 0) {
+    close(seg->fd);
+    free(seg);
+    return NULL;
+  }
+  seg->map = mmap(NULL, seg->map_size, active ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, seg->fd, 0);
+  if (seg->map == MAP_FAILED) {
+    seg->map = NULL;
+    segment_free(seg);
+    return NULL;
+  }
+  if (memcmp(seg->map, STORE_SEGMENT_MAGIC, 8) != 0 || get_u64(seg->map + 8) != first_seq) {
+    segment_free(seg);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // A full segment was cut to its last record, so its index is all that is needed
+  if (!active && index_load(seg, st.st_size) == 0) {
+    struct store_record r;
+    const store_index_t *last = &seg->index[seg->index_cap - 1];
+    size_t off = last->offset, len;
+    uint64_t seq = last->seq;
+    while ((len = decode_record(seg->map + off, st.st_size - off, &r)) > 0) {
+      seq = r.seq + 1;
+      last_time = r.time_ms;
+      off += len;
+    }
+    next_seq = seq;
+    atomic_store(&seg->end, off);
+    return seg;
+  }
+
+  if (index_alloc(seg) < 0) {
+    segment_free(seg);
+    return NULL;
+  }
+  atomic_store(&seg->end, segment_scan(seg, seg->map_size));
+  if (!active)
+    index_save(seg);
+  return seg;
+}
+
+// Creates the next segment, starting at the next sequence number
+// Returns NULL if the file could not be created or its space reserved
+static segment_t *segment_create()
+{
+  char path[4096];
+
+  segment_t *seg = calloc(1, sizeof(segment_t));
+  if (seg == NULL)
+    return NULL;
+  seg->first_seq = next_seq;
+  seg->map_size = segment_size;
+  segment_path(path, sizeof(path), seg->first_seq, "seg");
+  if ((seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    free(seg);
+    return NULL;
+  }
+
+  // Reserve the blocks up front, so running out of disk fails here and not on a write through the mapping
+  if ((errno = posix_fallocate(seg->fd, 0, segment_size)) != 0 || index_alloc(seg) < 0) {
+    close(seg->fd);
+    unlink(path);
+    free(seg);
+    return NULL;
+  }
+  seg->map = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+  if (seg->map == MAP_FAILED) {
+    seg->map = NULL;
+    unlink(path);
+    segment_free(seg);
+    return NULL;
+  }
+
+  memcpy(seg->map, STORE_SEGMENT_MAGIC, 8);
+  put_u64(seg->map + 8, seg->first_seq);
+  atomic_store(&seg->end, STORE_SEGMENT_HEADER);
+  next_index_at = STORE_SEGMENT_HEADER;
+  return seg;
+}
+
+// Flushes a segment's records to disk and gives back the space reserved past them
+static void segment_seal(segment_t *seg)
+{
+  size_t end = atomic_load(&seg->end);
+  msync(seg->map, end, MS_SYNC);
+  if (ftruncate(seg->fd, end) < 0)
+    return;  // the segment just keeps its preallocated tail
+}
+
+// Returns the segment records are appended to
+static segment_t *active_segment()
+{
+  return segment_count ? segments[segment_count - 1] : NULL;
+}
+
+// Seals the active segment and starts a new one
+// Returns -1 if the new segment could not be created, the active one then stays full
+static int roll_segment()
+{
+  char path[4096];
+  segment_t *seg = segment_create();
+
+  if (seg == NULL || segment_publish(seg) < 0) {
+    if (seg) {
+      segment_path(path, sizeof(path), seg->first_seq, "seg");
+      unlink(path);
+      segment_free(seg);
+    }
+    return -1;
+  }
+
+  // Readers may still be scanning the old segment, it stays mapped until store_close()
+  segment_t *old = segment_count > 1 ? segments[segment_count - 2] : NULL;
+  if (old) {
+    segment_seal(old);
+    index_save(old);
+  }
+  return 0;
+}
+
+/* producer side */
+
+void store_append(const char *room, uint32_t uid, const char *name, size_t name_len,
+                  const char *text, size_t text_len)
+{
+  if (!running)
+    return;
+
+  size_t room_len = strlen(room);
+  if (room_len > 255)
+    room_len = 255;
+  if (name_len > 255)
+    name_len = 255;
+  if (text_len > MAX_FRAME_DATA)
+    text_len = MAX_FRAME_DATA;
+
+  // The writer fills in the sequence number and the checksum
+  size_t need = STORE_RECORD_HEADER_LENGTH + room_len + name_len + text_len;
+  char hdr[STORE_RECORD_HEADER_LENGTH];
+  memset(hdr, 0, sizeof(hdr));
+  put_u32(hdr, (uint32_t)need);
+  put_u64(hdr + 16, now_realtime_ms());
+  put_u32(hdr + 24, uid);
+  hdr[28] = (char)room_len;
+  hdr[29] = (char)name_len;
+  struct iovec parts[4] = { { hdr, sizeof(hdr) }, { (void *)room, room_len }, { (void *)name, name_len },
+                            { (void *)text, text_len } };
+  spsc_append(&writer, &thread_ring, parts, 4);
+}
+
+/* writer side */
+
+// Returns the length of the record whose header is hdr
+static size_t record_len(const char *hdr)
+{
+  return get_u32(hdr);
+}
+
+// Returns the time of the record whose header is hdr
+static uint64_t record_time(const char *hdr)
+{
+  return get_u64(hdr + 16);
+}
+
+// Moves the next record of a ring into the active segment
+// Times are clamped to never go backwards, which keeps every segment sorted by time
+// Returns -1 if there is no segment to put it in
+static int take_record(spsc_writer_t *w, const spsc_ring_t *ring, size_t pos, size_t len)
+{
+  segment_t *seg = active_segment();
+  if (seg == NULL)
+    return -1;
+  size_t end = atomic_load_explicit(&seg->end, memory_order_relaxed);
+  if (end + len > seg->map_size) {
+    if (roll_segment() < 0)
+      return -1;
+    seg = active_segment();
+    end = STORE_SEGMENT_HEADER;
+  }
+
+  char *rec = seg->map + end;
+  spsc_copy_out(w, ring, pos, rec, len);
+
+  uint64_t time_ms = get_u64(rec + 16);
+  if (time_ms < last_time)
+    time_ms = last_time;
+  last_time = time_ms;
+  put_u64(rec + 8, next_seq);
+  put_u64(rec + 16, time_ms);
+  put_u32(rec + 4, record_checksum(rec, len));
+
+  // The record is published before it is indexed, so an index entry never points past end
+  atomic_store_explicit(&seg->end, end + len, memory_order_release);
+  if (end >= next_index_at) {
+    index_add(seg, time_ms, next_seq, end);
+    next_index_at = end + STORE_INDEX_INTERVAL;
+  }
+  next_seq++;
+  atomic_fetch_add_explicit(&stored, 1, memory_order_relaxed);
+  return 0;
+}
+
+// Reports the messages that could not be stored
+static void batch_done(spsc_writer_t *w, unsigned long dropped)
+{
+  char buff[128];
+  (void)w;
+
+  if (dropped > 0) {
+    atomic_fetch_add_explicit(&dropped_total, dropped, memory_order_relaxed);
+    sprintf(buff, "*** %lu messages were not stored, the message store fell behind or is full\n", dropped);
+    logger_text(buff);
+  }
+}
+
+// Orders sequence numbers for qsort()
+static int compare_seq(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Opens every segment already in the store directory, oldest first
+// Returns -1 if one of them could not be opened
+static int recover_segments()
+{
+  DIR *dir = opendir(store_dir);
+  if (dir == NULL)
+    return -1;
+
+  uint64_t *found = NULL;
+  size_t count = 0, cap = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    char *dot;
+    uint64_t seq = strtoull(ent->d_name, &dot, 10);
+    if (dot - ent->d_name != 20 || strcmp(dot, ".seg") != 0)
+      continue;
+    if (count == cap) {
+      cap = cap ? cap * 2 : 16;
+      uint64_t *grown = realloc(found, cap * sizeof(uint64_t));
+      if (grown == NULL) {
+        free(found);
+        closedir(dir);
+        return -1;
+      }
+      found = grown;
+    }
+    found[count++] = seq;
+  }
+  closedir(dir);
+
+  if (count > 1)
+    qsort(found, count, sizeof(uint64_t), compare_seq);
+  for (size_t i = 0; i < count; i++) {
+    segment_t *seg = segment_load(found[i], i == count - 1);
+    if (seg == NULL || segment_publish(seg) < 0) {
+      if (seg)
+        segment_free(seg);
+      free(found);
+      return -1;
+    }
+  }
+  free(found);
+  return 0;
+}
+
+/* queries */
+
+// Returns the time of a segment's first record, or UINT64_MAX if it has none yet
+static uint64_t segment_first_time(segment_t *seg)
+{
+  if (atomic_load_explicit(&seg->index_count, memory_order_acquire) == 0)
+    return UINT64_MAX;
+  return seg->index[0].time_ms;
+}
+
+// Returns the offset in a segment to start scanning from to find the records at or after from_ms:
+// that of the last index entry before from_ms, since records between two entries are not indexed
+static size_t segment_seek(segment_t *seg, uint64_t from_ms)
+{
+  unsigned lo = 0, hi = atomic_load_explicit(&seg->index_count, memory_order_acquire);
+
+  while (lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    if (seg->index[mid].time_ms < from_ms) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo ? seg->index[lo - 1].offset : STORE_SEGMENT_HEADER;
+}
+
+// Copies the first max_msgs messages sent to a room from from_ms to to_ms (inclusive) into one
+// buffer of OPEN frames, each text prefixed with the time it was sent
+// Scans at most STORE_SCAN_MAX records; *truncated is set if it stopped before reaching to_ms
+// Sets *found to the number of messages copied
+// Returns NULL if there is nothing to send or memory could not be allocated
+static frame_buf_t *run_query(const char *room, uint64_t from_ms, uint64_t to_ms, unsigned max_msgs,
+                              unsigned *found, int *truncated)
+{
+  *found = 0;
+  *truncated = 0;
+  if (max_msgs == 0)
+    return NULL;
+
+  struct store_record *hits = malloc(max_msgs * sizeof(struct store_record));
+  if (hits == NULL)
+    return NULL;
+  size_t room_len = strlen(room);
+  unsigned n = 0;
+  unsigned long scanned = 0;
+  int past = 0;   // Set once a record after to_ms is reached
+
+  pthread_rwlock_rdlock(&segments_lock);
+
+  // Start in the last segment whose first record is before from_ms
+  unsigned lo = 0, hi = segment_count;
+  while (lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    if (segment_first_time(segments[mid]) < from_ms) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  for (unsigned i = lo ? lo - 1 : 0; i < segment_count && n < max_msgs && scanned < STORE_SCAN_MAX && !past; i++) {
+    segment_t *seg = segments[i];
+    size_t end = atomic_load_explicit(&seg->end, memory_order_acquire);
+    size_t off = segment_seek(seg, from_ms), len;
+    struct store_record r;
+
+    // end was read before the index, which may already point at records appended since
+    while (n < max_msgs && scanned < STORE_SCAN_MAX && off < end &&
+           (len = decode_record(seg->map + off, end - off, &r)) > 0) {
+      scanned++;
+      if (r.time_ms > to_ms) {
+        past = 1;
+        break;
+      }
+      if (r.time_ms >= from_ms && r.room_len == room_len && memcmp(r.room, room, room_len) == 0)
+        hits[n++] = r;
+      off += len;
+    }
+  }
+
+  // Stopped early unless a record past the range was reached or every record was scanned
+  *truncated = !past && (n == max_msgs || scanned == STORE_SCAN_MAX);
+
+  // Render the matches as OPEN frames from their senders, each text prefixed with its time
+  frame_buf_t *fb = NULL;
+  size_t total = 0;
+  for (unsigned i = 0; i < n; i++)
+    total += frame_length(hits[i].name_len, TIME_PREFIX + hits[i].text_len);
+  if (n > 0 && (fb = frame_buf_alloc(total)) != NULL) {
+    char *p = fb->data;
+    for (unsigned i = 0; i < n; i++) {
+      char stamp[TIME_PREFIX + 1];
+      time_t secs = (time_t)(hits[i].time_ms / 1000);
+      struct tm tm;
+      localtime_r(&secs, &tm);
+      strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S] ", &tm);
+
+      p += frame_encode_head(p, OPEN, hits[i].uid, hits[i].name, hits[i].name_len, TIME_PREFIX + hits[i].text_len);
+      memcpy(p, stamp, TIME_PREFIX);
+      memcpy(p + TIME_PREFIX, hits[i].text, hits[i].text_len);
+      p += TIME_PREFIX + hits[i].text_len;
+    }
+    *found = n;
+  }
+
+  pthread_rwlock_unlock(&segments_lock);
+  free(hits);
+  return fb;
+}
+
+// Query thread, runs the queries so scanning segments (and paging cold ones in) never holds up an event loop
+static void *query_main()
+{
+  pthread_mutex_lock(&jobs_lock);
+  for (;;) {
+    while (jobs_head == NULL && !jobs_stopping)
+      pthread_cond_wait(&jobs_cond, &jobs_lock);
+    if (jobs_stopping)
+      break;
+    store_job_t *job = jobs_head;
+    jobs_head = job->next;
+    if (jobs_head == NULL)
+      jobs_tail = NULL;
+    jobs_waiting--;
+    pthread_mutex_unlock(&jobs_lock);
+
+    unsigned found;
+    int truncated;
+    frame_buf_t *fb = run_query(job->room, job->from_ms, job->to_ms, job->max_msgs, &found, &truncated);
+    job->reply(fb, found, truncated, job->uid, job->shard);
+    if (fb)
+      frame_buf_release(fb);
+    free(job);
+
+    pthread_mutex_lock(&jobs_lock);
+  }
+  pthread_mutex_unlock(&jobs_lock);
+  frame_pool_drain();
+  return NULL;
+}
+
+int store_query_post(const char *room, uint64_t from_ms, uint64_t to_ms, unsigned max_msgs,
+                     store_reply_t reply, int uid, int shard)
+{
+  if (!running)
+    return -1;
+  store_job_t *job = calloc(1, sizeof(store_job_t));
+  if (job == NULL)
+    return -1;
+  snprintf(job->room, sizeof(job->room), "%s", room);
+  job->from_ms = from_ms;
+  job->to_ms = to_ms;
+  job->max_msgs = max_msgs;
+  job->reply = reply;
+  job->uid = uid;
+  job->shard = shard;
+
+  pthread_mutex_lock(&jobs_lock);
+  if (jobs_waiting >= QUERY_QUEUE) {
+    pthread_mutex_unlock(&jobs_lock);
+    free(job);
+    return -1;
+  }
+  if (jobs_tail) {
+    jobs_tail->next = job;
+  } else {
+    jobs_head = job;
+  }
+  jobs_tail = job;
+  jobs_waiting++;
+  pthread_cond_signal(&jobs_cond);
+  pthread_mutex_unlock(&jobs_lock);
+  return 0;
+}
+
+int store_open(const char *dir, size_t seg_size)
+{
+  segment_size = seg_size;
+  if ((store_dir = strdup(dir)) == NULL)
+    return -1;
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return -1;
+  if (recover_segments() < 0)
+    return -1;
+
+  // Start a new segment if the store is empty or the last one is too full to be worth appending to
+  segment_t *seg = active_segment();
+  if (seg && atomic_load(&seg->end) + MAX_RECORD > seg->map_size) {
+    if (roll_segment() < 0)
+      return -1;
+  } else if (seg == NULL) {
+    if ((seg = segment_create()) == NULL || segment_publish(seg) < 0)
+      return -1;
+  }
+  writer.ring_size = RING_SIZE;
+  writer.header_len = STORE_RECORD_HEADER_LENGTH;
+  writer.flush_ms = FLUSH_MS;
+  writer.record_len = record_len;
+  writer.record_time = record_time;
+  writer.take = take_record;
+  writer.batch_done = batch_done;
+  if (spsc_start(&writer) < 0)
+    return -1;
+
+  // The query thread never handles signals either
+  sigset_t all, old_mask;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old_mask);
+  int rc = pthread_create(&query_thread, NULL, &query_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  if (rc != 0) {
+    spsc_stop(&writer, &thread_ring);
+    return -1;
+  }
+
+  running = 1;
+  return 0;
+}
+
+void store_stats(unsigned long *records, unsigned *segs, unsigned long *dropped)
+{
+  pthread_rwlock_rdlock(&segments_lock);
+  *segs = segment_count;
+  pthread_rwlock_unlock(&segments_lock);
+  *records = atomic_load_explicit(&stored, memory_order_relaxed);
+  *dropped = atomic_load_explicit(&dropped_total, memory_order_relaxed);
+}
+
+void store_close()
+{
+  if (!running)
+    return;
+
+  // Queries still waiting get no answer, their clients are going away with the server
+  pthread_mutex_lock(&jobs_lock);
+  jobs_stopping = 1;
+  pthread_cond_signal(&jobs_cond);
+  pthread_mutex_unlock(&jobs_lock);
+  pthread_join(query_thread, NULL);
+  while (jobs_head) {
+    store_job_t *next = jobs_head->next;
+    free(jobs_head);
+    jobs_head = next;
+  }
+  jobs_tail = NULL;
+
+  spsc_stop(&writer, &thread_ring);
+  running = 0;
+
+  // The active segment is cut to its records too, it is extended again when the store is reopened
+  if (active_segment())
+    segment_seal(active_segment());
+  for (unsigned i = 0; i < segment_count; i++)
+    segment_free(segments[i]);
+  free(segments);
+  segments = NULL;
+  segment_count = segment_cap = 0;
+
+  free(store_dir);
+}
@@ -0,0 +1,98 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "framebuf.h"
+
+//////// MESSAGE STORE ////////
+//
+// Durable, append-only record of every message broadcast to a room. Event
+// loop threads never touch the disk: like the log (see logger.h) each thread
+// appends records to its own lock-free ring, and a background writer thread
+// drains the rings, numbers the records and copies them into the current
+// segment file, which is preallocated and memory mapped. Queries read the
+// mapped segments directly, so serving one costs no read() calls and the
+// messages themselves live in the page cache, not in the server's memory.
+//
+// Each segment keeps a sparse index with one entry per STORE_INDEX_INTERVAL
+// bytes of records, so a query by time finds its starting point with two
+// binary searches (over segments, then over the index) and only scans the
+// records in the range it asked for. The index of a full segment is saved
+// next to it and mapped back in on restart. Queries run on their own thread
+// and scan at most STORE_SCAN_MAX records each, so one client asking for a
+// long range of a busy store costs the event loops nothing.
+
+#define STORE_SEGMENT_MAGIC   "CHATSEG1"
+#define STORE_SEGMENT_HEADER  16            // Magic and the sequence number of the first record
+#define STORE_INDEX_INTERVAL  (16 * 1024)   // Bytes of records between two index entries
+#define STORE_MIN_SEGMENT     (1 << 20)     // Smallest segment size, a record never spans segments
+#define STORE_SCAN_MAX        (256 * 1024)  // Most records one query scans, however few match
+
+//////// SEGMENT FORMAT ////////
+//
+// A segment file "<first sequence number>.seg" starts with STORE_SEGMENT_MAGIC
+// and the sequence number of its first record (u64), followed by records:
+//
+//   +--------+----------+-----+------+-----+----------+----------+----------+---------+----------+------+
+//   | length | checksum | seq | time | uid | room_len | name_len | reserved | room... | name ... | text |
+//   |  u32   |   u32    | u64 | u64  | u32 |    u8    |    u8    |   u16    |         |          |      |
+//   +--------+----------+-----+------+-----+----------+----------+----------+---------+----------+------+
+//
+// Multi-byte fields are in network byte order. length covers the whole
+// record, time is in milliseconds since the Unix epoch and never decreases
+// from one record to the next, and checksum is the FNV-1a hash of everything
+// after it. After a crash, the last segment is cut at the first record that
+// does not check out. "<first sequence number>.idx" holds the sparse index
+// of a full segment, and is rebuilt from the segment if it is missing.
+
+#define STORE_RECORD_HEADER_LENGTH 32
+
+// A decoded record
+// room, name and text point into the segment the record was decoded from
+struct store_record {
+  uint64_t seq;
+  uint64_t time_ms;
+  uint32_t uid;
+  uint8_t room_len;
+  uint8_t name_len;
+  uint32_t text_len;
+  const char *room;
+  const char *name;
+  const char *text;
+};
+
+// Opens the store in a directory, recovering the segments already there, and starts the writer thread
+// New segments are preallocated to segment_size bytes
+// Returns -1 if the directory or a segment could not be opened or the thread could not start
+int store_open(const char *dir, size_t segment_size);
+
+// Appends a message broadcast to a room
+// Never blocks: if the calling thread's ring is full the message is dropped and counted
+void store_append(const char *room, uint32_t uid, const char *name, size_t name_len,
+                  const char *text, size_t text_len);
+
+// Called on the query thread with the result of a query: fb holds the messages found as OPEN frames,
+// each text prefixed with the time it was sent (NULL if none), and found their number. truncated is set
+// if the query stopped at max_msgs messages or STORE_SCAN_MAX records before the end of its range.
+// uid and shard are passed back as given to store_query_post(). reply must take its own reference to fb
+typedef void (*store_reply_t)(frame_buf_t *fb, unsigned found, int truncated, int uid, int shard);
+
+// Queues a query for the first max_msgs messages sent to a room from from_ms to to_ms (inclusive)
+// A query thread scans the segments, so the caller's event loop never waits on the disk
+// Returns -1 if the store is closed, memory could not be allocated or too many queries are waiting
+int store_query_post(const char *room, uint64_t from_ms, uint64_t to_ms, unsigned max_msgs,
+                     store_reply_t reply, int uid, int shard);
+
+// Reports the records stored, the number of segments and the records dropped
+void store_stats(unsigned long *records, unsigned *segments, unsigned long *dropped);
+
+// Writes out every message appended so far, stops the writer and closes the segments
+// Must only be called once no other thread is appending or querying
+void store_close();
+
+// Decodes the record at the start of buff
+// Returns the record's length, 0 if the bytes are not a complete, intact record
+size_t store_record_decode(const char *buff, size_t len, struct store_record *r);
+
+#endif
@@ -0,0 +1,148 @@
+#include <string.h>
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_DELTA ((1LL << (TIMER_BITS * TIMER_LEVELS)) - 1)   // Furthest tick the wheel can hold
+
+// Converts a time in ms to the tick it falls in, rounding up so timers never fire early
+static long long to_tick(long long ms)
+{
+  return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+// Links a timer into the slot its deadline falls in
+static void place(timer_wheel_t *w, wheel_timer_t *t)
+{
+  long long delta = t->expires - w->now;
+  int level = 0;
+  while (level < TIMER_LEVELS - 1 && delta >= 1LL << (TIMER_BITS * (level + 1)))
+    level++;
+
+  int slot = (int)((t->expires >> (TIMER_BITS * level)) & SLOT_MASK);
+  wheel_timer_t **head = &w->slots[level][slot];
+  t->level = (uint8_t)level;
+  t->slot = (uint8_t)slot;
+  t->next = *head;
+  if (*head)
+    (*head)->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+  w->occupied[level] |= 1ULL << slot;
+}
+
+// Unlinks a timer from its slot
+static void unlink_timer(timer_wheel_t *w, wheel_timer_t *t)
+{
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  if (w->slots[t->level][t->slot] == NULL)
+    w->occupied[t->level] &= ~(1ULL << t->slot);
+  t->pprev = NULL;
+  t->next = NULL;
+}
+
+// Empties a slot and returns its timers as a list
+static wheel_timer_t *take_slot(timer_wheel_t *w, int level, int slot)
+{
+  wheel_timer_t *list = w->slots[level][slot];
+  w->slots[level][slot] = NULL;
+  w->occupied[level] &= ~(1ULL << slot);
+  return list;
+}
+
+// Moves the timers of a higher level slot down to the levels that now cover them
+// Returns the slot index, so the caller knows whether this level wrapped around too
+static int cascade(timer_wheel_t *w, int level)
+{
+  int slot = (int)((w->now >> (TIMER_BITS * level)) & SLOT_MASK);
+  wheel_timer_t *t = take_slot(w, level, slot);
+  while (t) {
+    wheel_timer_t *next = t->next;
+    place(w, t);
+    t = next;
+  }
+  return slot;
+}
+
+void timer_wheel_init(timer_wheel_t *w, long long now_ms)
+{
+  memset(w, 0, sizeof(*w));
+  w->now = now_ms / TIMER_TICK_MS;
+}
+
+void timer_arm(timer_wheel_t *w, wheel_timer_t *t, long long expires_ms)
+{
+  if (t->pprev) {
+    unlink_timer(w, t);
+  } else {
+    w->count++;
+  }
+
+  long long tick = to_tick(expires_ms);
+  if (tick <= w->now)
+    tick = w->now + 1;
+  if (tick - w->now > MAX_DELTA)
+    tick = w->now + MAX_DELTA;
+  t->expires = tick;
+  place(w, t);
+}
+
+void timer_cancel(timer_wheel_t *w, wheel_timer_t *t)
+{
+  if (t->pprev == NULL)
+    return;
+  unlink_timer(w, t);
+  w->count--;
+}
+
+int timer_armed(const wheel_timer_t *t)
+{
+  return t->pprev != NULL;
+}
+
+void timer_wheel_advance(timer_wheel_t *w, long long now_ms, timer_fn fn, void *arg)
+{
+  long long target = now_ms / TIMER_TICK_MS;
+
+  // With nothing armed there is nothing to walk through
+  if (w->count == 0 && target > w->now)
+    w->now = target;
+
+  while (w->now < target) {
+    w->now++;
+    int slot = (int)(w->now & SLOT_MASK);
+    for (int level = 1; slot == 0 && level < TIMER_LEVELS; level++)
+      slot = cascade(w, level);
+
+    // Detach the slot first, so callbacks may arm timers (even the one firing) again
+    // The timers still to fire stay linked from a local head, so callbacks may also cancel them
+    wheel_timer_t *expired = take_slot(w, 0, (int)(w->now & SLOT_MASK));
+    if (expired)
+      expired->pprev = &expired;
+    while (expired) {
+      wheel_timer_t *t = expired;
+      expired = t->next;
+      if (expired)
+        expired->pprev = &expired;
+      t->pprev = NULL;
+      t->next = NULL;
+      w->count--;
+      fn(t, arg);
+    }
+  }
+}
+
+int timer_wheel_next(const timer_wheel_t *w, long long now_ms)
+{
+  if (w->count == 0)
+    return -1;
+
+  // Ticks from now until the next occupied level 0 slot, or until level 0 wraps around
+  int current = (int)(w->now & SLOT_MASK);
+  uint64_t ahead = current == SLOT_MASK ? 0 : w->occupied[0] >> (current + 1);
+  long long ticks = ahead ? __builtin_ctzll(ahead) + 1 : TIMER_SLOTS - current;
+
+  long long wait = (w->now + ticks) * TIMER_TICK_MS - now_ms;
+  return wait > 0 ? (int)wait : 0;
+}
@@ -0,0 +1,63 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_TICK_MS 100   // Resolution of the wheel, deadlines are rounded up to a tick
+#define TIMER_LEVELS  4     // Levels of the wheel
+#define TIMER_BITS    6     // Each level has 1 << TIMER_BITS slots
+#define TIMER_SLOTS   (1 << TIMER_BITS)
+
+// A deadline, embedded in the object it belongs to
+typedef struct wheel_timer {
+  struct wheel_timer *next;    // Neighbours in the wheel slot
+  struct wheel_timer **pprev;  // Link that points at this timer, NULL when the timer is not armed
+  long long expires;           // Tick at which the timer fires
+  uint8_t level;               // Where the timer sits in the wheel
+  uint8_t slot;
+} wheel_timer_t;
+
+// Hierarchical timer wheel
+//
+// Level 0 has one slot per tick for the next TIMER_SLOTS ticks, and each level
+// above has slots TIMER_SLOTS times wider. A timer goes into the lowest level
+// whose range covers its deadline, so arming and cancelling are O(1) list
+// operations no matter how many timers there are. Whenever level 0 wraps
+// around, the next slot of level 1 is emptied into the levels below (and so on
+// up the levels), which moves every timer down at most TIMER_LEVELS - 1 times
+// in its life. A bitmap of occupied slots per level lets the owner find out how
+// long it may sleep without walking the slots.
+//
+// A wheel is owned by one thread and takes no locks. Deadlines further out than
+// the wheel reaches (about 19 days) fire at its far edge.
+typedef struct {
+  long long now;                                        // Last tick processed
+  wheel_timer_t *slots[TIMER_LEVELS][TIMER_SLOTS];
+  uint64_t occupied[TIMER_LEVELS];                      // Bit set for each non empty slot
+  unsigned count;                                       // Armed timers
+} timer_wheel_t;
+
+// Called for each expired timer, which is no longer armed and may be armed again
+typedef void (*timer_fn)(wheel_timer_t *t, void *arg);
+
+// Starts an empty wheel at the given time (ms)
+void timer_wheel_init(timer_wheel_t *w, long long now_ms);
+
+// Arms a timer to fire at the given time (ms), moving it if it is already armed
+// A deadline that has already passed fires on the next tick
+void timer_arm(timer_wheel_t *w, wheel_timer_t *t, long long expires_ms);
+
+// Disarms a timer, does nothing if it is not armed
+void timer_cancel(timer_wheel_t *w, wheel_timer_t *t);
+
+// Returns non zero if a timer is armed
+int timer_armed(const wheel_timer_t *t);
+
+// Moves the wheel forward to the given time (ms), calling fn for every timer that expired
+void timer_wheel_advance(timer_wheel_t *w, long long now_ms, timer_fn fn, void *arg);
+
+// Returns how many ms the owner may sleep before the wheel needs to advance (-1 if no timer is armed)
+// Only timers in level 0 are exact, with none there the wait ends when level 0 wraps around
+int timer_wheel_next(const timer_wheel_t *w, long long now_ms);
+
+#endif
@@ -0,0 +1,368 @@
+#include <string.h>
+#include <errno.h>
+#include "uring.h"
+
+#ifdef NO_IO_URING
+
+int uring_init(uring_t *r, unsigned entries, unsigned buf_count, unsigned buf_size)
+{
+  (void)entries; (void)buf_count; (void)buf_size;
+  memset(r, 0, sizeof(uring_t));
+  r->fd = -1;
+  errno = ENOSYS;
+  return -1;
+}
+
+void uring_prep_accept(uring_t *r, int fd, int flags, int multishot, uint64_t user_data)
+{
+  (void)r; (void)fd; (void)flags; (void)multishot; (void)user_data;
+}
+
+void uring_prep_recv(uring_t *r, int fd, int multishot, uint64_t user_data)
+{
+  (void)r; (void)fd; (void)multishot; (void)user_data;
+}
+
+void uring_prep_sendmsg(uring_t *r, int fd, const struct msghdr *msg, int flags, uint64_t user_data)
+{
+  (void)r; (void)fd; (void)msg; (void)flags; (void)user_data;
+}
+
+void uring_prep_poll(uring_t *r, int fd, unsigned events, int multishot, uint64_t user_data)
+{
+  (void)r; (void)fd; (void)events; (void)multishot; (void)user_data;
+}
+
+void uring_prep_cancel(uring_t *r, uint64_t target, uint64_t user_data)
+{
+  (void)r; (void)target; (void)user_data;
+}
+
+int uring_wait(uring_t *r, int timeout_ms)
+{
+  (void)r; (void)timeout_ms;
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_peek(uring_t *r, uring_cqe_t *cqe)
+{
+  (void)r; (void)cqe;
+  return 0;
+}
+
+char *uring_cqe_buffer(const uring_t *r, const uring_cqe_t *cqe)
+{
+  (void)r; (void)cqe;
+  return NULL;
+}
+
+void uring_recycle(uring_t *r, const uring_cqe_t *cqe)
+{
+  (void)r; (void)cqe;
+}
+
+void uring_free(uring_t *r)
+{
+  (void)r;
+}
+
+#else
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define BUFFER_GROUP 0   // Group id of the provided receive buffers
+
+_Static_assert(URING_CQE_MORE == IORING_CQE_F_MORE, "URING_CQE_MORE must match the kernel's flag");
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+// Maps a region of the ring into memory
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Hands every buffer to the kernel
+static int setup_buffers(uring_t *r, unsigned buf_count, unsigned buf_size)
+{
+  r->buf_ring_size = buf_count * sizeof(struct io_uring_buf);
+  r->buf_ring = mmap(NULL, r->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->buf_ring == MAP_FAILED) {
+    r->buf_ring = NULL;
+    return -1;
+  }
+  r->bufs = malloc((size_t)buf_count * buf_size);
+  if (r->bufs == NULL)
+    return -1;
+  r->buf_count = buf_count;
+  r->buf_size = buf_size;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+  reg.ring_entries = buf_count;
+  reg.bgid = BUFFER_GROUP;
+  if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return -1;
+
+  struct io_uring_buf_ring *br = r->buf_ring;
+  for (unsigned i = 0; i < buf_count; i++) {
+    br->bufs[i].addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)i * buf_size);
+    br->bufs[i].len = buf_size;
+    br->bufs[i].bid = (uint16_t)i;
+  }
+  __atomic_store_n(&br->tail, (uint16_t)buf_count, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+int uring_init(uring_t *r, unsigned entries, unsigned buf_count, unsigned buf_size)
+{
+  struct io_uring_params p;
+
+  memset(r, 0, sizeof(uring_t));
+  memset(&p, 0, sizeof(p));
+
+  // Completions for multishot requests can outnumber submissions, leave them room
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+  p.cq_entries = entries * 4;
+  r->fd = sys_setup(entries, &p);
+  if (r->fd < 0 && errno == EINVAL) {
+    // Older kernel, try without the task run hints
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    r->fd = sys_setup(entries, &p);
+  }
+  if (r->fd < 0)
+    return -1;
+
+  // Waiting with a timeout needs EXT_ARG, and completions must never be dropped
+  if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+    uring_free(r);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq_ring = map_ring(r->fd, r->sq_ring_size, IORING_OFF_SQ_RING);
+  r->cq_ring = map_ring(r->fd, r->cq_ring_size, IORING_OFF_CQ_RING);
+  r->sqes = map_ring(r->fd, r->sqes_size, IORING_OFF_SQES);
+  if (r->sq_ring == NULL || r->cq_ring == NULL || r->sqes == NULL) {
+    uring_free(r);
+    return -1;
+  }
+
+  char *sq = r->sq_ring, *cq = r->cq_ring;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = cq + p.cq_off.cqes;
+  r->sq_entries = p.sq_entries;
+
+  if (setup_buffers(r, buf_count, buf_size) < 0) {
+    int err = errno;
+    uring_free(r);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+// Submits the queued requests without waiting
+static void submit(uring_t *r)
+{
+  if (r->pending == 0)
+    return;
+
+  int n = sys_enter(r->fd, r->pending, 0, 0, NULL, 0);
+  r->enters++;
+  if (n > 0)
+    r->pending -= n < (int)r->pending ? (unsigned)n : r->pending;
+}
+
+// Returns a zeroed submission entry, submitting what is queued if the ring is full
+static struct io_uring_sqe *get_sqe(uring_t *r)
+{
+  unsigned tail = *r->sq_tail;
+  while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+    submit(r);
+
+  unsigned index = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *)r->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+  return sqe;
+}
+
+// Publishes a filled in submission entry
+static void commit_sqe(uring_t *r)
+{
+  __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+  r->pending++;
+}
+
+void uring_prep_accept(uring_t *r, int fd, int flags, int multishot, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = get_sqe(r);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->accept_flags = flags;
+  sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+  sqe->user_data = user_data;
+  commit_sqe(r);
+}
+
+void uring_prep_recv(uring_t *r, int fd, int multishot, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = get_sqe(r);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+  sqe->user_data = user_data;
+  commit_sqe(r);
+}
+
+void uring_prep_sendmsg(uring_t *r, int fd, const struct msghdr *msg, int flags, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = get_sqe(r);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = flags;
+  sqe->user_data = user_data;
+  commit_sqe(r);
+}
+
+void uring_prep_poll(uring_t *r, int fd, unsigned events, int multishot, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = get_sqe(r);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data = user_data;
+  commit_sqe(r);
+}
+
+void uring_prep_cancel(uring_t *r, uint64_t target, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = get_sqe(r);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+  commit_sqe(r);
+}
+
+int uring_wait(uring_t *r, int timeout_ms)
+{
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+
+  memset(&arg, 0, sizeof(arg));
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  }
+
+  // Completions already waiting, only submit
+  unsigned wait = *r->cq_head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) ? 1 : 0;
+
+  int n = sys_enter(r->fd, r->pending, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  r->enters++;
+  if (n >= 0)
+    r->pending -= n < (int)r->pending ? (unsigned)n : r->pending;
+  return n < 0 ? -1 : 0;
+}
+
+int uring_peek(uring_t *r, uring_cqe_t *cqe)
+{
+  unsigned head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  const struct io_uring_cqe *c = (const struct io_uring_cqe *)r->cqes + (head & *r->cq_mask);
+  cqe->user_data = c->user_data;
+  cqe->res = c->res;
+  cqe->flags = c->flags;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+char *uring_cqe_buffer(const uring_t *r, const uring_cqe_t *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    return NULL;
+  return r->bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * r->buf_size;
+}
+
+void uring_recycle(uring_t *r, const uring_cqe_t *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    return;
+
+  struct io_uring_buf_ring *br = r->buf_ring;
+  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  uint16_t tail = br->tail;
+  struct io_uring_buf *buf = &br->bufs[tail & (r->buf_count - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * r->buf_size);
+  buf->len = r->buf_size;
+  buf->bid = (uint16_t)bid;
+  __atomic_store_n(&br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+void uring_free(uring_t *r)
+{
+  if (r->fd >= 0)
+    close(r->fd);
+  if (r->sq_ring)
+    munmap(r->sq_ring, r->sq_ring_size);
+  if (r->cq_ring)
+    munmap(r->cq_ring, r->cq_ring_size);
+  if (r->sqes)
+    munmap(r->sqes, r->sqes_size);
+  if (r->buf_ring)
+    munmap(r->buf_ring, r->buf_ring_size);
+  free(r->bufs);
+
+  unsigned long enters = r->enters;
+  memset(r, 0, sizeof(uring_t));
+  r->fd = -1;
+  r->enters = enters;   // kept for the statistics logged at shutdown
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+//////// IO_URING ////////
+//
+// A minimal io_uring wrapper on the raw system calls, just what the server's
+// io_uring backend needs: one submission/completion ring per event loop and
+// one ring of provided receive buffers. Requests are queued in the
+// submission ring and handed to the kernel in one io_uring_enter() together
+// with the wait for completions.
+//
+// Building with -DNO_IO_URING leaves the backend out, uring_init() then
+// always fails with ENOSYS.
+
+#define URING_CQE_MORE (1U << 1)   // The multishot request that completed stays armed (IORING_CQE_F_MORE)
+
+// One completed request
+typedef struct {
+  uint64_t user_data;   // Tag the request was submitted with
+  int res;              // Result, a negative errno on failure
+  unsigned flags;       // URING_CQE_MORE, and whether a provided buffer was used
+} uring_cqe_t;
+
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  void *sqes;
+  void *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned sq_entries;
+  unsigned pending;          // Requests queued since the last io_uring_enter()
+  unsigned long enters;      // io_uring_enter() calls made
+  void *buf_ring;            // Ring of provided receive buffers
+  size_t buf_ring_size;
+  char *bufs;                // buf_count buffers of buf_size bytes
+  unsigned buf_count;
+  unsigned buf_size;
+} uring_t;
+
+// Creates a ring with room for entries requests and registers buf_count
+// provided receive buffers of buf_size bytes (buf_count a power of two)
+// Returns -1 and sets errno if the kernel lacks io_uring or a needed feature
+int uring_init(uring_t *r, unsigned entries, unsigned buf_count, unsigned buf_size);
+
+// Queues a request, submitting what is already queued if the ring is full
+// Multishot requests keep completing until a completion lacks URING_CQE_MORE
+void uring_prep_accept(uring_t *r, int fd, int flags, int multishot, uint64_t user_data);
+void uring_prep_recv(uring_t *r, int fd, int multishot, uint64_t user_data);   // into a provided buffer
+void uring_prep_sendmsg(uring_t *r, int fd, const struct msghdr *msg, int flags, uint64_t user_data);
+void uring_prep_poll(uring_t *r, int fd, unsigned events, int multishot, uint64_t user_data);
+void uring_prep_cancel(uring_t *r, uint64_t target, uint64_t user_data);   // the request tagged target
+
+// Submits every queued request and waits up to timeout_ms (-1 for no limit) for a completion
+// Returns -1 and sets errno on failure, ETIME and EINTR included
+int uring_wait(uring_t *r, int timeout_ms);
+
+// Takes the oldest completion
+// Returns 0 if there is none
+int uring_peek(uring_t *r, uring_cqe_t *cqe);
+
+// Returns the provided buffer a completion received into, or NULL if it used none
+// The buffer must be given back with uring_recycle() once its bytes are consumed
+char *uring_cqe_buffer(const uring_t *r, const uring_cqe_t *cqe);
+void uring_recycle(uring_t *r, const uring_cqe_t *cqe);
+
+// Closes the ring, which cancels whatever is still in flight
+void uring_free(uring_t *r);
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "users.h"
+#include "intern.h"
+#include "metrics.h"
+
+typedef struct user {
+  int id;
+  int shard;
+  const char *name;            // Interned username
+  struct user *next_by_name;   // Next user on the same name chain
+  struct user *next_by_id;     // Next user on the same id chain
+} user_t;
+
+static user_t **by_name;
+static user_t **by_id;
+static unsigned buckets;   // Per hash, a power of two
+static unsigned count;     // Users in the index
+static pthread_rwlock_t users_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// FNV-1a hash of a username
+static unsigned hash_name(const char *name)
+{
+  unsigned h = 2166136261u;
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h & (buckets - 1);
+}
+
+// Spreads sequential ids over the table (Fibonacci hashing)
+static unsigned hash_id(int id)
+{
+  return ((unsigned)id * 2654435769u) & (buckets - 1);
+}
+
+int users_init(unsigned expected)
+{
+  buckets = USERS_MIN_BUCKETS;
+  while (buckets < expected && buckets < (1u << 30))
+    buckets <<= 1;
+  by_name = calloc(buckets, sizeof(user_t *));
+  by_id = calloc(buckets, sizeof(user_t *));
+  return by_name && by_id ? 0 : -1;
+}
+
+// Doubles both bucket arrays, called with the write lock held
+// Each new chain comes from one old chain, which is reversed first so the
+// newest user with a name stays at the front of its chain
+// Keeps the old arrays if the new ones cannot be allocated
+static void grow()
+{
+  user_t **names = calloc(buckets * 2, sizeof(user_t *));
+  user_t **ids = calloc(buckets * 2, sizeof(user_t *));
+  if (names == NULL || ids == NULL) {
+    free(names);
+    free(ids);
+    return;
+  }
+
+  unsigned old_buckets = buckets;
+  buckets *= 2;
+  for (unsigned i = 0; i < old_buckets; i++) {
+    user_t *reversed = NULL;
+    while (by_name[i]) {
+      user_t *u = by_name[i];
+      by_name[i] = u->next_by_name;
+      u->next_by_name = reversed;
+      reversed = u;
+    }
+    while (reversed) {
+      user_t *u = reversed;
+      unsigned n = hash_name(u->name);
+      reversed = u->next_by_name;
+      u->next_by_name = names[n];
+      names[n] = u;
+    }
+    while (by_id[i]) {
+      user_t *u = by_id[i];
+      unsigned n = hash_id(u->id);
+      by_id[i] = u->next_by_id;
+      u->next_by_id = ids[n];
+      ids[n] = u;
+    }
+  }
+  free(by_name);
+  free(by_id);
+  by_name = names;
+  by_id = ids;
+}
+
+int users_add(const char *name, int id, int shard)
+{
+  user_t *u = malloc(sizeof(user_t));
+  if (u == NULL)
+    return -1;
+
+  u->id = id;
+  u->shard = shard;
+  u->name = intern_retain(name);
+
+  // New users go to the front of their chains, so name lookups find the newest one
+  pthread_rwlock_wrlock(&users_lock);
+  long long locked = metrics_now_ns();
+  if (++count > buckets && buckets < (1u << 30))
+    grow();
+  unsigned n = hash_name(u->name), i = hash_id(id);
+  u->next_by_name = by_name[n];
+  by_name[n] = u;
+  u->next_by_id = by_id[i];
+  by_id[i] = u;
+  metrics_lock_held(locked);
+  pthread_rwlock_unlock(&users_lock);
+
+  return 0;
+}
+
+void users_remove(int id)
+{
+  pthread_rwlock_wrlock(&users_lock);
+  long long locked = metrics_now_ns();
+
+  user_t **link = &by_id[hash_id(id)];
+  while (*link && (*link)->id != id)
+    link = &(*link)->next_by_id;
+  user_t *u = *link;
+  if (u == NULL) {
+    metrics_lock_held(locked);
+    pthread_rwlock_unlock(&users_lock);
+    return;
+  }
+  *link = u->next_by_id;
+
+  link = &by_name[hash_name(u->name)];
+  while (*link != u)
+    link = &(*link)->next_by_name;
+  *link = u->next_by_name;
+  count--;
+
+  metrics_lock_held(locked);
+  pthread_rwlock_unlock(&users_lock);
+  intern_put(u->name);
+  free(u);
+}
+
+void users_remove_shard(int shard)
+{
+  user_t *removed = NULL;
+
+  pthread_rwlock_wrlock(&users_lock);
+  long long locked = metrics_now_ns();
+  for (unsigned i = 0; i < buckets; i++) {
+    user_t **link = &by_id[i];
+    while (*link) {
+      user_t *u = *link;
+      if (u->shard != shard) {
+        link = &u->next_by_id;
+        continue;
+      }
+      *link = u->next_by_id;
+
+      user_t **name_link = &by_name[hash_name(u->name)];
+      while (*name_link != u)
+        name_link = &(*name_link)->next_by_name;
+      *name_link = u->next_by_name;
+      count--;
+
+      u->next_by_id = removed;
+      removed = u;
+    }
+  }
+  metrics_lock_held(locked);
+  pthread_rwlock_unlock(&users_lock);
+
+  while (removed) {
+    user_t *next = removed->next_by_id;
+    intern_put(removed->name);
+    free(removed);
+    removed = next;
+  }
+}
+
+int users_find_name(const char *name, int *id)
+{
+  int shard = -1;
+
+  pthread_rwlock_rdlock(&users_lock);
+  long long locked = metrics_now_ns();
+  for (user_t *u = by_name[hash_name(name)]; u; u = u->next_by_name) {
+    if (strcmp(u->name, name) == 0) {
+      *id = u->id;
+      shard = u->shard;
+      break;
+    }
+  }
+  metrics_lock_held(locked);
+  pthread_rwlock_unlock(&users_lock);
+
+  return shard;
+}
+
+int users_find_id(int id)
+{
+  int shard = -1;
+
+  pthread_rwlock_rdlock(&users_lock);
+  long long locked = metrics_now_ns();
+  for (user_t *u = by_id[hash_id(id)]; u; u = u->next_by_id) {
+    if (u->id == id) {
+      shard = u->shard;
+      break;
+    }
+  }
+  metrics_lock_held(locked);
+  pthread_rwlock_unlock(&users_lock);
+
+  return shard;
+}
+
+void users_free()
+{
+  for (unsigned i = 0; i < buckets; i++) {
+    user_t *u = by_id[i];
+    while (u) {
+      user_t *next = u->next_by_id;
+      intern_put(u->name);
+      free(u);
+      u = next;
+    }
+  }
+  free(by_name);
+  free(by_id);
+  by_name = by_id = NULL;
+  buckets = count = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef USERS_H
+#define USERS_H
+
+// Server wide index of logged in users, by username and by client id
+//
+// Every shard owns its clients, so a direct message first has to find the
+// shard the target lives on. Users are hashed into bucket arrays by name
+// and by id, and each user sits on one chain of each, so adding, finding and
+// removing a user are all O(1) on average. The arrays are sized for the
+// expected number of users at startup and doubled whenever the users
+// outnumber the buckets, so chains stay short however many clients the
+// cluster holds. Lookups take a read lock and only logins and disconnects
+// take the write lock.
+//
+// Usernames need not be unique: looking up a name that several clients use
+// finds the one that logged in most recently.
+
+#define USERS_MIN_BUCKETS 4096   // Fewest buckets per hash, a power of two
+
+// Sizes the index for about expected users, before any is added
+// Returns -1 if memory could not be allocated
+int users_init(unsigned expected);
+
+// Adds a user that logged in on a shard
+// name must come from intern_get(), the index takes its own reference to it
+// Returns -1 if memory could not be allocated
+int users_add(const char *name, int id, int shard);
+
+// Removes the user with the given id
+void users_remove(int id);
+
+// Removes every user on a shard
+void users_remove_shard(int shard);
+
+// Finds the most recent user with the given name
+// Returns the user's shard and sets *id, or returns -1 if there is no such user
+int users_find_name(const char *name, int *id);
+
+// Returns the shard of the user with the given id, or -1 if there is no such user
+int users_find_id(int id);
+
+// Releases every user left in the index
+void users_free();
+
+#endif
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Checks that a room's history is replayed whichever shard a client lands on:
+# with two workers, one client posts to a room, then clients that connect
+# afterwards (the kernel spreads them over both shards) join it and must each
+# get the message back. --history is raised so the joiners' own notices do not
+# evict it.
+#
+# Usage: tests/history_workers.sh [port], from the top of the tree after make
+
+PORT=${1:-5399}
+JOINERS=16
+TOP=$(pwd)
+DIR=$(mktemp -d)
+trap 'kill -INT $SERVER 2>/dev/null; wait $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+client() {
+  "$TOP/chatclient" -j -h localhost -p "$PORT" -u "$1" -c cs3251secret --script -
+}
+
+(cd "$DIR" && exec "$TOP/chatserver" -s -p "$PORT" --workers 2 --history 200 > server.out 2>&1) &
+SERVER=$!
+sleep 0.5
+
+printf ':join history-test\nposted before anyone joined\n' | client poster > /dev/null
+
+failed=0
+i=1
+while [ $i -le $JOINERS ]; do
+  if ! printf ':join history-test\n' | client joiner$i | grep -q "posted before anyone joined"; then
+    echo "joiner$i got no history"
+    failed=$((failed + 1))
+  fi
+  i=$((i + 1))
+done
+
+if [ $failed -gt 0 ]; then
+  echo "FAIL: $failed of $JOINERS joiners got no history"
+  exit 1
+fi
+echo "PASS: all $JOINERS joiners got the history"